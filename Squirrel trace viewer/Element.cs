@@ -54,6 +54,8 @@ namespace Squirrel_trace_viewer
                 case JTokenType.String:
                     if (AObject.IsAddr((string)obj))
                         return new Reference(obj);
+                    else if (PooledString.IsPooled((string)obj))
+                        return new PooledString(obj);
                     else
                         return new String(obj);
 
@@ -81,9 +83,15 @@ namespace Squirrel_trace_viewer
         public AElement arg2 { get; }
         public AElement arg3 { get; }
 
-        public Instruction(JObject obj)
+        public Instruction(JObject obj, Dictionary<UInt32, string> names)
         {
-            fn = (string)obj["fn"];
+            // fn is the ID of a name record, or the file name in the older traces.
+            JToken fnToken = obj["fn"];
+            string name;
+            if (fnToken.Type == JTokenType.Integer)
+                fn = names.TryGetValue((UInt32)fnToken, out name) ? name : "(unknown)";
+            else
+                fn = (string)fnToken;
             op = (string)obj["op"];
             arg0 = AElement.Create(obj["arg0"]);
             arg1 = AElement.Create(obj["arg1"]);
@@ -196,6 +204,38 @@ namespace Squirrel_trace_viewer
         public bool Compare(string other) => this.value == other;
     }
 
+    // Reference to a string of the tracer string pool ("STRING:<id>").
+    class PooledString : AElement
+    {
+        const string head = "STRING:";
+
+        // Content of every pool ID, from the "string" records read so far.
+        public static Dictionary<UInt32, string> Pool = new Dictionary<UInt32, string>();
+
+        UInt32 id;
+        string value;
+
+        public static bool IsPooled(string str)
+        {
+            return str.Length > head.Length && str.Substring(0, head.Length).Equals(head);
+        }
+
+        public PooledString(JToken obj)
+        {
+            id = UInt32.Parse(((string)obj).Substring(head.Length));
+            value = null;
+        }
+
+        public override void Load(Dictionary<UInt32, AElement> objects)
+        {
+            if (value == null)
+                Pool.TryGetValue(id, out value);
+        }
+
+        public override JTokenType Type => JTokenType.String;
+        public override string Description() => value != null ? '"' + value + '"' : "<string " + id + " not loaded>";
+    }
+
     abstract class AObject : AElement
     {
         const string head = "POINTER:";
@@ -94,11 +94,23 @@ namespace Squirrel_trace_viewer
             JArray root = (JArray)rootToken;
             instructionsList = new List<Instruction>();
             Dictionary<UInt32, AElement> objects = new Dictionary<uint, AElement>();
+            Dictionary<UInt32, string> names = new Dictionary<uint, string>();
+            // Last content of every object, for the delta records.
+            Dictionary<UInt32, JToken> contents = new Dictionary<uint, JToken>();
+            PooledString.Pool = new Dictionary<uint, string>();
             foreach (JObject it in root)
             {
-                if ((string)it["type"] == "instruction")
+                if ((string)it["type"] == "name")
                 {
-                    Instruction instruction = new Instruction(it);
+                    names[(UInt32)it["id"]] = (string)it["name"];
+                }
+                else if ((string)it["type"] == "string")
+                {
+                    PooledString.Pool[(UInt32)it["id"]] = (string)it["value"];
+                }
+                else if ((string)it["type"] == "instruction")
+                {
+                    Instruction instruction = new Instruction(it, names);
                     instruction.Load(objects);
                     instructionsList.Add(instruction);
                 }
@@ -107,19 +119,67 @@ namespace Squirrel_trace_viewer
                     UInt32 addr = AObject.StrToAddr((string)it["address"]);
                     JToken content = it["content"];
                     if (content != null)
+                    {
                         objects[addr] = AElement.Create(content);
+                        contents[addr] = content;
+                    }
                     else
                     {
                         //Console.WriteLine("Invalid object " + addr + ": content is null.");
                         objects[addr] = new Null();
+                        contents.Remove(addr);
                     }
                 }
+                else if ((string)it["type"] == "delta")
+                {
+                    UInt32 addr = AObject.StrToAddr((string)it["address"]);
+                    JToken content;
+                    if (!contents.TryGetValue(addr, out content))
+                        continue;
+                    // The previous objects may still be displayed by older instructions.
+                    content = content.DeepClone();
+                    if (!ApplyDelta(content, it["content"]))
+                        continue;
+                    objects[addr] = AElement.Create(content);
+                    contents[addr] = content;
+                }
+                else if ((string)it["type"] == "freed")
+                {
+                    // The address may be reused by another object.
+                    UInt32 addr = AObject.StrToAddr((string)it["address"]);
+                    objects.Remove(addr);
+                    contents.Remove(addr);
+                }
             }
 
             grid.ItemsSource = instructionsList;
             return true;
         }
 
+        // Applies a delta record to the content of a table or array (see TraceFormat.h).
+        private static bool ApplyDelta(JToken content, JToken delta)
+        {
+            JArray elements = content as JArray;
+            if (elements == null && content.Type == JTokenType.Object)
+                elements = content["_nodes"] as JArray;
+            if (elements == null || delta == null)
+                return false;
+
+            int length = (int)delta["length"];
+            while (elements.Count > length)
+                elements.RemoveAt(elements.Count - 1);
+            while (elements.Count < length)
+                elements.Add(new JValue((object)null));
+            foreach (JArray change in delta["set"])
+            {
+                int index = (int)change[0];
+                if (index >= length)
+                    return false;
+                elements[index] = change[1];
+            }
+            return true;
+        }
+
         private void grid_SelectedCellsChanged(object sender, SelectedCellsChangedEventArgs e)
         {
             AElement obj = grid.SelectedItem as AElement;
@@ -0,0 +1,135 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Squirrel tracing plugin
+  *
+  * ----
+  *
+  * Compiled breakpoint parameters. Shared with the offline trace tools for the benchmarks.
+  * x86_reg_t must be defined before including this file.
+  */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+  * A breakpoint parameter from bp_info, like "esi", "ebp-0x10" or "[esp+4]", compiled into
+  * a register offset once so that the breakpoint doesn't look up and parse it on every hit.
+  * compile() returns false for the expressions it doesn't handle. They are left to thcrap.
+  */
+class BpExpression
+{
+public:
+	typedef decltype(((x86_reg_t*)nullptr)->eax) Register;
+
+	enum Kind : uint8_t
+	{
+		BPEXPR_INVALID,
+		BPEXPR_CONSTANT, // value
+		BPEXPR_REGISTER, // reg + value
+		BPEXPR_POINTER,  // [reg + value]
+	};
+
+private:
+	Kind kind;
+	size_t reg; // Offset of the register in x86_reg_t
+	size_t value;
+
+	bool compileRegister(const char *name)
+	{
+		static const struct {
+			const char *name;
+			size_t offset;
+		} registers[] = {
+			{ "eax", offsetof(x86_reg_t, eax) }, { "ebx", offsetof(x86_reg_t, ebx) },
+			{ "ecx", offsetof(x86_reg_t, ecx) }, { "edx", offsetof(x86_reg_t, edx) },
+			{ "esi", offsetof(x86_reg_t, esi) }, { "edi", offsetof(x86_reg_t, edi) },
+			{ "ebp", offsetof(x86_reg_t, ebp) }, { "esp", offsetof(x86_reg_t, esp) },
+		};
+		char lower[3];
+		for (int i = 0; i < 3; i++) {
+			lower[i] = (name[i] >= 'A' && name[i] <= 'Z') ? name[i] - 'A' + 'a' : name[i];
+		}
+		for (const auto& it : registers) {
+			if (memcmp(lower, it.name, 3) == 0) {
+				this->reg = it.offset;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Parses "reg", "reg+N" or "reg-N", with N in decimal or in hexadecimal with 0x.
+	bool compileSum(const char *expr, const char *end)
+	{
+		if (end - expr < 3 || !this->compileRegister(expr)) {
+			return false;
+		}
+		expr += 3;
+		this->value = 0;
+		if (expr == end) {
+			return true;
+		}
+		if (*expr != '+' && *expr != '-') {
+			return false;
+		}
+		bool negative = *expr++ == '-';
+		int base = 10;
+		if (end - expr > 2 && expr[0] == '0' && (expr[1] == 'x' || expr[1] == 'X')) {
+			base = 16;
+			expr += 2;
+		}
+		char *numberEnd;
+		unsigned long number = strtoul(expr, &numberEnd, base);
+		if (numberEnd == expr || numberEnd != end) {
+			return false;
+		}
+		this->value = negative ? 0 - (size_t)number : (size_t)number;
+		return true;
+	}
+
+public:
+	BpExpression() : kind(BPEXPR_INVALID), reg(0), value(0) {}
+
+	Kind type() const { return this->kind; }
+
+	void constant(size_t value)
+	{
+		this->kind = BPEXPR_CONSTANT;
+		this->value = value;
+	}
+
+	bool compile(const char *expr)
+	{
+		this->kind = BPEXPR_INVALID;
+		size_t len = strlen(expr);
+		if (len > 2 && expr[0] == '[' && expr[len - 1] == ']') {
+			if (this->compileSum(expr + 1, expr + len - 1)) {
+				this->kind = BPEXPR_POINTER;
+			}
+		}
+		else if (this->compileSum(expr, expr + len)) {
+			this->kind = BPEXPR_REGISTER;
+		}
+		return this->kind != BPEXPR_INVALID;
+	}
+
+	size_t eval(x86_reg_t *regs) const
+	{
+		size_t address;
+		switch (this->kind) {
+		case BPEXPR_CONSTANT:
+			return this->value;
+		case BPEXPR_REGISTER:
+			return (size_t)*(Register*)((char*)regs + this->reg) + this->value;
+		case BPEXPR_POINTER:
+			address = (size_t)*(Register*)((char*)regs + this->reg) + this->value;
+			return *(size_t*)address;
+		default:
+			return 0;
+		}
+	}
+};
@@ -2,33 +2,62 @@
 
 ClosureDB::ClosureDB()
 	: lastClosure(nullptr)
-{}
+{
+	this->lastNames.file = this->names.intern("/");
+	this->lastNames.function = this->names.intern("(anonymous)");
+	this->lastFile = this->lastNames.file;
+}
 
 
 ClosureDB::~ClosureDB()
 {}
 
-const std::string& ClosureDB::get(SQClosure *closure)
+uint32_t ClosureDB::functionName(SQClosure *closure)
+{
+	const SQObjectPtr& name = closure->_function->_name;
+	return this->names.intern(name._type == OT_STRING ? name._unVal.pString->_val : "(anonymous)");
+}
+
+const ClosureNames& ClosureDB::get(SQClosure *closure)
 {
 	// The last result is cached (that's the one we want 99% of the time).
 	if (closure == this->lastClosure) {
-		return this->lastClosureFn;
+		return this->lastNames;
 	}
 	// Special case: the 1st closure isn't loaded from a file and don't have a file name.
 	if (this->empty()) {
-		return (*this)[closure] = "/";
+		ClosureNames names = { this->names.intern("/"), this->functionName(closure) };
+		return (*this)[closure] = names;
 	}
 	this->lastClosure = closure;
 
 	// Try to find the closure
-	auto& it = this->find(closure);
-	if (it != this->end()) {
-		this->lastClosureFn = it->second;
-		return it->second;
+	ClosureNames *names = this->find(closure);
+	if (names) {
+		this->lastNames = *names;
+		return this->lastNames;
 	}
 
 	// Create a new closure.
 	// This is probably the result of a Closure instruction, so we'll use the file name from the previous instruction.
-	(*this)[closure] = this->lastClosureFn;
-	return this->lastClosureFn;
+	this->lastNames.function = this->functionName(closure);
+	(*this)[closure] = this->lastNames;
+	return this->lastNames;
+}
+
+void ClosureDB::load(SQClosure *closure)
+{
+	ClosureNames names = { this->lastFile, this->functionName(closure) };
+	(*this)[closure] = names;
+	if (closure == this->lastClosure) {
+		this->lastNames = names;
+	}
+}
+
+void ClosureDB::erase(SQClosure *closure)
+{
+	if (closure == this->lastClosure) {
+		this->lastClosure = nullptr;
+	}
+	FlatPtrMap::erase(closure);
 }
@@ -0,0 +1,77 @@
+#include "Squirrel tracer.h"
+
+// Merges patch into config. The nested objects are merged too, so a client can change
+// a single filter list without repeating the others.
+static void merge_config(json_t *config, json_t *patch)
+{
+	const char *key;
+	json_t *value;
+	json_object_foreach(patch, key, value) {
+		json_t *current = json_object_get(config, key);
+		if (json_is_object(current) && json_is_object(value)) {
+			merge_config(current, value);
+		}
+		else {
+			json_object_set(config, key, value);
+		}
+	}
+}
+
+static std::string config_mode(json_t *config)
+{
+	const char *mode = json_string_value(json_object_get(config, "mode"));
+	return mode ? mode : "trace";
+}
+
+void SquirrelTracer::apply_control(TraceControlBlock *control)
+{
+	char text[TRACE_CONTROL_CONFIG_SIZE];
+	memcpy(text, control->config, sizeof(text));
+	text[sizeof(text) - 1] = '\0';
+	// The client can write the next config as soon as the flag is cleared.
+	control->state &= ~CONTROL_CONFIG_PENDING;
+
+	json_error_t error;
+	json_t *patch = json_loadb(text, strlen(text), 0, &error);
+	if (!patch) {
+		log_printf("Squirrel tracer: invalid config from the control block (line %d: %s).\n", error.line, error.text);
+		control->configsApplied++;
+		return;
+	}
+	if (!json_is_object(patch)) {
+		log_printf("Squirrel tracer: the config from the control block isn't an object.\n");
+		json_decref(patch);
+		control->configsApplied++;
+		return;
+	}
+
+	EnterCriticalSection(&this->cs);
+	std::string oldMode = config_mode(this->config);
+	merge_config(this->config, patch);
+	if (json_object_get(patch, "filters")) {
+		this->filter.load(this->config);
+	}
+	if (json_object_get(patch, "sampling")) {
+		this->sampler.load(this->config);
+	}
+	if (json_object_get(patch, "deltas")) {
+		this->load_delta_config(this->config);
+	}
+	if (json_object_get(patch, "mode") && config_mode(this->config) != oldMode) {
+		// Starts a new trace, profile or flight recorder with the whole config.
+		// Before the first traced instruction, the first one will use the new config.
+		if (this->started) {
+			this->set_mode(this->config);
+		}
+	}
+	else if (json_object_get(patch, "frames") && this->writer) {
+		this->traceFrames = json_is_true(json_object_get(this->config, "frames"));
+		// Frames opened while the tracking was off would never get their exit event.
+		this->frameStacks.clear();
+	}
+	LeaveCriticalSection(&this->cs);
+	json_decref(patch);
+
+	log_printf("Squirrel tracer: config changed through the control block: %s\n", text);
+	control->configsApplied++;
+}
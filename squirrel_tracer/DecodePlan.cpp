@@ -0,0 +1,525 @@
+#include <Squirrel tracer.h>
+
+enum	ArgType
+{
+	ARG_NONE = 0x0000,
+	ARG_STACK = 0x0001,
+	ARG_LITERAL = 0x0002,
+	ARG_IMMEDIATE = 0x0004,
+	ARG_UNKNOWN = 0x0008, // Just display its value
+
+	MASK_FLOAT = 0x0010,
+	MASK_CMP = 0x0020,
+	MASK_BITWISE = 0x0040,
+	MASK_SIGNED = 0x0080,
+	MASK_TARGET = 0x0100,
+	MASK_STACKBASE = 0x0200, // Base address for a range of values on the stack. The next argument contains the number of stack elements to use.
+
+	ARG_FLOAT = ARG_IMMEDIATE | MASK_FLOAT,
+	ARG_CMP = ARG_IMMEDIATE | MASK_CMP,
+	ARG_BITWISE = ARG_IMMEDIATE | MASK_BITWISE,
+	ARG_SIGNED = ARG_IMMEDIATE | MASK_SIGNED,
+	ARG_TARGET = ARG_STACK | MASK_TARGET,
+	ARG_TARGET_OFF = ARG_STACK | MASK_TARGET | MASK_SIGNED, // Offset to a stackbase
+	ARG_STACKBASE = ARG_STACK | MASK_STACKBASE,
+};
+
+struct	OpcodeDescriptor
+{
+	const char*	name;
+	ArgType	arg0;
+	ArgType	arg1;
+	ArgType	arg2;
+	ArgType	arg3;
+};
+
+// Indexed by opcode. A constant array: it is built by the compiler, not at startup.
+static const OpcodeDescriptor	opcodes[] = {
+  { "line",		ARG_NONE,	ARG_IMMEDIATE,	ARG_NONE,	ARG_NONE },
+  { "load",		ARG_TARGET,	ARG_LITERAL,	ARG_NONE,	ARG_NONE },
+  { "loadint",		ARG_TARGET,	ARG_IMMEDIATE,	ARG_NONE,	ARG_NONE },
+  { "loadfloat",	ARG_TARGET,	ARG_FLOAT,	ARG_NONE,	ARG_NONE },
+  { "dload",		ARG_TARGET,	ARG_LITERAL,	ARG_TARGET,	ARG_LITERAL },
+  { "tailcall",		ARG_NONE,	ARG_STACK,	ARG_STACKBASE,	ARG_IMMEDIATE },
+  { "call",		ARG_TARGET_OFF,	ARG_STACK,	ARG_STACKBASE,	ARG_IMMEDIATE },
+  { "prepcall",		ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_TARGET },
+  { "prepcallk",	ARG_TARGET,	ARG_LITERAL,	ARG_STACK,	ARG_TARGET },
+  { "getk",		ARG_TARGET,	ARG_LITERAL,	ARG_STACK,	ARG_NONE },
+  { "move",		ARG_TARGET,	ARG_STACK,	ARG_NONE,	ARG_NONE },
+  { "newslot",		ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_TARGET },
+  { "delete",		ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_NONE },
+  { "set",		ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_STACK },
+  { "get",		ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_NONE },
+  { "eq",		ARG_TARGET,	ARG_UNKNOWN,	ARG_STACK,	ARG_IMMEDIATE }, // arg1 type: arg3 != 0 ? LITERAL : STACK
+  { "ne",		ARG_TARGET,	ARG_UNKNOWN,	ARG_STACK,	ARG_IMMEDIATE }, // arg1 type: arg3 != 0 ? LITERAL : STACK
+  { "add",		ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_NONE },
+  { "sub",		ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_NONE },
+  { "mul",	        ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_NONE },
+  { "div",	        ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_NONE },
+  { "mod",	        ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_NONE },
+  { "bitw",	        ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_BITWISE },
+  { "return",		ARG_IMMEDIATE,	ARG_UNKNOWN,	ARG_NONE,	ARG_NONE }, // If arg0 is not 0xFF, arg1 is a STACK. Else, it isn't used.
+  { "loadnulls",	ARG_TARGET,	ARG_IMMEDIATE,	ARG_NONE,	ARG_NONE }, // arg0 is a target and a stackbase.
+  { "loadroot",		ARG_TARGET,	ARG_NONE,	ARG_NONE,	ARG_NONE },
+  { "loadbool",		ARG_TARGET,	ARG_IMMEDIATE,	ARG_NONE,	ARG_NONE },
+  { "dmove",		ARG_TARGET,	ARG_STACK,	ARG_TARGET,	ARG_STACK },
+  { "jmp",		ARG_NONE,	ARG_SIGNED,	ARG_NONE,	ARG_NONE },
+  { "jcmp",		ARG_STACK,	ARG_SIGNED,	ARG_STACK,	ARG_CMP },
+  { "jz",		ARG_STACK,	ARG_SIGNED,	ARG_NONE,	ARG_NONE },
+  { "setouter",		ARG_TARGET,	ARG_IMMEDIATE,	ARG_STACK,	ARG_NONE }, // arg1 is an outer value
+  { "getouter",		ARG_TARGET,	ARG_IMMEDIATE,	ARG_NONE,	ARG_NONE }, // arg1 is an outer value
+  { "newobj",		ARG_TARGET,	ARG_UNKNOWN,	ARG_UNKNOWN,	ARG_IMMEDIATE /* enum NewObjectType */ }, // arg1 and arg2 depends on arg3
+  { "appendarray",	ARG_STACK,	ARG_UNKNOWN,	ARG_IMMEDIATE /* enum AppendArrayType */,	ARG_NONE }, // The type of arg1 depends on arg2
+  { "comparith",	ARG_TARGET,	ARG_UNKNOWN,	ARG_STACK,	ARG_UNKNOWN }, // arg1 is the object and value stack positions, arg3 is an operator
+  { "inc",		ARG_STACK,	ARG_STACK,	ARG_STACK,	ARG_SIGNED },
+  { "incl",		ARG_NONE,	ARG_STACK,	ARG_NONE,	ARG_SIGNED },
+  { "pinc",		ARG_STACK,	ARG_STACK,	ARG_STACK,	ARG_SIGNED },
+  { "pincl",		ARG_NONE,	ARG_STACK,	ARG_NONE,	ARG_SIGNED },
+  { "cmp",		ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_CMP },
+  { "exists",		ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_NONE },
+  { "instanceof",	ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_NONE },
+  { "and",		ARG_TARGET,	ARG_SIGNED,	ARG_STACK,	ARG_NONE },
+  { "or",		ARG_TARGET,	ARG_SIGNED,	ARG_STACK,	ARG_NONE },
+  { "neg",		ARG_TARGET,	ARG_STACK,	ARG_NONE,	ARG_NONE },
+  { "not",		ARG_TARGET,	ARG_STACK,	ARG_NONE,	ARG_NONE },
+  { "bwnot",		ARG_TARGET,	ARG_STACK,	ARG_NONE,	ARG_NONE },
+  { "closure",		ARG_TARGET,	ARG_IMMEDIATE,	ARG_NONE,	ARG_NONE }, // arg1 is a function
+  { "yield",		ARG_IMMEDIATE,	ARG_STACK,	ARG_IMMEDIATE,	ARG_NONE }, // arg0 is 0xFF for a yield without a value. Else, arg1 is a STACK. arg2 is a stack offset.
+  { "resume",		ARG_TARGET,	ARG_STACK,	ARG_NONE,	ARG_NONE },
+  { "foreach",		ARG_STACK,	ARG_SIGNED,	ARG_STACK,	ARG_NONE },
+  { "postforeach",	ARG_STACK,	ARG_SIGNED,	ARG_NONE,	ARG_NONE },
+  { "clone",		ARG_TARGET,	ARG_STACK,	ARG_NONE,	ARG_NONE },
+  { "typeof",		ARG_TARGET,	ARG_STACK,	ARG_NONE,	ARG_NONE },
+  { "pushtrap",		ARG_IMMEDIATE,	ARG_IMMEDIATE,	ARG_NONE,	ARG_NONE },
+  { "poptrap",		ARG_IMMEDIATE,	ARG_NONE,	ARG_NONE,	ARG_NONE },
+  { "throw",		ARG_STACK,	ARG_NONE,	ARG_NONE,	ARG_NONE },
+  { "newslota",		ARG_IMMEDIATE,	ARG_STACK,	ARG_STACK,	ARG_STACK },
+  { "getbase",		ARG_TARGET,	ARG_NONE,	ARG_NONE,	ARG_NONE },
+  { "close",		ARG_NONE,	ARG_STACK,	ARG_NONE,	ARG_NONE }
+};
+
+static ArgPlan plan_arg(SQFunctionProto *proto, ArgType type, uint32_t arg)
+{
+	ArgPlan plan;
+	plan.kind = PLAN_VALUE;
+	plan.count = 0;
+
+	switch (type) {
+	case ARG_NONE:
+		break;
+
+	case ARG_STACK:
+		plan.kind = PLAN_STACK;
+		plan.value = TraceValue(TV_INTEGER, (int32_t)arg);
+		break;
+
+	case ARG_LITERAL:
+		// By index: the plan may outlive the literals array if the function is freed unnoticed.
+		plan.kind = PLAN_LITERAL;
+		plan.value = TraceValue(TV_INTEGER, (int32_t)arg);
+		break;
+
+	case ARG_IMMEDIATE:
+		plan.value = TraceValue(TV_INTEGER, (int32_t)arg);
+		break;
+
+	case ARG_UNKNOWN:
+		plan.value = TraceValue("(arg_type not supported yet)");
+		break;
+
+	case ARG_FLOAT:
+		float farg;
+		memcpy(&farg, &arg, 4);
+		plan.value = TraceValue(farg);
+		break;
+
+	case ARG_CMP: {
+		static const char *names[] = {
+			"CMP_G",
+			nullptr,
+			"CMP_GE",
+			"CMP_L",
+			"CMP_LE",
+			"CMP_3W"
+		};
+		const char* name = "UNKNOWN";
+		if (arg >= 0 && arg <= 5 && names[arg])
+			name = names[arg];
+		plan.value = TraceValue(name);
+		break;
+	}
+
+	case ARG_BITWISE: {
+		static const char *names[] = {
+			"BW_AND",
+			nullptr,
+			"BW_OR",
+			"BW_XOR",
+			"BW_SHIFTL",
+			"BW_SHIFTR",
+			"BW_USHIFTR"
+		};
+		const char* name = "UNKNOWN";
+		if (arg >= 0 && arg <= 6 && names[arg])
+			name = names[arg];
+		plan.value = TraceValue(name);
+		break;
+	}
+
+	case ARG_SIGNED: {
+		int32_t sarg;
+		memcpy(&sarg, &arg, 4);
+		plan.value = TraceValue(TV_INTEGER, sarg);
+		break;
+	}
+
+	case ARG_TARGET:
+	case ARG_TARGET_OFF:
+		plan.value = TraceValue("TARGET");
+		break;
+
+	case ARG_STACKBASE:
+		plan.value = TraceValue("(ARG_STACKBASE without a count)");
+		break;
+
+	default:
+		plan.value = TraceValue("(error in the instructions table)");
+		break;
+	}
+	return plan;
+}
+
+static ArgPlan plan_none()
+{
+	ArgPlan plan;
+	plan.kind = PLAN_VALUE;
+	plan.count = 0;
+	return plan;
+}
+
+static ArgPlan plan_value(const TraceValue& value)
+{
+	ArgPlan plan = plan_none();
+	plan.value = value;
+	return plan;
+}
+
+/**
+  * Generic encoder: the arguments are decoded as described by the opcodes table.
+  * An ARG_STACKBASE argument takes the next argument as its number of stack elements.
+  */
+static void plan_args(SQFunctionProto *proto, const OpcodeDescriptor& desc, const SQInstruction *_i_, InstructionPlan& plan)
+{
+	ArgType types[4] = { desc.arg0, desc.arg1, desc.arg2, desc.arg3 };
+	uint32_t values[4] = { _i_->_arg0, (uint32_t)_i_->_arg1, _i_->_arg2, _i_->_arg3 };
+
+	for (int i = 0; i < 4; i++) {
+		if (types[i] == ARG_STACKBASE && i < 3) {
+			plan.args[i].kind = PLAN_RANGE;
+			plan.args[i].count = (uint8_t)values[i + 1];
+			plan.args[i].value = TraceValue(TV_INTEGER, (int32_t)values[i]);
+			plan.args[i + 1] = plan_none();
+			i++;
+		}
+		else {
+			plan.args[i] = plan_arg(proto, types[i], values[i]);
+		}
+	}
+}
+
+/**
+  * Per-opcode encoders. They only depend on the bytecode, so they run once per instruction of a function
+  * (see SquirrelTracer::get_plan), and the values are fetched by SquirrelTracer::add_instruction.
+  * The opcodes without a specialization use the opcodes table.
+  */
+template<int op>
+static void plan_op(SQFunctionProto *proto, const SQInstruction *_i_, InstructionPlan& plan)
+{
+	plan_args(proto, opcodes[op], _i_, plan);
+}
+
+// arg1 is a literal if arg3 != 0, a stack position otherwise.
+static void plan_eq_ne(SQFunctionProto *proto, const SQInstruction *_i_, InstructionPlan& plan)
+{
+	plan.args[0] = plan_arg(proto, ARG_TARGET, _i_->_arg0);
+	plan.args[1] = plan_arg(proto, _i_->_arg3 ? ARG_LITERAL : ARG_STACK, _i_->_arg1);
+	plan.args[2] = plan_arg(proto, ARG_STACK, _i_->_arg2);
+	plan.args[3] = plan_none();
+}
+template<> void plan_op<_OP_EQ>(SQFunctionProto *proto, const SQInstruction *_i_, InstructionPlan& plan) { plan_eq_ne(proto, _i_, plan); }
+template<> void plan_op<_OP_NE>(SQFunctionProto *proto, const SQInstruction *_i_, InstructionPlan& plan) { plan_eq_ne(proto, _i_, plan); }
+
+// arg1 is only used if arg0 isn't 0xFF.
+template<int op>
+static void plan_return_yield(SQFunctionProto *proto, const SQInstruction *_i_, InstructionPlan& plan)
+{
+	plan_args(proto, opcodes[op], _i_, plan);
+	plan.args[1] = plan_arg(proto, _i_->_arg0 != 0xFF ? ARG_STACK : ARG_NONE, _i_->_arg1);
+}
+template<> void plan_op<_OP_RETURN>(SQFunctionProto *proto, const SQInstruction *_i_, InstructionPlan& plan) { plan_return_yield<_OP_RETURN>(proto, _i_, plan); }
+template<> void plan_op<_OP_YIELD>(SQFunctionProto *proto, const SQInstruction *_i_, InstructionPlan& plan) { plan_return_yield<_OP_YIELD>(proto, _i_, plan); }
+
+// The outer values belong to the closure, not to the function.
+template<int op>
+static void plan_outer(SQFunctionProto *proto, const SQInstruction *_i_, InstructionPlan& plan)
+{
+	plan_args(proto, opcodes[op], _i_, plan);
+	plan.args[1].kind = PLAN_OUTER;
+	plan.args[1].count = 0;
+	plan.args[1].value = TraceValue(TV_INTEGER, (int32_t)_i_->_arg1);
+}
+template<> void plan_op<_OP_GETOUTER>(SQFunctionProto *proto, const SQInstruction *_i_, InstructionPlan& plan) { plan_outer<_OP_GETOUTER>(proto, _i_, plan); }
+template<> void plan_op<_OP_SETOUTER>(SQFunctionProto *proto, const SQInstruction *_i_, InstructionPlan& plan) { plan_outer<_OP_SETOUTER>(proto, _i_, plan); }
+
+/**
+  * Tables and arrays: arg1 is the initial size.
+  * Classes: arg1 is the base class (-1 if none) and arg2 the attributes (MAX_FUNC_STACKSIZE if none).
+  */
+template<> void plan_op<_OP_NEWOBJ>(SQFunctionProto *proto, const SQInstruction *_i_, InstructionPlan& plan)
+{
+	plan.args[0] = plan_arg(proto, ARG_TARGET, _i_->_arg0);
+	switch (_i_->_arg3) {
+	case NOT_TABLE:
+	case NOT_ARRAY:
+		plan.args[1] = plan_arg(proto, ARG_IMMEDIATE, _i_->_arg1);
+		plan.args[2] = plan_none();
+		plan.args[3] = plan_value(TraceValue(_i_->_arg3 == NOT_TABLE ? "NOT_TABLE" : "NOT_ARRAY"));
+		break;
+
+	case NOT_CLASS:
+		plan.args[1] = plan_arg(proto, _i_->_arg1 != -1 ? ARG_STACK : ARG_NONE, _i_->_arg1);
+		plan.args[2] = plan_arg(proto, _i_->_arg2 != MAX_FUNC_STACKSIZE ? ARG_STACK : ARG_NONE, _i_->_arg2);
+		plan.args[3] = plan_value(TraceValue("NOT_CLASS"));
+		break;
+
+	default:
+		plan_args(proto, opcodes[_OP_NEWOBJ], _i_, plan);
+		break;
+	}
+}
+
+template<> void plan_op<_OP_APPENDARRAY>(SQFunctionProto *proto, const SQInstruction *_i_, InstructionPlan& plan)
+{
+	static const char *names[] = {
+		"AAT_STACK",
+		"AAT_LITERAL",
+		"AAT_INT",
+		"AAT_FLOAT",
+		"AAT_BOOL"
+	};
+
+	plan.args[0] = plan_arg(proto, ARG_STACK, _i_->_arg0);
+	switch (_i_->_arg2) {
+	case AAT_STACK:
+		plan.args[1] = plan_arg(proto, ARG_STACK, _i_->_arg1);
+		break;
+	case AAT_LITERAL:
+		plan.args[1] = plan_arg(proto, ARG_LITERAL, _i_->_arg1);
+		break;
+	case AAT_INT:
+		plan.args[1] = plan_arg(proto, ARG_SIGNED, _i_->_arg1);
+		break;
+	case AAT_FLOAT:
+		plan.args[1] = plan_arg(proto, ARG_FLOAT, _i_->_arg1);
+		break;
+	case AAT_BOOL:
+		plan.args[1] = plan_value(TraceValue(TV_BOOL, _i_->_arg1 != 0));
+		break;
+	default:
+		plan.args[1] = plan_arg(proto, ARG_UNKNOWN, _i_->_arg1);
+		break;
+	}
+	plan.args[2] = _i_->_arg2 <= AAT_BOOL ? plan_value(TraceValue(names[_i_->_arg2])) : plan_arg(proto, ARG_IMMEDIATE, _i_->_arg2);
+	plan.args[3] = plan_none();
+}
+
+// Compound arithmetic on a member (a.b += c): arg0 is the target, arg1 holds the position of the object (a)
+// in its high 16 bits and the position of the value (c) in its low 16 bits, arg2 is the position of the key (b),
+// and arg3 is the operator.
+template<> void plan_op<_OP_COMPARITH>(SQFunctionProto *proto, const SQInstruction *_i_, InstructionPlan& plan)
+{
+	uint32_t target = _i_->_arg0;
+	uint32_t objectAndValue = (uint32_t)_i_->_arg1;
+	uint32_t key = _i_->_arg2;
+	uint8_t op = _i_->_arg3;
+
+	plan.args[0] = plan_arg(proto, ARG_TARGET, target);
+	// Written as [object, value].
+	plan.args[1].kind = PLAN_PAIR;
+	plan.args[1].count = 2;
+	plan.args[1].value = TraceValue(TV_INTEGER, (int32_t)objectAndValue);
+	plan.args[2] = plan_arg(proto, ARG_STACK, key);
+
+	const char *name = nullptr;
+	switch (op) {
+	case '+': name = "+"; break;
+	case '-': name = "-"; break;
+	case '*': name = "*"; break;
+	case '/': name = "/"; break;
+	case '%': name = "%"; break;
+	}
+	plan.args[3] = name ? plan_value(TraceValue(name)) : plan_arg(proto, ARG_IMMEDIATE, op);
+}
+
+/**
+  * OP_CLOSURE will often be called with self->ci (or an object in it) being garbage.
+  * Even with all these NULL checks, if self->ci is 0x00000003 (it happened), well... I can't do anything but crash.
+  * So I'll just fallback to the default case that says "arg1 is an integer".
+
+case _OP_CLOSURE: {
+	json_object_set_new(instruction, "arg0", arg_to_json(self, file, desc->arg0, _i_->_arg0));
+	SQObjectPtr *functions = nullptr;
+	if (self->ci) {
+		if (self->ci->_closure._type == OT_CLOSURE) {
+			SQClosure *closure = self->ci->_closure._unVal.pClosure;
+			if (closure->_function) {
+				functions = closure->_function->_functions;
+			}
+		}
+	}
+	if (functions) {
+		json_object_set_new(instruction, "arg1", add_obj(file, &functions[_i_->_arg1]));
+	}
+	else {
+		json_object_set_new(instruction, "arg2", json_string("<null>"));
+	}
+	json_object_set_new(instruction, "arg2", arg_to_json(self, file, desc->arg2, _i_->_arg2));
+	json_object_set_new(instruction, "arg3", arg_to_json(self, file, desc->arg3, _i_->_arg3));
+	break;
+}
+*/
+
+typedef void (*OpcodePlanner)(SQFunctionProto *proto, const SQInstruction *_i_, InstructionPlan& plan);
+
+// Jump table, indexed by opcode like the opcodes table.
+static const OpcodePlanner planners[] = {
+	plan_op<_OP_LINE>, plan_op<_OP_LOAD>, plan_op<_OP_LOADINT>, plan_op<_OP_LOADFLOAT>,
+	plan_op<_OP_DLOAD>, plan_op<_OP_TAILCALL>, plan_op<_OP_CALL>, plan_op<_OP_PREPCALL>,
+	plan_op<_OP_PREPCALLK>, plan_op<_OP_GETK>, plan_op<_OP_MOVE>, plan_op<_OP_NEWSLOT>,
+	plan_op<_OP_DELETE>, plan_op<_OP_SET>, plan_op<_OP_GET>, plan_op<_OP_EQ>,
+	plan_op<_OP_NE>, plan_op<_OP_ADD>, plan_op<_OP_SUB>, plan_op<_OP_MUL>,
+	plan_op<_OP_DIV>, plan_op<_OP_MOD>, plan_op<_OP_BITW>, plan_op<_OP_RETURN>,
+	plan_op<_OP_LOADNULLS>, plan_op<_OP_LOADROOT>, plan_op<_OP_LOADBOOL>, plan_op<_OP_DMOVE>,
+	plan_op<_OP_JMP>, plan_op<_OP_JCMP>, plan_op<_OP_JZ>, plan_op<_OP_SETOUTER>,
+	plan_op<_OP_GETOUTER>, plan_op<_OP_NEWOBJ>, plan_op<_OP_APPENDARRAY>, plan_op<_OP_COMPARITH>,
+	plan_op<_OP_INC>, plan_op<_OP_INCL>, plan_op<_OP_PINC>, plan_op<_OP_PINCL>,
+	plan_op<_OP_CMP>, plan_op<_OP_EXISTS>, plan_op<_OP_INSTANCEOF>, plan_op<_OP_AND>,
+	plan_op<_OP_OR>, plan_op<_OP_NEG>, plan_op<_OP_NOT>, plan_op<_OP_BWNOT>,
+	plan_op<_OP_CLOSURE>, plan_op<_OP_YIELD>, plan_op<_OP_RESUME>, plan_op<_OP_FOREACH>,
+	plan_op<_OP_POSTFOREACH>, plan_op<_OP_CLONE>, plan_op<_OP_TYPEOF>, plan_op<_OP_PUSHTRAP>,
+	plan_op<_OP_POPTRAP>, plan_op<_OP_THROW>, plan_op<_OP_NEWSLOTA>, plan_op<_OP_GETBASE>,
+	plan_op<_OP_CLOSE>
+};
+static_assert(sizeof(planners) / sizeof(planners[0]) == sizeof(opcodes) / sizeof(opcodes[0]),
+	"The planners table must have one entry per opcode");
+
+const char *opcode_name(uint8_t op)
+{
+	if (op >= sizeof(opcodes) / sizeof(opcodes[0])) {
+		return nullptr;
+	}
+	return opcodes[op].name;
+}
+
+static void plan_instruction(SQFunctionProto *proto, const SQInstruction *_i_, InstructionPlan& plan)
+{
+	plan.op = _i_->op;
+	if (_i_->op >= sizeof(opcodes) / sizeof(opcodes[0])) {
+		plan.name = "(unknown opcode)";
+		for (int i = 0; i < 4; i++) {
+			plan.args[i] = plan_value(TraceValue("(error in the instructions table)"));
+		}
+		return;
+	}
+	plan.name = opcodes[_i_->op].name;
+	planners[_i_->op](proto, _i_, plan);
+}
+
+const DecodePlan& SquirrelTracer::get_plan(SQFunctionProto *proto)
+{
+	// Without the sq_vm_free hook, a plan may belong to a freed function whose address was reused.
+	DecodePlan *plan = this->plans.find(proto);
+	if (plan && plan->size() == (size_t)proto->_ninstructions) {
+		return *plan;
+	}
+
+	// The cached pointer is invalidated by the insertion.
+	this->lastProto = nullptr;
+	plan = &this->plans[proto];
+	plan->clear();
+	plan->resize(proto->_ninstructions);
+	for (SQInteger i = 0; i < proto->_ninstructions; i++) {
+		plan_instruction(proto, &proto->_instructions[i], (*plan)[i]);
+	}
+	return *plan;
+}
+
+void SquirrelTracer::load_closure(SQClosure *closure)
+{
+	EnterCriticalSection(&this->cs);
+	this->closureDB.load(closure);
+	this->filter.erase(closure);
+	if (this->usePlans) {
+		// The nested functions are loaded at the same time.
+		std::vector<SQFunctionProto*> protos(1, closure->_function);
+		while (!protos.empty()) {
+			SQFunctionProto *proto = protos.back();
+			protos.pop_back();
+			this->get_plan(proto);
+			for (SQInteger i = 0; i < proto->_nfunctions; i++) {
+				if (proto->_functions[i]._type == OT_FUNCPROTO) {
+					protos.push_back(proto->_functions[i]._unVal.pFunctionProto);
+				}
+			}
+		}
+	}
+	LeaveCriticalSection(&this->cs);
+}
+
+const InstructionPlan& SquirrelTracer::find_plan(SQInstruction *_i_)
+{
+	SQFunctionProto *proto = this->vm->ci->_closure._unVal.pClosure->_function;
+	if (this->usePlans) {
+		if (proto != this->lastProto) {
+			this->lastPlan = &this->get_plan(proto);
+			this->lastProto = proto;
+		}
+		// The opcode check catches the plans of a reused address with the same instruction count.
+		size_t index = _i_ - proto->_instructions;
+		if (index < this->lastPlan->size() && (*this->lastPlan)[index].op == _i_->op) {
+			return (*this->lastPlan)[index];
+		}
+	}
+	plan_instruction(proto, _i_, this->tmpPlan);
+	return this->tmpPlan;
+}
+
+TraceValue SquirrelTracer::plan_to_value(const ArgPlan& arg)
+{
+	switch (arg.kind) {
+	case PLAN_STACK:
+		return add_STK(arg.value.i);
+
+	case PLAN_LITERAL:
+		return add_obj(&this->vm->ci->_closure._unVal.pClosure->_function->_literals[arg.value.i]);
+
+	case PLAN_OUTER:
+		return add_obj(&this->vm->ci->_closure._unVal.pClosure->_outervalues[arg.value.i]);
+
+	case PLAN_RANGE:
+		this->instruction.array.clear();
+		for (int i = arg.value.i; i < arg.value.i + arg.count; i++) {
+			this->instruction.array.push_back(add_STK(i));
+		}
+		return TraceValue(TV_ARRAY, (int32_t)this->instruction.array.size());
+
+	case PLAN_PAIR:
+		this->instruction.array.clear();
+		this->instruction.array.push_back(add_STK((uint32_t)arg.value.i >> 16));
+		this->instruction.array.push_back(add_STK(arg.value.i & 0xFFFF));
+		return TraceValue(TV_ARRAY, 2);
+
+	default:
+		return arg.value;
+	}
+}
@@ -0,0 +1,186 @@
+#include "Squirrel tracer.h"
+
+struct OpcodeClass
+{
+	const char *name;
+	uint8_t opcodes[16];
+	size_t count;
+};
+
+// Classes usable in the "opcodes" filters, in addition to the opcode names.
+static const OpcodeClass opcodeClasses[] = {
+	{ "load", { _OP_LOAD, _OP_LOADINT, _OP_LOADFLOAT, _OP_DLOAD, _OP_LOADNULLS, _OP_LOADROOT, _OP_LOADBOOL,
+		_OP_MOVE, _OP_DMOVE }, 9 },
+	{ "call", { _OP_TAILCALL, _OP_CALL, _OP_PREPCALL, _OP_PREPCALLK, _OP_RETURN, _OP_YIELD, _OP_RESUME }, 7 },
+	{ "access", { _OP_GETK, _OP_GET, _OP_SET, _OP_NEWSLOT, _OP_NEWSLOTA, _OP_DELETE, _OP_EXISTS,
+		_OP_GETOUTER, _OP_SETOUTER, _OP_GETBASE }, 10 },
+	{ "arith", { _OP_ADD, _OP_SUB, _OP_MUL, _OP_DIV, _OP_MOD, _OP_BITW, _OP_NEG, _OP_BWNOT,
+		_OP_INC, _OP_INCL, _OP_PINC, _OP_PINCL, _OP_COMPARITH }, 13 },
+	{ "compare", { _OP_EQ, _OP_NE, _OP_CMP, _OP_AND, _OP_OR, _OP_NOT, _OP_INSTANCEOF, _OP_TYPEOF }, 8 },
+	{ "jump", { _OP_JMP, _OP_JCMP, _OP_JZ, _OP_FOREACH, _OP_POSTFOREACH }, 5 },
+	{ "object", { _OP_NEWOBJ, _OP_APPENDARRAY, _OP_CLOSURE, _OP_CLONE, _OP_CLOSE }, 5 },
+	{ "exception", { _OP_PUSHTRAP, _OP_POPTRAP, _OP_THROW }, 3 },
+	{ "debug", { _OP_LINE }, 1 },
+};
+
+bool wildcard_match(const char *pattern, const char *str, bool ignoreCase)
+{
+	const char *star = nullptr;
+	const char *starStr = nullptr;
+
+	while (*str) {
+		char p = *pattern;
+		char c = *str;
+		if (ignoreCase) {
+			p = (char)tolower((unsigned char)p);
+			c = (char)tolower((unsigned char)c);
+		}
+		if (p == '*') {
+			star = pattern++;
+			starStr = str;
+		}
+		else if (p == '?' || (p != '\0' && p == c)) {
+			pattern++;
+			str++;
+		}
+		else if (star) {
+			// Let the last star match one more character.
+			pattern = star + 1;
+			str = ++starStr;
+		}
+		else {
+			return false;
+		}
+	}
+	while (*pattern == '*') {
+		pattern++;
+	}
+	return *pattern == '\0';
+}
+
+static void load_patterns(json_t *list, std::vector<std::string>& patterns)
+{
+	size_t i;
+	json_t *it;
+	json_array_foreach(list, i, it) {
+		const char *pattern = json_string_value(it);
+		if (pattern) {
+			patterns.push_back(pattern);
+		}
+	}
+}
+
+void TraceFilter::PatternList::load(json_t *config, bool ignoreCase)
+{
+	this->ignoreCase = ignoreCase;
+	load_patterns(json_object_get(config, "include"), this->include);
+	load_patterns(json_object_get(config, "exclude"), this->exclude);
+}
+
+bool TraceFilter::PatternList::traced(const char *str) const
+{
+	bool included = this->include.empty();
+	for (const std::string& pattern : this->include) {
+		if (wildcard_match(pattern.c_str(), str, this->ignoreCase)) {
+			included = true;
+			break;
+		}
+	}
+	if (!included) {
+		return false;
+	}
+	for (const std::string& pattern : this->exclude) {
+		if (wildcard_match(pattern.c_str(), str, this->ignoreCase)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void TraceFilter::loadOpcodes(json_t *list, bool value)
+{
+	size_t i;
+	json_t *it;
+	json_array_foreach(list, i, it) {
+		const char *name = json_string_value(it);
+		if (!name) {
+			continue;
+		}
+
+		bool found = false;
+		for (const OpcodeClass& opClass : opcodeClasses) {
+			if (strcmp(opClass.name, name) == 0) {
+				for (size_t j = 0; j < opClass.count; j++) {
+					this->opcodes[opClass.opcodes[j]] = value;
+				}
+				found = true;
+			}
+		}
+		for (int op = 0; op < 256 && opcode_name(op); op++) {
+			if (strcmp(opcode_name(op), name) == 0) {
+				this->opcodes[op] = value;
+				found = true;
+			}
+		}
+		if (!found) {
+			log_printf("Squirrel tracer: unknown opcode or opcode class \"%s\" in the filters.\n", name);
+		}
+	}
+}
+
+TraceFilter::TraceFilter(json_t *config)
+	: lastClosure(nullptr), lastTraced(true)
+{
+	this->load(config);
+}
+
+void TraceFilter::load(json_t *config)
+{
+	this->files = PatternList();
+	this->functions = PatternList();
+	this->closures.clear();
+	this->lastClosure = nullptr;
+	this->lastTraced = true;
+
+	json_t *filters = json_object_get(config, "filters");
+	this->files.load(json_object_get(filters, "files"), true);
+	this->functions.load(json_object_get(filters, "functions"), false);
+
+	json_t *opcodes = json_object_get(filters, "opcodes");
+	json_t *include = json_object_get(opcodes, "include");
+	bool includeAll = json_array_size(include) == 0;
+	for (int op = 0; op < 256; op++) {
+		this->opcodes[op] = includeAll;
+	}
+	this->loadOpcodes(include, true);
+	this->loadOpcodes(json_object_get(opcodes, "exclude"), false);
+}
+
+bool TraceFilter::closureTraced(SQClosure *closure, ClosureDB& closureDB)
+{
+	if (this->files.empty() && this->functions.empty()) {
+		return true;
+	}
+	if (closure == this->lastClosure) {
+		return this->lastTraced;
+	}
+
+	bool *traced = this->closures.find(closure);
+	if (!traced) {
+		SQFunctionProto *proto = closure->_function;
+		const char *name = proto->_name._type == OT_STRING ? proto->_name._unVal.pString->_val : "";
+		bool value = this->files.traced(closureDB.file(closure).str) && this->functions.traced(name);
+		traced = &(this->closures[closure] = value);
+	}
+	this->lastClosure = closure;
+	this->lastTraced = *traced;
+	return this->lastTraced;
+}
+
+void TraceFilter::erase(SQClosure *closure)
+{
+	if (closure == this->lastClosure) {
+		this->lastClosure = nullptr;
+	}
+	this->closures.erase(closure);
+}
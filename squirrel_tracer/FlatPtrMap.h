@@ -0,0 +1,244 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Squirrel tracing plugin
+  *
+  * ----
+  *
+  * Open-addressing hash table keyed by object address.
+  * Shared with the offline trace tools.
+  */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <new>
+#include <utility>
+
+/**
+  * Linear probing with a load factor of at most 1/2, so a lookup almost always
+  * needs a single probe. The keys are stored in their own array, which keeps the probes
+  * cache-friendly; nullptr marks an empty slot and can't be used as a key.
+  * Erasing uses backward shift deletion, so there are no tombstones.
+  * Pointers to the values are invalidated by any insertion or erase.
+  */
+template<typename K, typename V>
+class FlatPtrMap
+{
+private:
+	K *keys;
+	V *values; // Only the slots with a key hold a constructed value
+	size_t capacity; // Power of 2
+	size_t shift;
+	size_t count;
+
+	FlatPtrMap(const FlatPtrMap&) = delete;
+	FlatPtrMap& operator=(const FlatPtrMap&) = delete;
+
+	// Fibonacci hashing: the multiplication moves the entropy of the address to the high bits.
+	size_t home(K key) const
+	{
+		uint64_t x = (uint64_t)(uintptr_t)key;
+		uint32_t h = (uint32_t)(x ^ (x >> 32)) * 2654435769u;
+		return this->shift < 32 ? (size_t)(h >> this->shift) : 0;
+	}
+
+	void allocate(size_t capacity)
+	{
+		this->capacity = capacity;
+		this->shift = 32;
+		for (size_t i = capacity; i > 1; i >>= 1) {
+			this->shift--;
+		}
+		this->keys = (K*)calloc(capacity, sizeof(K));
+		this->values = (V*)malloc(capacity * sizeof(V));
+		this->count = 0;
+	}
+
+	void grow()
+	{
+		K *oldKeys = this->keys;
+		V *oldValues = this->values;
+		size_t oldCapacity = this->capacity;
+
+		this->allocate(oldCapacity * 2);
+		for (size_t i = 0; i < oldCapacity; i++) {
+			if (oldKeys[i]) {
+				size_t j = this->probe(oldKeys[i]);
+				this->keys[j] = oldKeys[i];
+				new (&this->values[j]) V(std::move(oldValues[i]));
+				oldValues[i].~V();
+				this->count++;
+			}
+		}
+		free(oldKeys);
+		free(oldValues);
+	}
+
+	void moveSlot(size_t from, size_t to)
+	{
+		this->keys[to] = this->keys[from];
+		new (&this->values[to]) V(std::move(this->values[from]));
+		this->values[from].~V();
+		this->keys[from] = nullptr;
+	}
+
+	// Slot holding key, or the empty slot where it would be inserted.
+	size_t probe(K key) const
+	{
+		size_t mask = this->capacity - 1;
+		size_t i = this->home(key);
+		while (this->keys[i] && this->keys[i] != key) {
+			i = (i + 1) & mask;
+		}
+		return i;
+	}
+
+	void eraseSlot(size_t i)
+	{
+		size_t mask = this->capacity - 1;
+		this->values[i].~V();
+		this->keys[i] = nullptr;
+		this->count--;
+
+		// Move back the next entries of the cluster that can't be reached anymore.
+		for (size_t j = (i + 1) & mask; this->keys[j]; j = (j + 1) & mask) {
+			size_t k = this->home(this->keys[j]);
+			bool reachable = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+			if (reachable) {
+				continue;
+			}
+			this->moveSlot(j, i);
+			i = j;
+		}
+	}
+
+public:
+	FlatPtrMap(size_t capacity = 16)
+	{
+		size_t c = 16;
+		while (c < capacity * 2) {
+			c *= 2;
+		}
+		this->allocate(c);
+	}
+
+	~FlatPtrMap()
+	{
+		this->clear();
+		free(this->keys);
+		free(this->values);
+	}
+
+	size_t size() const { return this->count; }
+	bool empty() const { return this->count == 0; }
+
+	V *find(K key)
+	{
+		size_t i = this->probe(key);
+		return this->keys[i] ? &this->values[i] : nullptr;
+	}
+
+	// Inserts a default-constructed value if the key isn't there.
+	V& operator[](K key)
+	{
+		size_t i = this->probe(key);
+		if (this->keys[i]) {
+			return this->values[i];
+		}
+		if ((this->count + 1) * 2 > this->capacity) {
+			this->grow();
+			i = this->probe(key);
+		}
+		this->keys[i] = key;
+		new (&this->values[i]) V();
+		this->count++;
+		return this->values[i];
+	}
+
+	// Inserts value if the key isn't there. Returns the value stored for the key.
+	V& insert(K key, V&& value)
+	{
+		size_t i = this->probe(key);
+		if (this->keys[i]) {
+			return this->values[i];
+		}
+		if ((this->count + 1) * 2 > this->capacity) {
+			this->grow();
+			i = this->probe(key);
+		}
+		this->keys[i] = key;
+		new (&this->values[i]) V(std::move(value));
+		this->count++;
+		return this->values[i];
+	}
+
+	bool erase(K key)
+	{
+		size_t i = this->probe(key);
+		if (!this->keys[i]) {
+			return false;
+		}
+		this->eraseSlot(i);
+		return true;
+	}
+
+	// Bulk erase: removes every entry for which pred(key, value) is true, in place.
+	// Returns the number of erased entries.
+	template<typename Pred>
+	size_t erase_if(Pred pred)
+	{
+		size_t erased = 0;
+		for (size_t i = 0; i < this->capacity; i++) {
+			if (this->keys[i] && pred(this->keys[i], this->values[i])) {
+				this->values[i].~V();
+				this->keys[i] = nullptr;
+				erased++;
+			}
+		}
+		if (erased == 0) {
+			return 0;
+		}
+		this->count -= erased;
+
+		// Close the holes left in the clusters. Starting after an empty slot, the clusters are walked in order,
+		// so every entry moved back lands in its final slot.
+		size_t mask = this->capacity - 1;
+		size_t start = 0;
+		while (this->keys[start]) {
+			start++;
+		}
+		for (size_t n = 1; n <= this->capacity; n++) {
+			size_t i = (start + n) & mask;
+			if (this->keys[i]) {
+				size_t j = this->probe(this->keys[i]);
+				if (j != i) {
+					this->moveSlot(i, j);
+				}
+			}
+		}
+		return erased;
+	}
+
+	void clear()
+	{
+		for (size_t i = 0; i < this->capacity; i++) {
+			if (this->keys[i]) {
+				this->values[i].~V();
+				this->keys[i] = nullptr;
+			}
+		}
+		this->count = 0;
+	}
+
+	// Calls f(key, value) for every entry.
+	template<typename F>
+	void for_each(F f)
+	{
+		for (size_t i = 0; i < this->capacity; i++) {
+			if (this->keys[i]) {
+				f(this->keys[i], this->values[i]);
+			}
+		}
+	}
+};
@@ -0,0 +1,133 @@
+#include "Squirrel tracer.h"
+
+FlightRecorder::FlightRecorder(json_t *config, const std::string& suffix)
+	: files(0)
+{
+	json_t *flight = json_object_get(config, "flight_recorder");
+
+	// Buffer size in MB
+	json_int_t bufferSizeMB = json_integer_value(json_object_get(flight, "buffer_size"));
+	if (bufferSizeMB <= 0) {
+		bufferSizeMB = 4;
+	}
+	this->recorderOutput = new FlightRecorderOutput((size_t)bufferSizeMB * 1024 * 1024);
+
+	const char *file = json_string_value(json_object_get(flight, "file"));
+	this->fileBase = (file ? file : "flight") + suffix;
+	json_int_t maxFiles = json_integer_value(json_object_get(flight, "max_files"));
+	this->maxFiles = maxFiles > 0 ? (unsigned int)maxFiles : 16;
+	this->onExit = !json_is_false(json_object_get(flight, "on_exit"));
+
+	memset(this->triggerOps, 0, sizeof(this->triggerOps));
+	json_t *opcodes = json_object_get(flight, "trigger_opcodes");
+	if (!opcodes) {
+		this->triggerOps[_OP_THROW] = true;
+	}
+	size_t i;
+	json_t *it;
+	json_array_foreach(opcodes, i, it) {
+		const char *name = json_string_value(it);
+		bool found = false;
+		for (int op = 0; name && op < 256 && opcode_name(op); op++) {
+			if (strcmp(opcode_name(op), name) == 0) {
+				this->triggerOps[op] = true;
+				found = true;
+			}
+		}
+		if (!found) {
+			log_printf("Squirrel tracer: unknown opcode \"%s\" in the flight recorder triggers.\n", name ? name : "");
+		}
+	}
+	json_array_foreach(json_object_get(flight, "trigger_functions"), i, it) {
+		const char *name = json_string_value(it);
+		if (name) {
+			this->triggerFunctions.push_back(name);
+		}
+	}
+}
+
+const char *FlightRecorder::trigger(SQVM *vm, const SQInstruction *_i_)
+{
+	if (this->triggerOps[_i_->op]) {
+		return opcode_name(_i_->op);
+	}
+	if (this->triggerFunctions.empty()) {
+		return nullptr;
+	}
+
+	// The function triggers fire on the first instruction of the function.
+	SQFunctionProto *proto = vm->ci->_closure._unVal.pClosure->_function;
+	if (_i_ != proto->_instructions) {
+		return nullptr;
+	}
+	bool *triggered = this->functionTriggers.find(proto);
+	if (!triggered) {
+		const char *name = proto->_name._type == OT_STRING ? proto->_name._unVal.pString->_val : "";
+		bool value = false;
+		for (const std::string& pattern : this->triggerFunctions) {
+			value = value || wildcard_match(pattern.c_str(), name, false);
+		}
+		triggered = &(this->functionTriggers[proto] = value);
+	}
+	return *triggered ? "function" : nullptr;
+}
+
+FILE *FlightRecorder::openFile(std::string& fn)
+{
+	if (this->files >= this->maxFiles) {
+		return nullptr;
+	}
+	this->files++;
+	char name[MAX_PATH];
+	_snprintf(name, MAX_PATH, "%s-%u.bin", this->fileBase.c_str(), this->files);
+	name[MAX_PATH - 1] = '\0';
+	fn = name;
+	return fopen(name, "wb");
+}
+
+void SquirrelTracer::prune_flight_objs()
+{
+	std::vector<uint32_t> pointers;
+	this->flight->output()->pointers(pointers);
+	FlatPtrMap<void*, bool> referenced(pointers.size());
+	for (uint32_t address : pointers) {
+		referenced[(void*)(uintptr_t)address] = true;
+	}
+	this->flightObjs.erase_if([&referenced](void *o, TrackedObject&) { return referenced.find(o) == nullptr; });
+	// The buffer is parsed again once the map doubled, so the pruning cost is amortized.
+	this->flightObjsLimit = this->flightObjs.size() * 2 > 65536 ? this->flightObjs.size() * 2 : 65536;
+}
+
+void SquirrelTracer::flush_flight_recorder(const char *reason)
+{
+	EnterCriticalSection(&this->cs);
+	std::string fn;
+	FILE *file = this->flight->openFile(fn);
+	if (!file) {
+		LeaveCriticalSection(&this->cs);
+		return;
+	}
+
+	FlightRecorderOutput *output = this->flight->output();
+	output->beginFlush(file);
+
+	// Dump the referenced objects still alive, and everything they reference.
+	// The snapshots are dropped first, so that every object is written.
+	// Without the sq_vm_free hook, a recorded address may have been freed or reused since.
+	this->flushing = true;
+	this->objs_list.erase_if([](void*, ObjectDump&) { return true; });
+	if (++this->objEpoch == 0) {
+		this->objEpoch = 1;
+	}
+	this->prune_flight_objs();
+	this->queue_live_objects(this->flightObjs);
+	this->dump_pending_objs();
+	this->objs_list.erase_if([](void*, ObjectDump&) { return true; });
+	this->flightObjs.clear();
+	this->flushing = false;
+
+	output->endFlush();
+	fclose(file);
+	log_printf("Squirrel tracer: flight recorder written to %s (trigger: %s).\n", fn.c_str(), reason);
+	LeaveCriticalSection(&this->cs);
+}
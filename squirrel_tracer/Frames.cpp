@@ -0,0 +1,70 @@
+#include "Squirrel tracer.h"
+
+SquirrelTracer::Frame SquirrelTracer::frame_of(const SQObjectPtr& closure)
+{
+	Frame frame;
+	frame.closure = closure._unVal.pRefCounted;
+
+	if (closure._type == OT_CLOSURE) {
+		frame.fn = this->closureDB.file(closure._unVal.pClosure);
+		frame.name = this->closureDB.function(closure._unVal.pClosure);
+		return frame;
+	}
+
+	// A native function called by a script, which called a script in turn.
+	NameTable& names = this->closureDB.names;
+	frame.fn = names.name("(native)");
+	if (closure._type == OT_NATIVECLOSURE && closure._unVal.pNativeClosure->_name._type == OT_STRING) {
+		frame.name = names.name(closure._unVal.pNativeClosure->_name._unVal.pString->_val);
+	}
+	else {
+		frame.name = names.name("(anonymous)");
+	}
+	return frame;
+}
+
+/**
+  * Compares the call stack of the VM with the one seen by its last instruction,
+  * and writes an exit event for every frame that ended and an enter event for every new frame.
+  * A function calling itself with a tail call isn't seen as a new frame.
+  */
+void SquirrelTracer::track_frames(SQVM *vm)
+{
+	EnterCriticalSection(&this->cs);
+	std::vector<Frame>& stack = this->frameStacks[vm];
+	size_t depth = vm->ci - vm->_callsstack + 1;
+	if (stack.size() == depth && stack.back().closure == vm->ci->_closure._unVal.pRefCounted) {
+		LeaveCriticalSection(&this->cs);
+		return;
+	}
+
+	LARGE_INTEGER qpc;
+	QueryPerformanceCounter(&qpc);
+	TraceFrame event;
+	event.vm = vm;
+	event.time = (uint64_t)((qpc.QuadPart - this->decodeStats.qpcStart) * this->qpcToNs);
+
+	size_t same = 0;
+	while (same < stack.size() && same < depth && stack[same].closure == vm->_callsstack[same]._closure._unVal.pRefCounted) {
+		same++;
+	}
+
+	event.event = FRAME_EXIT;
+	while (stack.size() > same) {
+		event.closure = stack.back().closure;
+		event.fn = stack.back().fn;
+		event.name = stack.back().name;
+		this->writer->writeFrame(event);
+		stack.pop_back();
+	}
+
+	event.event = FRAME_ENTER;
+	for (size_t i = same; i < depth; i++) {
+		stack.push_back(this->frame_of(vm->_callsstack[i]._closure));
+		event.closure = stack.back().closure;
+		event.fn = stack.back().fn;
+		event.name = stack.back().name;
+		this->writer->writeFrame(event);
+	}
+	LeaveCriticalSection(&this->cs);
+}
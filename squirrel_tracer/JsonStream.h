@@ -0,0 +1,214 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Squirrel tracing plugin
+  *
+  * ----
+  *
+  * Streaming JSON writer.
+  * Shared with the offline trace tools.
+  */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+/**
+  * Appends JSON to a buffer without building a tree, with the same formatting as jansson's
+  * JSON_COMPACT output. The buffer is reused, so once it has grown, writing doesn't allocate.
+  * Nothing is validated: the caller must write the keys and values in a valid order.
+  */
+class JsonStream
+{
+private:
+	std::string buffer;
+	bool first;    // Nothing written yet in the current object or array
+	bool afterKey; // The next value belongs to the key that was just written
+
+	void separate()
+	{
+		if (this->afterKey) {
+			this->afterKey = false;
+		}
+		else if (!this->first) {
+			this->buffer += ',';
+		}
+		this->first = false;
+	}
+
+	// Length of the valid UTF-8 sequence at str, or 0 if it isn't valid.
+	static size_t utf8Length(const unsigned char *str, size_t size)
+	{
+		unsigned char c = str[0];
+		size_t length;
+		if (c < 0x80) {
+			return 1;
+		}
+		else if (c >= 0xC2 && c <= 0xDF) {
+			length = 2;
+		}
+		else if (c >= 0xE0 && c <= 0xEF) {
+			length = 3;
+		}
+		else if (c >= 0xF0 && c <= 0xF4) {
+			length = 4;
+		}
+		else {
+			return 0;
+		}
+		if (length > size) {
+			return 0;
+		}
+		for (size_t i = 1; i < length; i++) {
+			if ((str[i] & 0xC0) != 0x80) {
+				return 0;
+			}
+		}
+		// Overlong forms, surrogates and code points above U+10FFFF
+		if ((c == 0xE0 && str[1] < 0xA0) || (c == 0xED && str[1] >= 0xA0) ||
+			(c == 0xF0 && str[1] < 0x90) || (c == 0xF4 && str[1] >= 0x90)) {
+			return 0;
+		}
+		return length;
+	}
+
+	void appendString(const char *str, size_t size)
+	{
+		const unsigned char *s = (const unsigned char*)str;
+		char escape[8];
+
+		this->buffer += '"';
+		size_t start = 0;
+		size_t i = 0;
+		while (i < size) {
+			unsigned char c = s[i];
+			size_t length = 1;
+			if (c >= 0x20 && c != '"' && c != '\\' && (c < 0x80 || (length = utf8Length(s + i, size - i)) != 0)) {
+				i += length;
+				continue;
+			}
+
+			this->buffer.append(str + start, i - start);
+			switch (c) {
+			case '"':  this->buffer.append("\\\"", 2); break;
+			case '\\': this->buffer.append("\\\\", 2); break;
+			case '\b': this->buffer.append("\\b", 2); break;
+			case '\f': this->buffer.append("\\f", 2); break;
+			case '\n': this->buffer.append("\\n", 2); break;
+			case '\r': this->buffer.append("\\r", 2); break;
+			case '\t': this->buffer.append("\\t", 2); break;
+			default:
+				// Control characters, and the bytes that aren't valid UTF-8 (jansson refuses them),
+				// which are written as the code point with the same value.
+				sprintf(escape, "\\u%04X", c);
+				this->buffer.append(escape, 6);
+				break;
+			}
+			i++;
+			start = i;
+		}
+		this->buffer.append(str + start, size - start);
+		this->buffer += '"';
+	}
+
+public:
+	JsonStream()
+		: first(true), afterKey(false)
+	{}
+
+	void clear()
+	{
+		this->buffer.clear();
+		this->first = true;
+		this->afterKey = false;
+	}
+
+	const char *data() const { return this->buffer.data(); }
+	size_t size() const { return this->buffer.size(); }
+
+	void beginObject() { this->separate(); this->buffer += '{'; this->first = true; }
+	void endObject() { this->buffer += '}'; this->first = false; }
+	void beginArray() { this->separate(); this->buffer += '['; this->first = true; }
+	void endArray() { this->buffer += ']'; this->first = false; }
+
+	void key(const char *key)
+	{
+		this->separate();
+		this->appendString(key, strlen(key));
+		this->buffer += ':';
+		this->afterKey = true;
+	}
+
+	void null() { this->separate(); this->buffer.append("null", 4); }
+	void boolean(bool value) { this->separate(); this->buffer.append(value ? "true" : "false"); }
+	void string(const char *str, size_t size) { this->separate(); this->appendString(str, size); }
+	void string(const char *str) { this->string(str, strlen(str)); }
+
+	void integer(int64_t value)
+	{
+		char str[32];
+		this->separate();
+		this->buffer.append(str, sprintf(str, "%lld", (long long)value));
+	}
+
+	// Same formatting as jansson's jsonp_dtostr. jansson has no representation for NaN and infinites.
+	void real(double value)
+	{
+		this->separate();
+		if (!(value == value) || value - value != 0) {
+			this->buffer.append("null", 4);
+			return;
+		}
+
+		char str[64];
+		int size = sprintf(str, "%.17g", value);
+		if (strspn(str, "0123456789-") == (size_t)size) {
+			strcpy(str + size, ".0");
+		}
+
+		// Remove the '+' sign and the leading zeroes from the exponent.
+		char *exp = strchr(str, 'e');
+		if (exp) {
+			char *src = exp + 1;
+			char *dst = exp + 1;
+			if (*src == '-') {
+				*dst++ = *src++;
+			}
+			else if (*src == '+') {
+				src++;
+			}
+			while (*src == '0' && src[1] != '\0') {
+				src++;
+			}
+			memmove(dst, src, strlen(src) + 1);
+		}
+		this->buffer.append(str);
+	}
+
+	// String with "0x" followed by the bytes in lowercase hexadecimal.
+	void hex(const void *data, size_t size)
+	{
+		static const char digits[] = "0123456789abcdef";
+		const unsigned char *bytes = (const unsigned char*)data;
+
+		this->separate();
+		this->buffer.append("\"0x", 3);
+		for (size_t i = 0; i < size; i++) {
+			this->buffer += digits[bytes[i] >> 4];
+			this->buffer += digits[bytes[i] & 0x0F];
+		}
+		this->buffer += '"';
+	}
+
+	// A value that is already serialized.
+	void raw(const char *json, size_t size) { this->separate(); this->buffer.append(json, size); }
+
+	// Text outside of the JSON values, like the separators between the records of a trace.
+	void append(const char *text, size_t size)
+	{
+		this->buffer.append(text, size);
+		this->first = true;
+	}
+};
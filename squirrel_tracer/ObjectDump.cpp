@@ -1,30 +1,75 @@
 #include <Squirrel tracer.h>
 
-ObjectDump::ObjectDump()
-	: hMap(nullptr), pointer(nullptr), size(0), json(nullptr), json_dump_size(0)
+ObjectDump::ObjectDump(SnapshotStore *store)
+	: store(store), address(nullptr), offset(0), size(0), json_dump_size(0), epoch(0), deltas(0)
 {}
 
 ObjectDump::ObjectDump(const ObjectDump& other)
-	: hMap(nullptr), pointer(nullptr), size(0), json(nullptr), json_dump_size(0)
+	: store(other.store), address(nullptr), offset(0), size(0), json_dump_size(0), epoch(0), deltas(0)
 {
 	*this = other;
 }
 
-ObjectDump::ObjectDump(const void *mem_dump, size_t size, json_t *json)
-	: hMap(nullptr), pointer(nullptr), size(0), json(nullptr), json_dump_size(0)
+ObjectDump& ObjectDump::operator=(const ObjectDump& other)
+{
+	if (this == &other) {
+		return *this;
+	}
+	this->release();
+	this->store = other.store;
+	this->address = other.address;
+	this->epoch = other.epoch;
+	this->deltas = other.deltas;
+	if (other) {
+		// The pointers returned by get() are only valid until the next call to the store,
+		// so the source is copied to a temporary buffer first.
+		size_t alloc_size = other.size + other.json_dump_size;
+		char *src = (char*)other.store->get(other.offset, alloc_size);
+		if (src == nullptr) {
+			return *this;
+		}
+		std::vector<char> buffer(src, src + alloc_size);
+
+		// If the store is full or can't be mapped, the copy is left empty.
+		uint64_t offset = this->store->alloc(alloc_size);
+		if (offset != SnapshotStore::NONE) {
+			char *dst = (char*)this->store->get(offset, alloc_size);
+			if (dst == nullptr) {
+				this->store->release(offset, alloc_size);
+				return *this;
+			}
+			memcpy(dst, buffer.data(), alloc_size);
+			this->offset = offset;
+			this->size = other.size;
+			this->json_dump_size = other.json_dump_size;
+		}
+	}
+	return *this;
+}
+
+ObjectDump::ObjectDump(ObjectDump&& other)
+	: store(other.store), address(nullptr), offset(0), size(0), json_dump_size(0), epoch(0), deltas(0)
 {
-	this->set(mem_dump, size, json);
+	*this = std::move(other);
 }
 
-ObjectDump& ObjectDump::operator=(const ObjectDump& other)
+ObjectDump& ObjectDump::operator=(ObjectDump&& other)
 {
+	if (this == &other) {
+		return *this;
+	}
+	// The snapshot changes owner, it isn't copied.
 	this->release();
-	DuplicateHandle(GetCurrentProcess(), other.hMap, GetCurrentProcess(), &this->hMap, 0, FALSE, DUPLICATE_SAME_ACCESS);
-	this->pointer = nullptr;
+	this->store = other.store;
+	this->address = other.address;
+	this->offset = other.offset;
 	this->size = other.size;
-	this->json = other.json;
-	json_incref(this->json);
-	this->json_dump_size = 0;
+	this->json_dump_size = other.json_dump_size;
+	this->epoch = other.epoch;
+	this->deltas = other.deltas;
+	other.offset = 0;
+	other.size = 0;
+	other.json_dump_size = 0;
 	return *this;
 }
 
@@ -33,144 +78,100 @@ ObjectDump::~ObjectDump()
 	this->release();
 }
 
-ObjectDump::operator bool()
+ObjectDump::operator bool() const
 {
-	return this->hMap != nullptr;
+	return this->json_dump_size != 0;
 }
 
-void ObjectDump::set(const void *mem_dump, size_t size, json_t *json)
+bool ObjectDump::set(const void *address, const RawSnapshot& raw, const JsonStream& json)
 {
 	this->release();
 
-	json_t *dumped_obj = json_object();
-	json_object_set_new(dumped_obj, "type", json_string("object"));
-	char string[] = "POINTER:0x00000000";
-	sprintf(string, "POINTER:%p", mem_dump);
-	json_object_set_new(dumped_obj, "address", json_string(string));
-	json_object_set(dumped_obj, "content", json);
-
-	this->json_dump_size = json_dumpb(dumped_obj, nullptr, 0, JSON_COMPACT);
-	size_t alloc_size = size + this->json_dump_size;
-
-	this->hMap = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, alloc_size, nullptr);
-	if (this->hMap == nullptr) {
-		log_mboxf("Error", MB_OK, "CreateFileMapping failed with error code %d", GetLastError());
+	this->address = address;
+	size_t alloc_size = raw.size + raw.extraSize + json.size();
+	uint64_t offset = this->store->alloc(alloc_size);
+	if (offset == SnapshotStore::NONE) {
+		return false;
 	}
-	this->pointer = MapViewOfFile(this->hMap, FILE_MAP_WRITE, 0, 0, alloc_size); // This pointer may be remapped as FILE_MAP_READ later
-	if (this->pointer == nullptr) {
-		if (GetLastError() == ERROR_NOT_ENOUGH_MEMORY) {
-			log_mboxf("Error", MB_OK, "MapViewOfFile failed: ERROR_NOT_ENOUGH_MEMORY");
-		}
-		else {
-			log_mboxf("Error", MB_OK, "MapViewOfFile failed with error code %d", GetLastError());
-		}
+	char *pointer = (char*)this->store->get(offset, alloc_size);
+	if (pointer == nullptr) {
+		this->store->release(offset, alloc_size);
+		return false;
 	}
-
-	memcpy(this->pointer, mem_dump, size);
-	this->size = size;
-
-	this->json = json;
-	json_incref(this->json);
-
-	this->json_dump_size = json_dumpb(dumped_obj, (char*)this->pointer + size, this->json_dump_size, JSON_COMPACT);
-	json_decref(dumped_obj);
+	this->offset = offset;
+	this->size = raw.size + raw.extraSize;
+	this->json_dump_size = json.size();
+	memcpy(pointer, raw.data, raw.size);
+	if (raw.extraSize) {
+		memcpy(pointer + raw.size, raw.extra, raw.extraSize);
+	}
+	memcpy(pointer + this->size, json.data(), this->json_dump_size);
+	return true;
 }
 
 void ObjectDump::release()
 {
-	this->unmap();
-	if (this->hMap) {
-		CloseHandle(this->hMap);
+	if (*this) {
+		this->store->release(this->offset, this->size + this->json_dump_size);
 	}
-	this->hMap = nullptr;
+	this->offset = 0;
 	this->size = 0;
 	this->json_dump_size = 0;
 }
 
-void ObjectDump::map()
+bool ObjectDump::equal(const RawSnapshot& raw)
 {
-	if (this->pointer) {
-		return;
-	}
-	this->pointer = MapViewOfFile(this->hMap, FILE_MAP_READ, 0, 0, this->size + this->json_dump_size);
-	if (this->pointer == nullptr) {
-		if (GetLastError() == ERROR_NOT_ENOUGH_MEMORY) {
-			log_mboxf("Error", MB_OK, "MapViewOfFile failed: ERROR_NOT_ENOUGH_MEMORY");
-		}
-		else {
-			log_mboxf("Error", MB_OK, "MapViewOfFile failed with error code %d", GetLastError());
-		}
-	}
-	if (!this->json) {
-		json_error_t error;
-		json_t *obj = json_loadb((char*)this->pointer + this->size, this->json_dump_size, JSON_COMPACT, &error);
-		if (obj == nullptr) {
-			log_mboxf("Error", MB_OK, "%s", error.text);
-		}
-
-		this->json = json_object_get(obj, "content");
-		json_incref(this->json);
-		json_decref(obj);
-	}
-}
-
-void ObjectDump::unmap()
-{
-	if (this->pointer) {
-		UnmapViewOfFile(this->pointer);
-	}
-	this->pointer = nullptr;
-	if (this->json) {
-		json_decref(this->json);
-	}
-	this->json = nullptr;
-}
-
-bool ObjectDump::equal(const void* mem_dump, size_t size)
-{
-	if (this->hMap == nullptr || this->size != size) {
+	if (!*this || this->size != raw.size + raw.extraSize) {
 		return false;
 	}
-	if (!this->pointer) {
-		this->map();
-	}
-	return memcmp(this->pointer, mem_dump, size) == 0;
+	// If the snapshot can't be read, the object is dumped again.
+	char *pointer = (char*)this->store->get(this->offset, this->size);
+	return pointer && memcmp(pointer, raw.data, raw.size) == 0 &&
+		(raw.extraSize == 0 || memcmp(pointer + raw.size, raw.extra, raw.extraSize) == 0);
 }
 
-bool ObjectDump::equal(const json_t *json)
+// The JSON writer always gives the same output for the same content, so comparing the bytes is enough.
+bool ObjectDump::equal(const JsonStream& json)
 {
-	if (this->json == nullptr) {
+	if (!*this || this->json_dump_size != json.size()) {
 		return false;
 	}
-	return json_equal(this->json, json) != 0;
+	char *pointer = (char*)this->store->get(this->offset, this->size + this->json_dump_size);
+	return pointer && memcmp(pointer + this->size, json.data(), this->json_dump_size) == 0;
 }
 
-void ObjectDump::writeToFile(FILE *file)
+const char *ObjectDump::snapshot(size_t& size)
 {
-	this->map();
-	fwrite((char*)this->pointer + this->size, this->json_dump_size, 1, file);
-	fwrite(",\n", 2, 1, file);
+	if (!*this) {
+		return nullptr;
+	}
+	size = this->size;
+	return (const char*)this->store->get(this->offset, this->size);
 }
 
 
 
-ObjectDumpCollection::ObjectDumpCollection()
+ObjectDumpCollection::ObjectDumpCollection(SnapshotStore *store)
+	: store(store)
 {}
 
 ObjectDumpCollection::~ObjectDumpCollection()
-{}
+{
+	// The dumps must be released before their store.
+	this->map.clear();
+	delete this->store;
+}
 
 ObjectDump& ObjectDumpCollection::operator[](void* key)
 {
-	ObjectDump& obj = map[key];
-	this->mappedObjects.push(&obj);
-	return obj;
+	ObjectDump *dump = this->map.find(key);
+	if (dump == nullptr) {
+		dump = &this->map.insert(key, ObjectDump(this->store));
+	}
+	return *dump;
 }
 
-void ObjectDumpCollection::unmapAll()
+bool ObjectDumpCollection::erase(void* key)
 {
-	while (!this->mappedObjects.empty()) {
-		this->mappedObjects.top()->unmap();
-		this->mappedObjects.pop();
-	}
+	return this->map.erase(key);
 }
@@ -0,0 +1,253 @@
+#include "Squirrel tracer.h"
+#include <algorithm>
+
+Profiler::Profiler(json_t *config)
+	: lastVm(nullptr), lastVmProfile(nullptr), sinceCheck(0)
+{
+	memset(this->retiredOpcodes, 0, sizeof(this->retiredOpcodes));
+
+	json_t *profile = json_object_get(config, "profile");
+	const char *reportFn = json_string_value(json_object_get(profile, "report"));
+	const char *callgrindFn = json_string_value(json_object_get(profile, "callgrind"));
+	this->reportFn = reportFn ? reportFn : "profile.txt";
+	this->callgrindFn = callgrindFn ? callgrindFn : "callgrind.out.squirrel";
+
+	json_int_t interval = json_integer_value(json_object_get(profile, "interval"));
+	this->interval = interval > 0 ? (DWORD)interval * 1000 : 0;
+	this->lastReport = GetTickCount();
+}
+
+Profiler::~Profiler()
+{
+	this->report();
+	this->vms.for_each([this](SQVM*, VmProfile *profile) {
+		this->freeVm(profile);
+	});
+}
+
+Profiler::VmProfile *Profiler::getVm(SQVM *vm)
+{
+	VmProfile **found = this->vms.find(vm);
+	VmProfile *profile;
+	if (found) {
+		profile = *found;
+	}
+	else {
+		// operator new doesn't align on more than 8 bytes.
+		profile = new (_aligned_malloc(sizeof(VmProfile), 64)) VmProfile;
+		memset(profile->opcodes, 0, sizeof(profile->opcodes));
+		profile->lastProto = nullptr;
+		profile->lastCounts = nullptr;
+		profile->lastSize = 0;
+		this->vms[vm] = profile;
+	}
+	this->lastVm = vm;
+	this->lastVmProfile = profile;
+	return profile;
+}
+
+void Profiler::freeVm(VmProfile *profile)
+{
+	profile->functions.for_each([](SQFunctionProto*, uint64_t *counts) {
+		_aligned_free(counts);
+	});
+	profile->~VmProfile();
+	_aligned_free(profile);
+}
+
+uint64_t *Profiler::getCounts(VmProfile *profile, SQClosure *closure, ClosureDB& closureDB)
+{
+	SQFunctionProto *proto = closure->_function;
+	// Without the sq_vm_free hook, the function may have been released and its address reused
+	// by a function of another size: its counters are retired, and new ones are allocated.
+	FunctionInfo *info = this->functions.find(proto);
+	if (info && info->lines.size() != (size_t)proto->_ninstructions) {
+		this->remove(proto);
+	}
+	uint64_t **found = profile->functions.find(proto);
+	if (found) {
+		return *found;
+	}
+
+	if (!this->functions.find(proto)) {
+		FunctionInfo& info = this->functions[proto];
+		info.file = closureDB.file(closure).str;
+		info.name = proto->_name._type == OT_STRING ? proto->_name._unVal.pString->_val : "(anonymous)";
+		info.lines.resize(proto->_ninstructions);
+		info.lineOps.resize(proto->_ninstructions);
+
+		// The line infos are sorted by instruction, and give the line of the instructions up to the next one.
+		SQInteger line = 0;
+		SQInteger next = 0;
+		for (SQInteger i = 0; i < proto->_ninstructions; i++) {
+			while (next < proto->_nlineinfos && proto->_lineinfos[next]._op <= i) {
+				line = proto->_lineinfos[next]._line;
+				next++;
+			}
+			if (proto->_instructions[i].op == _OP_LINE) {
+				info.lines[i] = proto->_instructions[i]._arg1;
+				info.lineOps[i] = true;
+			}
+			else {
+				info.lines[i] = line;
+			}
+		}
+	}
+
+	size_t size = ((size_t)proto->_ninstructions * sizeof(uint64_t) + 63) & ~(size_t)63;
+	uint64_t *counts = (uint64_t*)_aligned_malloc(size ? size : 64, 64);
+	memset(counts, 0, size);
+	profile->functions[proto] = counts;
+	return counts;
+}
+
+void Profiler::fold(SQFunctionProto *proto, const uint64_t *counts, Report& report)
+{
+	FunctionInfo *info = this->functions.find(proto);
+	if (!info) {
+		return;
+	}
+	FunctionReport& function = report[std::make_pair(info->file, info->name)];
+	for (size_t i = 0; i < info->lines.size(); i++) {
+		if (counts[i] == 0) {
+			continue;
+		}
+		function.instructions += counts[i];
+		function.lineCosts[info->lines[i]] += counts[i];
+		if (info->lineOps[i]) {
+			function.lineHits[info->lines[i]] += counts[i];
+		}
+	}
+}
+
+void Profiler::remove(void *o)
+{
+	VmProfile **vm = this->vms.find((SQVM*)o);
+	if (vm) {
+		VmProfile *profile = *vm;
+		for (int i = 0; i < 64; i++) {
+			this->retiredOpcodes[i] += profile->opcodes[i];
+		}
+		profile->functions.for_each([this](SQFunctionProto *proto, uint64_t *counts) {
+			this->fold(proto, counts, this->retired);
+		});
+		this->freeVm(profile);
+		this->vms.erase((SQVM*)o);
+		if (this->lastVm == o) {
+			this->lastVm = nullptr;
+		}
+		return;
+	}
+
+	SQFunctionProto *proto = (SQFunctionProto*)o;
+	if (this->functions.find(proto)) {
+		this->vms.for_each([this, proto](SQVM*, VmProfile *profile) {
+			uint64_t **counts = profile->functions.find(proto);
+			if (counts) {
+				this->fold(proto, *counts, this->retired);
+				_aligned_free(*counts);
+				profile->functions.erase(proto);
+				if (profile->lastProto == proto) {
+					profile->lastProto = nullptr;
+				}
+			}
+		});
+		this->functions.erase(proto);
+	}
+}
+
+void Profiler::report()
+{
+	this->lastReport = GetTickCount();
+
+	Report report(this->retired);
+	uint64_t opcodes[64];
+	memcpy(opcodes, this->retiredOpcodes, sizeof(opcodes));
+	this->vms.for_each([&](SQVM*, VmProfile *profile) {
+		for (int i = 0; i < 64; i++) {
+			opcodes[i] += profile->opcodes[i];
+		}
+		profile->functions.for_each([&](SQFunctionProto *proto, uint64_t *counts) {
+			this->fold(proto, counts, report);
+		});
+	});
+
+	uint64_t total = 0;
+	for (int i = 0; i < 64; i++) {
+		total += opcodes[i];
+	}
+	if (total == 0) {
+		return;
+	}
+
+	FILE *file = fopen(this->reportFn.c_str(), "w");
+	if (file) {
+		fprintf(file, "Squirrel profile: %llu instructions\n", total);
+
+		std::vector<std::pair<uint64_t, int>> ops;
+		for (int i = 0; i < 64; i++) {
+			if (opcodes[i]) {
+				ops.push_back(std::make_pair(opcodes[i], i));
+			}
+		}
+		std::sort(ops.rbegin(), ops.rend());
+		fprintf(file, "\nOpcodes\n");
+		for (const auto& it : ops) {
+			const char *name = opcode_name(it.second);
+			fprintf(file, "%14llu %6.2f%%  %s\n", it.first, it.first * 100.0 / total, name ? name : "(unknown opcode)");
+		}
+
+		std::vector<std::pair<uint64_t, const Report::value_type*>> functions;
+		std::vector<std::pair<std::pair<uint64_t, uint64_t>, std::pair<const Report::value_type*, SQInteger>>> lines;
+		for (const auto& function : report) {
+			functions.push_back(std::make_pair(function.second.instructions, &function));
+			for (const auto& line : function.second.lineCosts) {
+				auto hits = function.second.lineHits.find(line.first);
+				uint64_t hitCount = hits != function.second.lineHits.end() ? hits->second : 0;
+				lines.push_back(std::make_pair(std::make_pair(line.second, hitCount), std::make_pair(&function, line.first)));
+			}
+		}
+		std::sort(functions.rbegin(), functions.rend());
+		std::sort(lines.rbegin(), lines.rend());
+
+		fprintf(file, "\nFunctions (instructions)\n");
+		for (size_t i = 0; i < functions.size() && i < 100; i++) {
+			fprintf(file, "%14llu %6.2f%%  %s: %s\n", functions[i].first, functions[i].first * 100.0 / total,
+				functions[i].second->first.first.c_str(), functions[i].second->first.second.c_str());
+		}
+		fprintf(file, "\nLines (instructions, hits)\n");
+		for (size_t i = 0; i < lines.size() && i < 100; i++) {
+			fprintf(file, "%14llu %12llu  %s:%d (%s)\n", lines[i].first.first, lines[i].first.second,
+				lines[i].second.first->first.first.c_str(), (int)lines[i].second.second,
+				lines[i].second.first->first.second.c_str());
+		}
+		fclose(file);
+	}
+	else {
+		log_printf("Squirrel tracer: can't open %s for writing.\n", this->reportFn.c_str());
+	}
+
+	file = fopen(this->callgrindFn.c_str(), "w");
+	if (file) {
+		uint64_t totalHits = 0;
+		for (const auto& function : report) {
+			for (const auto& line : function.second.lineHits) {
+				totalHits += line.second;
+			}
+		}
+		fprintf(file, "# callgrind format\nversion: 1\ncreator: Squirrel tracer\n"
+			"positions: line\nevents: Instructions LineHits\nsummary: %llu %llu\n", total, totalHits);
+		for (const auto& function : report) {
+			fprintf(file, "\nfl=%s\nfn=%s\n", function.first.first.c_str(), function.first.second.c_str());
+			for (const auto& line : function.second.lineCosts) {
+				auto hits = function.second.lineHits.find(line.first);
+				fprintf(file, "%d %llu %llu\n", (int)line.first, line.second,
+					hits != function.second.lineHits.end() ? hits->second : 0);
+			}
+		}
+		fclose(file);
+	}
+	else {
+		log_printf("Squirrel tracer: can't open %s for writing.\n", this->callgrindFn.c_str());
+	}
+}
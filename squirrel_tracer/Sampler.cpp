@@ -0,0 +1,135 @@
+#include "Squirrel tracer.h"
+
+Sampler::Sampler(json_t *config)
+	: seen(0), traced(0)
+{
+	this->load(config);
+}
+
+void Sampler::load(json_t *config)
+{
+	this->mode = SAMPLE_NONE;
+	this->rate = 1;
+	this->counter = 0;
+	this->frames.clear();
+	this->lastVm = nullptr;
+	this->lastDepth = 0;
+	this->burstLength = 0;
+	this->burstInterval = 0;
+	this->burstRemaining = 0;
+	this->burstStart = 0;
+
+	json_t *sampling = json_object_get(config, "sampling");
+	const char *mode = json_string_value(json_object_get(sampling, "mode"));
+	if (!mode || strcmp(mode, "none") == 0) {
+		return;
+	}
+
+	json_int_t rate = json_integer_value(json_object_get(sampling, "rate"));
+	this->rate = rate > 0 ? (uint32_t)rate : 100;
+
+	if (strcmp(mode, "instructions") == 0) {
+		this->mode = SAMPLE_INSTRUCTIONS;
+		// Start with a traced instruction.
+		this->counter = this->rate - 1;
+	}
+	else if (strcmp(mode, "frames") == 0) {
+		this->mode = SAMPLE_FRAMES;
+		this->frames.reserve(64);
+	}
+	else if (strcmp(mode, "bursts") == 0) {
+		this->mode = SAMPLE_BURSTS;
+		json_int_t length = json_integer_value(json_object_get(sampling, "burst_length"));
+		json_int_t interval = json_integer_value(json_object_get(sampling, "burst_interval"));
+		this->burstLength = length > 0 ? (uint32_t)length : 1000;
+		this->burstInterval = interval > 0 ? (uint32_t)interval : 1000;
+		this->burstStart = GetTickCount() - this->burstInterval;
+	}
+	else {
+		log_printf("Squirrel tracer: unknown sampling mode \"%s\", tracing every instruction.\n", mode);
+	}
+}
+
+Sampler::~Sampler()
+{
+	if (this->mode != SAMPLE_NONE && this->seen) {
+		log_printf("Squirrel tracer: sampling traced %llu of %llu instructions (%.2f%%).\n",
+			this->traced, this->seen, this->traced * 100.0 / this->seen);
+	}
+}
+
+bool Sampler::sample(SQVM *vm)
+{
+	bool sampled;
+	switch (this->mode) {
+	case SAMPLE_INSTRUCTIONS:
+		if (++this->counter < this->rate) {
+			sampled = false;
+		}
+		else {
+			this->counter = 0;
+			sampled = true;
+		}
+		break;
+
+	case SAMPLE_FRAMES:
+		sampled = this->sampleFrame(vm);
+		break;
+
+	case SAMPLE_BURSTS:
+		sampled = this->sampleBurst();
+		break;
+
+	default:
+		return true;
+	}
+
+	this->seen++;
+	this->traced += sampled;
+	return sampled;
+}
+
+bool Sampler::sampleFrame(SQVM *vm)
+{
+	size_t depth = vm->ci - vm->_callsstack;
+	SQClosure *closure = vm->ci->_closure._unVal.pClosure;
+
+	// The decisions of the callers are lost when switching to another VM (a thread or a generator).
+	if (vm != this->lastVm) {
+		this->frames.clear();
+		this->lastVm = vm;
+	}
+	if (depth >= this->frames.size()) {
+		Frame frame = { nullptr, false };
+		this->frames.resize(depth + 1, frame);
+	}
+
+	// A new frame starts when the call stack grows, or when another function runs
+	// at the same depth (tail call). When returning to a caller, its decision is kept.
+	Frame& frame = this->frames[depth];
+	if (depth > this->lastDepth || frame.closure != closure) {
+		frame.closure = closure;
+		frame.sampled = this->counter == 0;
+		if (++this->counter >= this->rate) {
+			this->counter = 0;
+		}
+	}
+	this->lastDepth = depth;
+	return frame.sampled;
+}
+
+bool Sampler::sampleBurst()
+{
+	if (this->burstRemaining > 0) {
+		this->burstRemaining--;
+		return true;
+	}
+
+	DWORD now = GetTickCount();
+	if (now - this->burstStart < this->burstInterval) {
+		return false;
+	}
+	this->burstStart = now;
+	this->burstRemaining = this->burstLength - 1;
+	return true;
+}
@@ -0,0 +1,129 @@
+#include "Squirrel tracer.h"
+
+// Calls f(path, size) for every file of a segment: the trace, and the side index of a compressed trace.
+template<typename F> static void for_each_segment_file(const std::string& segment, F f)
+{
+	WIN32_FIND_DATAA data;
+	std::string pattern = segment + ".*";
+	HANDLE find = FindFirstFileA(pattern.c_str(), &data);
+	if (find == INVALID_HANDLE_VALUE) {
+		return;
+	}
+	// cFileName doesn't have the directory.
+	std::string dir = segment.substr(0, segment.find_last_of("/\\") + 1);
+	do {
+		f(dir + data.cFileName, ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow);
+	} while (FindNextFileA(find, &data));
+	FindClose(find);
+}
+
+// Returns the integer value of key, or def if it isn't set.
+static uint64_t config_integer(json_t *object, const char *key, uint64_t def)
+{
+	json_t *value = json_object_get(object, key);
+	return json_is_integer(value) && json_integer_value(value) >= 0 ? (uint64_t)json_integer_value(value) : def;
+}
+
+TraceSegments::TraceSegments(json_t *config, const std::string& suffix)
+	: segment(0), instructions(0), segmentStart(0), totalSize(0)
+{
+	json_t *segments = json_object_get(config, "segments");
+	const char *file = json_string_value(json_object_get(segments, "file"));
+	this->fileBase = (file ? file : "trace") + suffix;
+	// Sizes in MB. 0 means no limit.
+	this->maxSize = config_integer(segments, "max_size", 64) * 1024 * 1024;
+	this->maxInstructions = config_integer(segments, "max_instructions", 0);
+	this->maxTotalSize = config_integer(segments, "max_total_size", 1024) * 1024 * 1024;
+	this->indexInterval = config_integer(segments, "index_interval", 4096);
+	if (this->indexInterval == 0) {
+		this->indexInterval = 1;
+	}
+
+	std::string indexFn = this->fileBase + ".idx";
+	this->index = fopen(indexFn.c_str(), "wb");
+	if (!this->index) {
+		log_printf("Squirrel tracer: cannot open %s, the segments won't be indexed.\n", indexFn.c_str());
+		return;
+	}
+	SegmentIndexHeader header;
+	memcpy(header.magic, SEGMENT_INDEX_MAGIC, sizeof(SEGMENT_INDEX_MAGIC));
+	header.version = SEGMENT_INDEX_VERSION;
+	fwrite(&header, sizeof(header), 1, this->index);
+}
+
+TraceSegments::~TraceSegments()
+{
+	if (this->index) {
+		fclose(this->index);
+	}
+}
+
+std::string TraceSegments::open()
+{
+	if (this->segment > 0) {
+		uint64_t size = 0;
+		for_each_segment_file(this->current, [&size](const std::string&, uint64_t fileSize) {
+			size += fileSize;
+		});
+		this->closed.push_back(std::make_pair(this->current, size));
+		this->totalSize += size;
+	}
+	// The limit includes the segment being written.
+	while (this->maxTotalSize && !this->closed.empty() && this->totalSize + this->maxSize > this->maxTotalSize) {
+		for_each_segment_file(this->closed.front().first, [](const std::string& fn, uint64_t) {
+			DeleteFileA(fn.c_str());
+		});
+		this->totalSize -= this->closed.front().second;
+		this->closed.pop_front();
+	}
+
+	this->segment++;
+	this->segmentStart = this->instructions;
+	char name[MAX_PATH];
+	_snprintf(name, MAX_PATH, "%s.%04u", this->fileBase.c_str(), this->segment);
+	name[MAX_PATH - 1] = '\0';
+	this->current = name;
+	return this->current;
+}
+
+bool TraceSegments::full(uint64_t size) const
+{
+	// A segment has at least one instruction, even if the dumps of the live objects are over the limit.
+	uint64_t count = this->instructions - this->segmentStart;
+	return count > 0 && ((this->maxSize && size >= this->maxSize) || (this->maxInstructions && count >= this->maxInstructions));
+}
+
+void TraceSegments::instruction(uint64_t offset)
+{
+	if ((this->instructions - this->segmentStart) % this->indexInterval == 0 && this->index) {
+		SegmentIndexEntry entry;
+		entry.instruction = this->instructions;
+		entry.offset = offset;
+		entry.segment = this->segment;
+		fwrite(&entry, sizeof(entry), 1, this->index);
+		fflush(this->index);
+	}
+	this->instructions++;
+}
+
+uint64_t SquirrelTracer::roll_segment()
+{
+	// The JSON writer closes its array when it is destroyed.
+	delete this->writer;
+	this->writer = TraceWriter::create(this->config, this->segments->open().c_str());
+	// The string records of the previous segments aren't in this one.
+	this->strings.clear();
+	// A reader seeking to the first instruction must see the dumps of the live objects too.
+	uint64_t offset = this->writer->size();
+
+	// The dumps are taken again from memory rather than copied from the snapshots,
+	// so that their strings are written to this segment too. Only the objects still alive
+	// are read, and segmentObjs is left with them and the objects dumped from now on.
+	this->objs_list.erase_if([](void*, ObjectDump&) { return true; });
+	if (++this->objEpoch == 0) {
+		this->objEpoch = 1;
+	}
+	this->queue_live_objects(this->segmentObjs);
+	this->dump_pending_objs();
+	return offset;
+}
@@ -0,0 +1,191 @@
+#include <Squirrel tracer.h>
+
+// Blocks are rounded to this size, so that the freed blocks are easier to reuse.
+#define SNAPSHOT_ALIGN 16
+
+SnapshotStore *SnapshotStore::create(json_t *config)
+{
+	json_t *snapshots = json_object_get(config, "snapshots");
+
+	// Slab size in MB. The file store needs it to be a multiple of the allocation granularity (64 KB).
+	json_int_t slabSizeMB = json_integer_value(json_object_get(snapshots, "slab_size"));
+	if (slabSizeMB <= 0) {
+		slabSizeMB = 16;
+	}
+	size_t slabSize = (size_t)slabSizeMB * 1024 * 1024;
+
+	const char *type = json_string_value(json_object_get(snapshots, "store"));
+	if (type && strcmp(type, "file") == 0) {
+		const char *fn = json_string_value(json_object_get(snapshots, "file"));
+		json_int_t maxViews = json_integer_value(json_object_get(snapshots, "max_views"));
+		return new FileSnapshotStore(fn ? fn : "snapshots.tmp", slabSize, maxViews > 0 ? (size_t)maxViews : 16);
+	}
+	if (type && strcmp(type, "memory") != 0) {
+		log_printf("Squirrel tracer: unknown snapshot store \"%s\", falling back to memory.\n", type);
+	}
+	return new MemorySnapshotStore(slabSize);
+}
+
+SnapshotStore::SnapshotStore(size_t slabSize)
+	: top(0), failed(false), slabSize(slabSize), slabCount(0)
+{}
+
+uint64_t SnapshotStore::alloc(size_t size)
+{
+	size = (size + SNAPSHOT_ALIGN - 1) & ~(SNAPSHOT_ALIGN - 1);
+
+	auto it = this->freeLists.find(size);
+	if (it != this->freeLists.end() && !it->second.empty()) {
+		uint64_t offset = it->second.back();
+		it->second.pop_back();
+		return offset;
+	}
+
+	// Blocks never cross a group boundary. If the block doesn't fit in the current slab,
+	// the end of this slab is wasted and the block starts a new group.
+	if (this->top + size > (uint64_t)this->slabCount * this->slabSize) {
+		uint64_t end = (uint64_t)this->slabCount * this->slabSize;
+		if (this->failed || !this->addSlabs((size + this->slabSize - 1) / this->slabSize)) {
+			this->failed = true;
+			return NONE;
+		}
+		this->top = end;
+	}
+	uint64_t offset = this->top;
+	this->top += size;
+	return offset;
+}
+
+void SnapshotStore::release(uint64_t offset, size_t size)
+{
+	size = (size + SNAPSHOT_ALIGN - 1) & ~(SNAPSHOT_ALIGN - 1);
+	this->freeLists[size].push_back(offset);
+}
+
+
+
+MemorySnapshotStore::MemorySnapshotStore(size_t slabSize)
+	: SnapshotStore(slabSize)
+{}
+
+MemorySnapshotStore::~MemorySnapshotStore()
+{
+	for (char *it : this->allocations) {
+		VirtualFree(it, 0, MEM_RELEASE);
+	}
+}
+
+bool MemorySnapshotStore::addSlabs(size_t count)
+{
+	char *group = (char*)VirtualAlloc(nullptr, count * this->slabSize, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (group == nullptr) {
+		log_mboxf("Error", MB_OK, "VirtualAlloc failed with error code %d.\n"
+			"The object snapshots won't be stored anymore, every object will be written in full.", GetLastError());
+		return false;
+	}
+	this->allocations.push_back(group);
+	for (size_t i = 0; i < count; i++) {
+		this->slabs.push_back(group + i * this->slabSize);
+	}
+	this->slabCount += count;
+	return true;
+}
+
+void *MemorySnapshotStore::get(uint64_t offset, size_t)
+{
+	return this->slabs[(size_t)(offset / this->slabSize)] + (size_t)(offset % this->slabSize);
+}
+
+
+
+FileSnapshotStore::FileSnapshotStore(const char *fn, size_t slabSize, size_t maxViews)
+	: SnapshotStore(slabSize), fn(fn), hFile(nullptr), hMap(nullptr), maxViews(maxViews)
+{}
+
+FileSnapshotStore::~FileSnapshotStore()
+{
+	this->unmapAll();
+	if (this->hMap) {
+		CloseHandle(this->hMap);
+	}
+	if (this->hFile && this->hFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(this->hFile);
+	}
+}
+
+void FileSnapshotStore::unmapAll()
+{
+	for (auto& it : this->views) {
+		UnmapViewOfFile(it.second);
+	}
+	this->views.clear();
+}
+
+bool FileSnapshotStore::addSlabs(size_t count)
+{
+	if (this->hFile == nullptr) {
+		this->hFile = CreateFile(this->fn.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+			FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+		if (this->hFile == INVALID_HANDLE_VALUE) {
+			log_mboxf("Error", MB_OK, "Could not create the snapshot store file %s (error code %d)", this->fn.c_str(), GetLastError());
+		}
+	}
+	// Without the file, CreateFileMapping would create a new section in the paging file
+	// every time, and the previous slabs would be lost.
+	if (this->hFile == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	// Grow the file. The views of the previous mapping object stay valid after it is closed.
+	uint64_t fileSize = (uint64_t)(this->slabCount + count) * this->slabSize;
+	HANDLE hMap = CreateFileMapping(this->hFile, nullptr, PAGE_READWRITE, (DWORD)(fileSize >> 32), (DWORD)fileSize, nullptr);
+	if (hMap == nullptr) {
+		log_mboxf("Error", MB_OK, "CreateFileMapping failed with error code %d.\n"
+			"The object snapshots won't be stored anymore, every object will be written in full.", GetLastError());
+		return false;
+	}
+	if (this->hMap) {
+		CloseHandle(this->hMap);
+	}
+	this->hMap = hMap;
+
+	size_t first = this->slabCount;
+	this->slabCount += count;
+	this->groupSize[first] = count;
+	for (size_t i = 0; i < count; i++) {
+		this->groupStart.push_back(first);
+	}
+	return true;
+}
+
+void *FileSnapshotStore::get(uint64_t offset, size_t)
+{
+	size_t group = this->groupStart[(size_t)(offset / this->slabSize)];
+	uint64_t groupOffset = (uint64_t)group * this->slabSize;
+
+	auto it = this->views.find(group);
+	if (it == this->views.end()) {
+		// The games are 32-bit processes: keep the address space used by the views bounded.
+		if (this->views.size() >= this->maxViews) {
+			this->unmapAll();
+		}
+		char *view = (char*)MapViewOfFile(this->hMap, FILE_MAP_WRITE, (DWORD)(groupOffset >> 32), (DWORD)groupOffset,
+			this->groupSize[group] * this->slabSize);
+		if (view == nullptr && !this->views.empty()) {
+			// The address space may be too fragmented for the other views. Try again without them.
+			this->unmapAll();
+			view = (char*)MapViewOfFile(this->hMap, FILE_MAP_WRITE, (DWORD)(groupOffset >> 32), (DWORD)groupOffset,
+				this->groupSize[group] * this->slabSize);
+		}
+		if (view == nullptr) {
+			if (GetLastError() == ERROR_NOT_ENOUGH_MEMORY) {
+				log_mboxf("Error", MB_OK, "MapViewOfFile failed: ERROR_NOT_ENOUGH_MEMORY");
+			}
+			else {
+				log_mboxf("Error", MB_OK, "MapViewOfFile failed with error code %d", GetLastError());
+			}
+			return nullptr;
+		}
+		it = this->views.insert(std::make_pair(group, view)).first;
+	}
+	return it->second + (size_t)(offset - groupOffset);
+}
@@ -3,341 +3,299 @@
 #include <list>
 #include <map>
 
-enum	ArgType
-{
-	ARG_NONE = 0x0000,
-	ARG_STACK = 0x0001,
-	ARG_LITERAL = 0x0002,
-	ARG_IMMEDIATE = 0x0004,
-	ARG_UNKNOWN = 0x0008, // Just display its value
-
-	MASK_FLOAT = 0x0010,
-	MASK_CMP = 0x0020,
-	MASK_BITWISE = 0x0040,
-	MASK_SIGNED = 0x0080,
-	MASK_TARGET = 0x0100,
-	MASK_STACKBASE = 0x0200, // Base address for a range of values on the stack. The next argument contains the number of stack elements to use.
-
-	ARG_FLOAT = ARG_IMMEDIATE | MASK_FLOAT,
-	ARG_CMP = ARG_IMMEDIATE | MASK_CMP,
-	ARG_BITWISE = ARG_IMMEDIATE | MASK_BITWISE,
-	ARG_SIGNED = ARG_IMMEDIATE | MASK_SIGNED,
-	ARG_TARGET = ARG_STACK | MASK_TARGET,
-	ARG_TARGET_OFF = ARG_STACK | MASK_TARGET | MASK_SIGNED, // Offset to a stackbase
-	ARG_STACKBASE = ARG_STACK | MASK_STACKBASE,
-};
-
-struct	OpcodeDescriptor
-{
-	const char*	name;
-	ArgType	arg0;
-	ArgType	arg1;
-	ArgType	arg2;
-	ArgType	arg3;
-};
-
-static std::vector<OpcodeDescriptor>	opcodes = {
-  { "line",		ARG_NONE,	ARG_IMMEDIATE,	ARG_NONE,	ARG_NONE },
-  { "load",		ARG_TARGET,	ARG_LITERAL,	ARG_NONE,	ARG_NONE },
-  { "loadint",		ARG_TARGET,	ARG_IMMEDIATE,	ARG_NONE,	ARG_NONE },
-  { "loadfloat",	ARG_TARGET,	ARG_FLOAT,	ARG_NONE,	ARG_NONE },
-  { "dload",		ARG_TARGET,	ARG_LITERAL,	ARG_TARGET,	ARG_LITERAL },
-  { "tailcall",		ARG_NONE,	ARG_STACK,	ARG_STACKBASE,	ARG_IMMEDIATE },
-  { "call",		ARG_TARGET_OFF,	ARG_STACK,	ARG_STACKBASE,	ARG_IMMEDIATE },
-  { "prepcall",		ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_TARGET },
-  { "prepcallk",	ARG_TARGET,	ARG_LITERAL,	ARG_STACK,	ARG_TARGET },
-  { "getk",		ARG_TARGET,	ARG_LITERAL,	ARG_STACK,	ARG_NONE },
-  { "move",		ARG_TARGET,	ARG_STACK,	ARG_NONE,	ARG_NONE },
-  { "newslot",		ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_TARGET },
-  { "delete",		ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_NONE },
-  { "set",		ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_STACK },
-  { "get",		ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_NONE },
-  { "eq",		ARG_TARGET,	ARG_UNKNOWN,	ARG_STACK,	ARG_IMMEDIATE }, // arg1 type: arg3 != 0 ? LITERAL : STACK
-  { "ne",		ARG_TARGET,	ARG_UNKNOWN,	ARG_STACK,	ARG_IMMEDIATE }, // arg1 type: arg3 != 0 ? LITERAL : STACK
-  { "add",		ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_NONE },
-  { "sub",		ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_NONE },
-  { "mul",	        ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_NONE },
-  { "div",	        ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_NONE },
-  { "mod",	        ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_NONE },
-  { "bitw",	        ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_BITWISE },
-  { "return",		ARG_IMMEDIATE,	ARG_UNKNOWN,	ARG_NONE,	ARG_NONE }, // If arg0 is not 0xFF, arg1 is a STACK. Else, it isn't used.
-  { "loadnulls",	ARG_TARGET,	ARG_IMMEDIATE,	ARG_NONE,	ARG_NONE }, // arg0 is a target and a stackbase.
-  { "loadroot",		ARG_TARGET,	ARG_NONE,	ARG_NONE,	ARG_NONE },
-  { "loadbool",		ARG_TARGET,	ARG_IMMEDIATE,	ARG_NONE,	ARG_NONE },
-  { "dmove",		ARG_TARGET,	ARG_STACK,	ARG_TARGET,	ARG_STACK },
-  { "jmp",		ARG_NONE,	ARG_SIGNED,	ARG_NONE,	ARG_NONE },
-  { "jcmp",		ARG_STACK,	ARG_SIGNED,	ARG_STACK,	ARG_CMP },
-  { "jz",		ARG_STACK,	ARG_SIGNED,	ARG_NONE,	ARG_NONE },
-  { "setouter",		ARG_TARGET,	ARG_IMMEDIATE,	ARG_STACK,	ARG_NONE }, // arg1 is an outer value
-  { "getouter",		ARG_TARGET,	ARG_IMMEDIATE,	ARG_NONE,	ARG_NONE }, // arg1 is an outer value
-  { "newobj",		ARG_TARGET,	ARG_UNKNOWN,	ARG_UNKNOWN,	ARG_IMMEDIATE /* enum NewObjectType */ }, // arg1 and arg2 depends on arg3
-  { "appendarray",	ARG_STACK,	ARG_UNKNOWN,	ARG_IMMEDIATE,	ARG_NONE }, // The type of arg2 depends on arg1
-  { "comparith",	ARG_STACK,	ARG_UNKNOWN,	ARG_STACK,	ARG_UNKNOWN },
-  { "inc",		ARG_STACK,	ARG_STACK,	ARG_STACK,	ARG_SIGNED },
-  { "incl",		ARG_NONE,	ARG_STACK,	ARG_NONE,	ARG_SIGNED },
-  { "pinc",		ARG_STACK,	ARG_STACK,	ARG_STACK,	ARG_SIGNED },
-  { "pincl",		ARG_NONE,	ARG_STACK,	ARG_NONE,	ARG_SIGNED },
-  { "cmp",		ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_CMP },
-  { "exists",		ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_NONE },
-  { "instanceof",	ARG_TARGET,	ARG_STACK,	ARG_STACK,	ARG_NONE },
-  { "and",		ARG_TARGET,	ARG_SIGNED,	ARG_STACK,	ARG_NONE },
-  { "or",		ARG_TARGET,	ARG_SIGNED,	ARG_STACK,	ARG_NONE },
-  { "neg",		ARG_TARGET,	ARG_STACK,	ARG_NONE,	ARG_NONE },
-  { "not",		ARG_TARGET,	ARG_STACK,	ARG_NONE,	ARG_NONE },
-  { "bwnot",		ARG_TARGET,	ARG_STACK,	ARG_NONE,	ARG_NONE },
-  { "closure",		ARG_TARGET,	ARG_IMMEDIATE,	ARG_NONE,	ARG_NONE }, // arg1 is a function
-  { "yield",		ARG_UNKNOWN,	ARG_STACK,	ARG_IMMEDIATE,	ARG_NONE }, // arg2 is a stack offset. If arg0 is not 0xFF, arg1 is a STACK. Else, it isn't used.
-  { "resume",		ARG_TARGET,	ARG_STACK,	ARG_NONE,	ARG_NONE },
-  { "foreach",		ARG_STACK,	ARG_SIGNED,	ARG_STACK,	ARG_NONE },
-  { "postforeach",	ARG_STACK,	ARG_SIGNED,	ARG_NONE,	ARG_NONE },
-  { "clone",		ARG_TARGET,	ARG_STACK,	ARG_NONE,	ARG_NONE },
-  { "typeof",		ARG_TARGET,	ARG_STACK,	ARG_NONE,	ARG_NONE },
-  { "pushtrap",		ARG_IMMEDIATE,	ARG_IMMEDIATE,	ARG_NONE,	ARG_NONE },
-  { "poptrap",		ARG_IMMEDIATE,	ARG_NONE,	ARG_NONE,	ARG_NONE },
-  { "throw",		ARG_STACK,	ARG_NONE,	ARG_NONE,	ARG_NONE },
-  { "newslota",		ARG_IMMEDIATE,	ARG_STACK,	ARG_STACK,	ARG_STACK },
-  { "getbase",		ARG_TARGET,	ARG_NONE,	ARG_NONE,	ARG_NONE },
-  { "close",		ARG_NONE,	ARG_STACK,	ARG_NONE,	ARG_NONE }
-};
-
-json_t *SquirrelTracer::arg_to_json(ArgType type, uint32_t arg)
-{
-	switch (type) {
-	case ARG_NONE:
-		return json_null();
-
-	case ARG_STACK:
-		return add_STK(arg);
-
-	case ARG_LITERAL:
-		return add_obj(&this->vm->ci->_literals[arg]);
-
-	case ARG_IMMEDIATE:
-		return json_integer(arg);
-
-	case ARG_UNKNOWN:
-		return json_string("(arg_type not supported yet)");
-
-	case ARG_FLOAT:
-		float farg;
-		memcpy(&farg, &arg, 4);
-		return json_real(farg);
-
-	case ARG_CMP: {
-		const char *names[] = {
-			"CMP_G",
-			nullptr,
-			"CMP_GE",
-			"CMP_L",
-			"CMP_LE",
-			"CMP_3W"
-		};
-		const char* name = "UNKNOWN";
-		if (arg >= 0 && arg <= 5 && names[arg])
-			name = names[arg];
-		return json_string(name);
-	}
-
-	case ARG_BITWISE: {
-		const char *names[] = {
-			"BW_AND",
-			nullptr,
-			"BW_OR",
-			"BW_XOR",
-			"BW_SHIFTL",
-			"BW_SHIFTR",
-			"BW_USHIFTR"
-		};
-		const char* name = "UNKNOWN";
-		if (arg >= 0 && arg <= 6 && names[arg])
-			name = names[arg];
-		return json_string(name);
-	}
-
-	case ARG_SIGNED: {
-		int32_t sarg;
-		memcpy(&sarg, &arg, 4);
-		return json_integer(sarg);
-	}
-
-	case ARG_TARGET:
-	case ARG_TARGET_OFF:
-		return json_string("TARGET");
-
-	case ARG_STACKBASE:
-		return json_string("(ARG_STACKBASE not supported yet)");
-
-	default:
-		return json_string("(error in the instructions table)");
-	}
-}
-
 void SquirrelTracer::add_instruction(SQInstruction *_i_)
 {
-	if (!this->enabled) {
+	if (this->profiler) {
+		this->profiler->count(this->vm, _i_, this->closureDB);
 		return;
 	}
-
-	OpcodeDescriptor *desc = &opcodes[_i_->op];
-	json_t *instruction = json_object();
-
-	json_object_set_new(instruction, "type", json_string("instruction"));
-	json_object_set_new(instruction, "fn", json_string(this->fn.c_str()));
-	json_object_set_new(instruction, "op", json_string(desc->name));
-
-	switch (_i_->op) {
-	case _OP_TAILCALL:
-	case _OP_CALL: {
-		json_object_set_new(instruction, "arg0", arg_to_json(desc->arg0, _i_->_arg0));
-		json_object_set_new(instruction, "arg1", arg_to_json(desc->arg1, _i_->_arg1));
-		json_t *callstack = json_array();
-		for (int i = _i_->_arg2; i < _i_->_arg2 + _i_->_arg3; i++)
-			json_array_append(callstack, add_STK(i));
-		json_object_set_new(instruction, "arg2", callstack);
-		json_object_set_new(instruction, "arg3", json_null());
-		break;
-	}
-
-	case _OP_EQ:
-	case _OP_NE:
-		json_object_set_new(instruction, "arg0", arg_to_json(desc->arg0, _i_->_arg0));
-		if (_i_->_arg3) {
-			json_object_set_new(instruction, "arg1", add_obj(&this->vm->ci->_literals[_i_->_arg1]));
-		}
-		else {
-			json_object_set_new(instruction, "arg1", add_STK(_i_->_arg1));
+	if (this->segments) {
+		uint64_t offset = this->writer->size();
+		if (this->segments->full(offset)) {
+			offset = this->roll_segment();
 		}
-		json_object_set_new(instruction, "arg2", arg_to_json(desc->arg2, _i_->_arg2));
-		json_object_set_new(instruction, "arg3", json_null());
-		break;
+		this->segments->instruction(offset);
+	}
 
-	case _OP_RETURN:
-	case _OP_YIELD:
-		json_object_set_new(instruction, "arg0", arg_to_json(desc->arg0, _i_->_arg0));
-		if (_i_->_arg0 != 0xFF) {
-			json_object_set_new(instruction, "arg1", add_STK(_i_->_arg1));
-		}
-		else {
-			json_object_set_new(instruction, "arg1", json_null());
-		}
-		json_object_set_new(instruction, "arg2", arg_to_json(desc->arg2, _i_->_arg2));
-		json_object_set_new(instruction, "arg3", arg_to_json(desc->arg3, _i_->_arg3));
-		break;
+	uint64_t start = this->decodeStats.enabled ? __rdtsc() : 0;
+	const InstructionPlan& plan = this->find_plan(_i_);
+	TraceInstruction& instruction = this->instruction;
 
-	case _OP_GETOUTER:
-	case _OP_SETOUTER:
-		json_object_set_new(instruction, "arg0", arg_to_json(desc->arg0, _i_->_arg0));
-		json_object_set_new(instruction, "arg1", add_obj(&this->vm->ci->_closure._unVal.pClosure->_outervalues[_i_->_arg1]));
-		json_object_set_new(instruction, "arg2", arg_to_json(desc->arg2, _i_->_arg2));
-		json_object_set_new(instruction, "arg3", arg_to_json(desc->arg3, _i_->_arg3));
-		break;
+	instruction.op = plan.op;
+	instruction.name = plan.name;
+	instruction.fn = this->fn;
 
-	/**
-	  * OP_CLOSURE will often be called with self->ci (or an object in it) being garbage.
-	  * Even with all these NULL checks, if self->ci is 0x00000003 (it happened), well... I can't do anything but crash.
-	  * So I'll just fallback to the default case that says "arg1 is an integer".
-
-	case _OP_CLOSURE: {
-		json_object_set_new(instruction, "arg0", arg_to_json(self, file, desc->arg0, _i_->_arg0));
-		SQObjectPtr *functions = nullptr;
-		if (self->ci) {
-			if (self->ci->_closure._type == OT_CLOSURE) {
-				SQClosure *closure = self->ci->_closure._unVal.pClosure;
-				if (closure->_function) {
-					functions = closure->_function->_functions;
-				}
-			}
-		}
-		if (functions) {
-			json_object_set_new(instruction, "arg1", add_obj(file, &functions[_i_->_arg1]));
+	if (this->writer->congested()) {
+		// The trace output can't keep up. Don't spend time on the arguments and their objects.
+		for (int i = 0; i < 4; i++) {
+			instruction.args[i] = TraceValue("(skipped: trace output congested)");
 		}
-		else {
-			json_object_set_new(instruction, "arg2", json_string("<null>"));
-		}
-		json_object_set_new(instruction, "arg2", arg_to_json(self, file, desc->arg2, _i_->_arg2));
-		json_object_set_new(instruction, "arg3", arg_to_json(self, file, desc->arg3, _i_->_arg3));
-		break;
+		this->writer->writeInstruction(instruction);
+		return;
 	}
-	*/
 
-	// TODO: _OP_NEWOBJ, _OP_APPENDARRAY, _OP_COMPARITH
+	if (++this->objEpoch == 0) {
+		this->objEpoch = 1; // 0 is the epoch of the new dumps
+	}
 
-	default:
-		json_object_set_new(instruction, "arg0", arg_to_json(desc->arg0, _i_->_arg0));
-		json_object_set_new(instruction, "arg1", arg_to_json(desc->arg1, _i_->_arg1));
-		json_object_set_new(instruction, "arg2", arg_to_json(desc->arg2, _i_->_arg2));
-		json_object_set_new(instruction, "arg3", arg_to_json(desc->arg3, _i_->_arg3));
-		break;
+	for (int i = 0; i < 4; i++) {
+		instruction.args[i] = this->plan_to_value(plan.args[i]);
+	}
+	if (this->decodeStats.enabled) {
+		this->decodeStats.ticks += __rdtsc() - start;
+		this->decodeStats.instructions++;
 	}
 
-	json_dumpf(instruction, this->file, JSON_COMPACT);
-	fwrite(",\n", 2, 1, this->file);
-	fflush(this->file);
-	json_decref(instruction);
+	this->dump_pending_objs();
+	this->writer->writeInstruction(instruction);
+	if (this->flight && this->flightObjs.size() >= this->flightObjsLimit) {
+		this->prune_flight_objs();
+	}
 }
 
-SquirrelTracer::SquirrelTracer()
-	: enabled(true)
+SquirrelTracer::SquirrelTracer(json_t *config)
+	: writer(nullptr), objs_list(SnapshotStore::create(config)), config(json_deep_copy(config)), filter(config), sampler(config),
+	profiler(nullptr), flight(nullptr), pendingTrigger(nullptr), strings(config), objEpoch(0), lastProto(nullptr), lastPlan(nullptr), traceFrames(false), segments(nullptr), runs(0), started(false)
 {
+	memset(&this->objStats, 0, sizeof(this->objStats));
+	this->pendingObjs.reserve(4096);
+	this->flushing = false;
+	this->flightObjsLimit = 65536;
+	this->sharedState = nullptr;
+	this->usePlans = !json_is_false(json_object_get(config, "decode_plans"));
+	this->load_delta_config(config);
+
+	LARGE_INTEGER qpc;
+	QueryPerformanceCounter(&qpc);
+	this->decodeStats.enabled = json_is_true(json_object_get(config, "decode_stats"));
+	this->decodeStats.instructions = 0;
+	this->decodeStats.ticks = 0;
+	this->decodeStats.tscStart = __rdtsc();
+	this->decodeStats.qpcStart = qpc.QuadPart;
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	this->qpcToNs = 1e9 / (double)frequency.QuadPart;
 	InitializeCriticalSection(&this->cs);
-	this->file = fopen("trace.json", "w");
-	fwrite("[\n", 2, 1, this->file);
+}
+
+void SquirrelTracer::set_mode(json_t *config)
+{
+	this->started = true;
+	if (this->flight && this->flight->onExit) {
+		this->flush_flight_recorder("mode change");
+	}
+	delete this->profiler;
+	delete this->flight;
+	delete this->writer;
+	delete this->segments;
+	this->profiler = nullptr;
+	this->flight = nullptr;
+	this->writer = nullptr;
+	this->segments = nullptr;
+	// The new output starts without any object or call frame.
+	this->objs_list.erase_if([](void*, ObjectDump&) { return true; });
+	this->flightObjs.clear();
+	this->segmentObjs.clear();
+	this->frameStacks.clear();
+	this->strings.clear();
+
+	std::string suffix;
+	if (++this->runs > 1) {
+		char run[16];
+		_snprintf(run, sizeof(run), "-%u", this->runs);
+		run[sizeof(run) - 1] = '\0';
+		suffix = run;
+	}
+
+	const char *mode = json_string_value(json_object_get(config, "mode"));
+	if (mode && strcmp(mode, "profile") == 0) {
+		this->profiler = new Profiler(config);
+		this->traceFrames = false;
+		return;
+	}
+	if (mode && strcmp(mode, "trace") != 0 && strcmp(mode, "flight_recorder") != 0) {
+		log_printf("Squirrel tracer: unknown mode \"%s\", falling back to trace.\n", mode);
+	}
+	if (mode && strcmp(mode, "flight_recorder") == 0) {
+		// The records are kept in memory, so they use the compact format.
+		this->flight = new FlightRecorder(config, suffix);
+		this->writer = new BinaryTraceWriter(this->flight->output());
+	}
+	else if (json_is_true(json_object_get(json_object_get(config, "segments"), "enabled"))) {
+		this->segments = new TraceSegments(config, suffix);
+		this->writer = TraceWriter::create(config, this->segments->open().c_str());
+	}
+	else {
+		this->writer = TraceWriter::create(config, ("trace" + suffix).c_str());
+	}
+	this->traceFrames = json_is_true(json_object_get(config, "frames"));
 }
 
 SquirrelTracer::~SquirrelTracer()
 {
-	fclose(this->file);
+	if (this->objStats.visited) {
+		log_printf("Squirrel tracer: %llu object visits, %llu (%.1f%%) skipped by the raw snapshot check, "
+			"%llu with an unchanged JSON dump, %llu objects written (%llu as a delta), %llu freed.\n",
+			this->objStats.visited,
+			this->objStats.rawUnchanged, this->objStats.rawUnchanged * 100.0 / this->objStats.visited,
+			this->objStats.jsonUnchanged, this->objStats.written, this->objStats.deltas, this->objStats.freed);
+	}
+	if (this->decodeStats.instructions) {
+		// The rdtsc frequency is calibrated against QueryPerformanceCounter over the whole session.
+		LARGE_INTEGER qpc, frequency;
+		QueryPerformanceCounter(&qpc);
+		QueryPerformanceFrequency(&frequency);
+		double ns = (double)(qpc.QuadPart - this->decodeStats.qpcStart) * 1e9 / frequency.QuadPart;
+		double ticksPerNs = (double)(__rdtsc() - this->decodeStats.tscStart) / ns;
+		log_printf("Squirrel tracer: %llu instructions, %.1f ns per instruction to decode the arguments (decode plans %s).\n",
+			this->decodeStats.instructions, this->decodeStats.ticks / ticksPerNs / this->decodeStats.instructions,
+			this->usePlans ? "enabled" : "disabled");
+	}
+	if (this->flight && this->flight->onExit) {
+		// Deleted from the exit hook, before the VM is torn down by the process exit, so the live
+		// objects are written too. If sq_vm_free reported the VM closed, only the instructions are.
+		this->flush_flight_recorder("exit");
+	}
+	delete this->profiler;
+	delete this->flight;
+	delete this->writer;
+	delete this->segments;
+	json_decref(this->config);
 	DeleteCriticalSection(&this->cs);
 }
 
-void SquirrelTracer::enter(SQVM *vm)
+bool SquirrelTracer::enter(SQVM *vm, SQInstruction *_i_)
 {
-	if (GetAsyncKeyState('O') & 0x8000) {
-		this->enabled = !this->enabled;
-		log_mboxf(NULL, MB_OK, "SquirrelTracer is now %s.\n"
-			"To toggle the SquirrelTracer state, press the 'O' key.",
-			this->enabled ? "enabled" : "disabled");
+	// The mode, the filters and the sampler are shared with apply_control, which may replace them.
+	EnterCriticalSection(&this->cs);
+	if (!this->started) {
+		this->set_mode(this->config);
 	}
-	if (!this->enabled) {
-		return;
+	this->sharedState = vm->_sharedstate;
+	// The frames are tracked on every instruction, before the filters and the sampling.
+	if (this->traceFrames) {
+		this->track_frames(vm);
 	}
-	EnterCriticalSection(&this->cs);
-	this->vm = vm;
-	this->fn = this->closureDB.get(vm->ci->_closure._unVal.pClosure).c_str();
+	// The flight recorder triggers fire even if the instruction isn't traced.
+	const char *trigger = this->flight ? this->flight->trigger(vm, _i_) : nullptr;
+	if (this->filter.opcodeTraced(_i_->op) && this->sampler.sample(vm)) {
+		SQClosure *closure = vm->ci->_closure._unVal.pClosure;
+		if (this->filter.closureTraced(closure, this->closureDB)) {
+			this->vm = vm;
+			this->fn = this->closureDB.file(closure);
+			// Flushed by leave(), so the triggering instruction is in the flight recorder.
+			this->pendingTrigger = trigger;
+			return true;
+		}
+	}
+	if (trigger) {
+		this->flush_flight_recorder(trigger);
+	}
+	LeaveCriticalSection(&this->cs);
+	return false;
 }
 
 void SquirrelTracer::leave()
 {
-	if (!this->enabled) {
-		return;
-	}
-	this->objs_list.unmapAll();
-	this->fn.clear();
 	this->vm = nullptr;
+	if (this->pendingTrigger) {
+		const char *trigger = this->pendingTrigger;
+		this->pendingTrigger = nullptr;
+		this->flush_flight_recorder(trigger);
+	}
 	LeaveCriticalSection(&this->cs);
 }
 
+size_t BpParam::getSlow(json_t *bp_info, x86_reg_t *regs)
+{
+	if (!this->claimed.exchange(true)) {
+		json_t *value = json_object_get(bp_info, this->key);
+		bool compiled = true;
+		if (json_is_integer(value)) {
+			this->expr.constant((size_t)json_integer_value(value));
+		}
+		else if (!json_is_string(value) || !this->expr.compile(json_string_value(value))) {
+			compiled = false;
+		}
+		if (compiled) {
+			this->bpInfo.store(bp_info, std::memory_order_release);
+		}
+	}
+	return json_object_get_immediate(bp_info, regs, this->key);
+}
+
+static json_t *config = nullptr;
 static SquirrelTracer *tracer = nullptr;
 
+// Control block shared with the external tools (sqtrace control).
+// If it can't be created, the tracer still works with a private one.
+static TraceControlMapping controlMapping;
+static TraceControlBlock privateControl;
+static TraceControlBlock *control = &privateControl;
+
+static SquirrelTracer *get_tracer()
+{
+	if (!tracer) {
+		tracer = new SquirrelTracer(config);
+	}
+	return tracer;
+}
+
+/**
+  * Toggles the tracer when the "toggle_key" from the "control" config is pressed.
+  * The key is polled from its own thread, so the VM thread only reads the control block.
+  */
+static DWORD WINAPI toggle_key_thread(LPVOID param)
+{
+	int key = (int)(uintptr_t)param;
+	for (;;) {
+		if (GetAsyncKeyState(key) & 0x8000) {
+			uint32_t state = control->state.fetch_xor(CONTROL_ENABLED) ^ CONTROL_ENABLED;
+			log_mboxf(NULL, MB_OK, "SquirrelTracer is now %s.\n"
+				"To toggle the SquirrelTracer state, press the '%c' key.",
+				(state & CONTROL_ENABLED) ? "enabled" : "disabled", key);
+			while (GetAsyncKeyState(key) & 0x8000) {
+				Sleep(10);
+			}
+		}
+		Sleep(50);
+	}
+}
+
+// Breakpoint parameters. They are compiled on the first hit.
+static BpParam executeSwitchThis("this");
+static BpParam executeSwitchInstruction("instruction");
+static BpParam readclosureClosure("closure");
+static BpParam vmFreeP("p");
+static BpParam fileNameFileName("file_name");
+
 /**
   * switch instruction in SQVM::execute
   * The breakpoint should cover the jmp [opcode*4+jump_table_addr]
   */
 extern "C" int BP_SQVM_execute_switch(x86_reg_t *regs, json_t *bp_info)
 {
+	// Disabled, with no config to apply.
+	uint32_t state = control->state.load(std::memory_order_acquire);
+	if (state == 0) {
+		return 1;
+	}
+
 	// Parameters
 	// ----------
-	SQVM *vm = (SQVM*)json_object_get_immediate(bp_info, regs, "this");
-	SQInstruction *_i_ = (SQInstruction*)json_object_get_immediate(bp_info, regs, "instruction");
+	SQVM *vm = (SQVM*)executeSwitchThis.get(bp_info, regs);
+	SQInstruction *_i_ = (SQInstruction*)executeSwitchInstruction.get(bp_info, regs);
 	// ----------
 
-	if (!tracer) {
-		tracer = new SquirrelTracer();
+	SquirrelTracer *tracer = get_tracer();
+	if (state & CONTROL_CONFIG_PENDING) {
+		tracer->apply_control(control);
 	}
 
-	tracer->enter(vm);
-	tracer->add_instruction(_i_);
-	tracer->leave();
+	if ((state & CONTROL_ENABLED) && tracer->enter(vm, _i_)) {
+		tracer->add_instruction(_i_);
+		tracer->leave();
+	}
 
 	return 1;
 }
@@ -352,11 +310,47 @@ extern "C" int BP_sq_readclosure(x86_reg_t *regs, json_t *bp_info)
 {
 	// Parameters
 	// ----------
-	SQObjectPtr *closure = (SQObjectPtr*)json_object_get_immediate(bp_info, regs, "closure");
+	SQObjectPtr *closure = (SQObjectPtr*)readclosureClosure.get(bp_info, regs);
+	// ----------
+
+	// The files are known even if the tracer is disabled when they are loaded.
+	if (closure) {
+		get_tracer()->load_closure(closure->_unVal.pClosure);
+	}
+	return 1;
+}
+
+/**
+  * sq_vm_free
+  * Every object released by the VM goes through it (sq_delete), so its snapshot can be dropped
+  * before the allocator gives its address to another object.
+  * Put the breakpoint at the beginning of the function, with "p": "[esp+4]".
+  * The address isn't known for any game version yet. Its cavesize depends on the prologue,
+  * so it goes in the version file with the address.
+  */
+extern "C" int BP_sq_vm_free(x86_reg_t *regs, json_t *bp_info)
+{
+	// Parameters
+	// ----------
+	void *p = (void*)vmFreeP.get(bp_info, regs);
 	// ----------
 
-	if (tracer && closure) {
-		tracer->closureDB[closure->_unVal.pClosure] = tracer->closureDB.lastFileName;
+	if (tracer && p) {
+		tracer->remove_obj(p);
+	}
+	return 1;
+}
+
+/**
+  * SQVM::CallErrorHandler
+  * Flushes the flight recorder when a script error isn't caught.
+  * Put the breakpoint at the beginning of the function.
+  * Like sq_vm_free, the address isn't known for any game version yet.
+  */
+extern "C" int BP_SQVM_CallErrorHandler(x86_reg_t *regs, json_t *bp_info)
+{
+	if (tracer) {
+		tracer->script_error();
 	}
 	return 1;
 }
@@ -369,11 +363,11 @@ int BP_file_name_for_squirrel(x86_reg_t *regs, json_t *bp_info)
 {
 	// Parameters
 	// ----------
-	const char *filename = (const char*)json_object_get_immediate(bp_info, regs, "file_name");
+	const char *filename = (const char*)fileNameFileName.get(bp_info, regs);
 	// ----------
 
-	if (tracer && filename && strcmp(PathFindExtension(filename), ".nut") == 0) {
-		tracer->closureDB.lastFileName = filename;
+	if (filename && strcmp(PathFindExtension(filename), ".nut") == 0) {
+		get_tracer()->closureDB.setLastFile(filename);
 	}
 	return 1;
 }
@@ -384,9 +378,52 @@ int __stdcall thcrap_plugin_init()
 	if (squirrel_tracer_removed == 1) {
 		return 1;
 	}
+	config = stack_json_resolve("squirrel_tracer.js", NULL);
+
+	// Without it, the snapshots of the freed objects are kept, and no "freed" records are written.
+	json_t *breakpoints = json_object_get(runconfig_get(), "breakpoints");
+	if (!json_object_get(json_object_get(breakpoints, "sq_vm_free"), "addr")) {
+		log_printf("Squirrel tracer: no address for the sq_vm_free breakpoint, the freed objects won't be reported.\n");
+	}
+	if (!json_object_get(json_object_get(breakpoints, "SQVM_CallErrorHandler"), "addr")) {
+		log_printf("Squirrel tracer: no address for the SQVM_CallErrorHandler breakpoint, "
+			"the flight recorder won't be flushed on script errors.\n");
+	}
+
+	json_t *controlConfig = json_object_get(config, "control");
+	uint32_t state = json_is_false(json_object_get(controlConfig, "enabled")) ? 0 : CONTROL_ENABLED;
+	if (controlMapping.create(GetCurrentProcessId(), state)) {
+		control = controlMapping.block;
+	}
+	else {
+		log_printf("Squirrel tracer: cannot create the control block, sqtrace control won't work.\n");
+		control->state = state;
+	}
+
+	const char *toggleKey = json_string_value(json_object_get(controlConfig, "toggle_key"));
+	if (toggleKey && toggleKey[0]) {
+		// The virtual-key codes of the letters and digits are their uppercase ASCII codes.
+		HANDLE thread = CreateThread(NULL, 0, toggle_key_thread, (LPVOID)(uintptr_t)toupper((unsigned char)toggleKey[0]), 0, NULL);
+		if (thread) {
+			CloseHandle(thread);
+		}
+	}
 	return 0;
 }
 
+/**
+  * Called by thcrap from its ExitProcess detour, before the other threads are killed and
+  * outside of the loader lock. Deleting the tracer waits for the async outputs to write
+  * the records still in their buffers.
+  */
+extern "C" void squirrel_tracer_mod_exit()
+{
+	control->state = 0;
+	SquirrelTracer *exitingTracer = tracer;
+	tracer = nullptr;
+	delete exitingTracer;
+}
+
 BOOL APIENTRY DllMain( HMODULE hModule,
                        DWORD  ul_reason_for_call,
                        LPVOID lpReserved
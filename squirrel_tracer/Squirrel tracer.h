@@ -33,97 +33,1067 @@
 
 #ifdef __cplusplus
 
+#include "TraceFormat.h"
+#include "TraceControl.h"
+#include "TraceCompression.h"
+#include "BpExpression.h"
+#include "FlatPtrMap.h"
+#include "JsonStream.h"
 #include <map>
-#include <stack>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include <deque>
 
-class ObjectDump
+// Value of an instruction argument or of an object field, before it is written to the trace.
+struct TraceValue
+{
+	TraceValueType type;
+	union {
+		int32_t i;
+		float f;
+		const void *p;
+		const char *s; // Must point to a string that lives as long as the tracer
+	};
+
+	TraceValue() : type(TV_NULL), i(0) {}
+	TraceValue(TraceValueType type, int32_t i) : type(type), i(i) {}
+	TraceValue(TraceValueType type, const void *p) : type(type), p(p) {}
+	TraceValue(float f) : type(TV_FLOAT), f(f) {}
+	TraceValue(const char *s) : type(TV_STRING), s(s) {}
+};
+
+void value_to_json(JsonStream& json, const TraceValue& value);
+
+// File or function name interned in a NameTable.
+struct TraceName
+{
+	uint32_t id;
+	const char *str;
+};
+
+/**
+  * File and function names, interned into small IDs. The records only carry the ID,
+  * and the writers write the name the first time they see its ID.
+  * The strings never move, so the TraceNames stay valid as long as the table.
+  */
+class NameTable
+{
+private:
+	std::unordered_map<std::string, uint32_t> ids;
+	std::vector<const char*> strings; // By ID. The keys of an unordered_map never move.
+
+public:
+	uint32_t intern(const char *str)
+	{
+		auto it = this->ids.find(str);
+		if (it != this->ids.end()) {
+			return it->second;
+		}
+		uint32_t id = this->strings.size();
+		it = this->ids.insert(std::make_pair(std::string(str), id)).first;
+		this->strings.push_back(it->first.c_str());
+		return id;
+	}
+
+	TraceName get(uint32_t id) const
+	{
+		TraceName name = { id, this->strings[id] };
+		return name;
+	}
+
+	TraceName name(const char *str) { return this->get(this->intern(str)); }
+};
+
+struct TraceInstruction
+{
+	uint8_t op;
+	const char *name;
+	TraceName fn;
+	TraceValue args[4];
+	std::vector<TraceValue> array; // Elements of the TV_ARRAY argument, if any.
+};
+
+// Start or end of a call frame.
+struct TraceFrame
+{
+	uint8_t event; // FrameEvent
+	const void *vm;
+	const void *closure;
+	TraceName fn;
+	TraceName name;
+	uint64_t time; // Nanoseconds since the tracer started
+};
+
+// Destination of the encoded records.
+class TraceOutput
+{
+public:
+	virtual ~TraceOutput() {}
+
+	// Writes one or more complete records. Returns false if they were dropped.
+	// Instructions are flushed in synchronous mode, and may be dropped when the async output is full.
+	virtual bool write(const void *data, size_t size, bool isInstruction) = 0;
+	// True when the output can't keep up and the tracer should only record which instructions run.
+	virtual bool congested() { return false; }
+
+	// Creates the output selected by the "output" object of the tracer config.
+	static TraceOutput *create(json_t *config, const char *fn);
+};
+
+// Writes directly to the trace file, on the calling thread.
+class FileTraceOutput : public TraceOutput
+{
+private:
+	FILE *file;
+
+public:
+	FileTraceOutput(const char *fn);
+	~FileTraceOutput();
+
+	bool write(const void *data, size_t size, bool isInstruction);
+};
+
+/**
+  * Pushes the records into a preallocated ring buffer, and writes them to the file
+  * from a background thread. The VM thread (holding SquirrelTracer::cs) is the only producer,
+  * so the ring buffer only needs the head and tail counters to be atomic.
+  */
+class AsyncTraceOutput : public TraceOutput
+{
+public:
+	enum Backpressure
+	{
+		BACKPRESSURE_BLOCK,   // Wait for the writer thread
+		BACKPRESSURE_DROP,    // Drop the instructions that don't fit in the buffer
+		BACKPRESSURE_DEGRADE, // Stop dumping arguments when the buffer is 3/4 full, and wait if it is full
+	};
+
+private:
+	FILE *file;
+	char *ring;
+	size_t ringSize; // Power of 2
+	// Total number of bytes pushed and written. The used size is head - tail.
+	std::atomic<size_t> head;
+	std::atomic<size_t> tail;
+	std::atomic<bool> stop;
+	std::atomic<bool> stopped;
+	std::atomic<bool> draining; // Between the writes of drain() and the tail update
+	bool broken; // The writer thread died in the middle of a write
+	HANDLE thread;
+
+	Backpressure backpressure;
+	unsigned int dropped;
+	unsigned int degraded;
+
+	static DWORD WINAPI threadProc(LPVOID self);
+	bool drain();
+	bool writerAlive();
+
+public:
+	AsyncTraceOutput(const char *fn, size_t bufferSize, Backpressure backpressure);
+	~AsyncTraceOutput();
+
+	bool write(const void *data, size_t size, bool isInstruction);
+	bool congested();
+};
+
+/**
+  * Compresses the records into independent LZ4 frames (see TraceCompression.h), written with their
+  * side index by a background thread. The VM thread only copies the records into the frame buffer
+  * it is filling. A frame is queued when it reaches the frame size, or by the background thread
+  * once its first record is more than a second old, so the file doesn't lag far behind the game,
+  * even when the game stops running scripts. The frames always end on a record boundary.
+  */
+class CompressedTraceOutput : public TraceOutput
+{
+private:
+	FILE *file;
+	FILE *index;
+	Lz4 lz4;
+	std::string compressed;
+	uint64_t offset;
+	uint64_t rawOffset;
+
+	// Ring of frame buffers. The VM thread fills frames[head % frames.size()], the background
+	// thread compresses the ones before it.
+	std::vector<std::string> frames;
+	size_t frameSize;
+	DWORD frameStart; // GetTickCount() when the first record of the current frame was written
+	// Held while the current frame is filled or queued, so both threads can queue it.
+	CRITICAL_SECTION frameCs;
+	std::atomic<size_t> head;
+	std::atomic<size_t> tail;
+	std::atomic<bool> stop;
+	std::atomic<bool> stopped;
+	std::atomic<bool> compressing; // Between the writes of compressFrames() and the tail update
+	bool broken; // The background thread died in the middle of a write
+	HANDLE thread;
+
+	AsyncTraceOutput::Backpressure backpressure;
+	unsigned int dropped;
+	unsigned int degraded;
+
+	static DWORD WINAPI threadProc(LPVOID self);
+	bool compressFrames();
+	void queueFrame();
+	bool queueFrameOlderThan(DWORD age);
+	bool writerAlive();
+
+public:
+	CompressedTraceOutput(const char *fn, size_t frameSize, size_t frameCount, AsyncTraceOutput::Backpressure backpressure);
+	~CompressedTraceOutput();
+
+	bool write(const void *data, size_t size, bool isInstruction);
+	bool congested();
+};
+
+/**
+  * Output of the flight recorder mode: keeps the last records in a ring buffer in memory,
+  * and writes nothing until it is flushed. The first write (the trace header) and the string
+  * and opcode records are kept apart and never evicted, so every flush is a complete binary trace.
+  */
+class FlightRecorderOutput : public TraceOutput
+{
+private:
+	std::string state;
+	// Every record is stored with a uint32_t size before it, and may wrap around the end.
+	char *ring;
+	size_t ringSize;
+	size_t tail; // Offset of the oldest record
+	size_t used;
+	FILE *file; // Destination of the writes during a flush
+
+	void ringCopy(size_t offset, void *out, size_t size) const;
+
+public:
+	FlightRecorderOutput(size_t bufferSize);
+	~FlightRecorderOutput();
+
+	bool write(const void *data, size_t size, bool isInstruction);
+
+	// Writes the header, strings and opcodes to file. Until endFlush, the records go to file.
+	void beginFlush(FILE *file);
+	// Address of every object referenced by the buffered instructions.
+	void pointers(std::vector<uint32_t>& out) const;
+	// Writes the buffered records to the file, and empties the buffer.
+	void endFlush();
+};
+
+class TraceWriter
+{
+protected:
+	TraceOutput *output;
+	uint64_t bytesWritten;
+
+	// The dropped records don't count in the size of the trace.
+	void write(const void *data, size_t size, bool isInstruction)
+	{
+		if (this->output->write(data, size, isInstruction)) {
+			this->bytesWritten += size;
+		}
+	}
+
+public:
+	TraceWriter(TraceOutput *output) : output(output), bytesWritten(0) {}
+	virtual ~TraceWriter() { delete this->output; }
+
+	virtual void writeInstruction(const TraceInstruction& instruction) = 0;
+	// content is the JSON dump of the object content.
+	virtual void writeObject(const void *address, const char *content, size_t size) = 0;
+	// content is the JSON delta of a table or array since its last record (see TraceFormat.h).
+	virtual void writeDelta(const void *address, const char *content, size_t size) = 0;
+	// The object at this address, previously written with writeObject, was released by the VM.
+	virtual void writeFreed(const void *address) = 0;
+	virtual void writeFrame(const TraceFrame& frame) = 0;
+	// Content of a string pool ID.
+	virtual void writeString(uint32_t id, const char *str, size_t size) = 0;
+
+	bool congested() { return this->output->congested(); }
+	// Size of the trace so far, before compression.
+	uint64_t size() const { return this->bytesWritten; }
+
+	// Creates the writer selected by the "format" field of the tracer config,
+	// for the file name followed by the extension of the format.
+	static TraceWriter *create(json_t *config, const char *name);
+};
+
+// Writes trace.json
+class JsonTraceWriter : public TraceWriter
+{
+private:
+	JsonStream json;
+	std::vector<bool> namesWritten; // By NameTable ID
+
+	// Writes the name record of a name seen for the first time.
+	void writeName(const TraceName& name);
+
+public:
+	JsonTraceWriter(TraceOutput *output);
+	~JsonTraceWriter();
+
+	void writeInstruction(const TraceInstruction& instruction);
+	void writeObject(const void *address, const char *content, size_t size);
+	void writeDelta(const void *address, const char *content, size_t size);
+	void writeFreed(const void *address);
+	void writeFrame(const TraceFrame& frame);
+	void writeString(uint32_t id, const char *str, size_t size);
+};
+
+// Writes trace.bin. See TraceFormat.h for the format.
+class BinaryTraceWriter : public TraceWriter
+{
+private:
+	std::unordered_map<std::string, uint32_t> strings;
+	bool opcodeWritten[256];
+	std::vector<uint32_t> nameStrings; // String ID of every NameTable ID
+	std::vector<BinaryValue> array;
+	// The string and opcode records are written separately from the instruction that needs them,
+	// because the instruction may be dropped.
+	std::string stateBuffer;
+	std::string buffer;
+
+	uint32_t internString(const char *str);
+	uint32_t internName(const TraceName& name);
+	BinaryValue encodeValue(const TraceValue& value);
+
+public:
+	BinaryTraceWriter(TraceOutput *output);
+
+	void writeInstruction(const TraceInstruction& instruction);
+	void writeObject(const void *address, const char *content, size_t size);
+	void writeDelta(const void *address, const char *content, size_t size);
+	void writeFreed(const void *address);
+	void writeFrame(const TraceFrame& frame);
+	void writeString(uint32_t id, const char *str, size_t size);
+};
+
+// Raw memory the dump of an object depends on.
+struct RawSnapshot
+{
+	const void *data;
+	size_t size;
+	// Out-of-line storage (table nodes, array values, string characters...)
+	const void *extra;
+	size_t extraSize;
+};
+
+/**
+  * Storage for the raw snapshots and JSON dumps of the objects.
+  * The memory is allocated in big slabs, and the blocks are addressed by their offset in the store.
+  * Freed blocks are reused by the next allocation with the same rounded size.
+  */
+class SnapshotStore
 {
 private:
+	uint64_t top; // Offset of the first unused byte
+	std::unordered_map<size_t, std::vector<uint64_t>> freeLists;
+	bool failed; // addSlabs failed once. The store doesn't try to grow again.
+
+protected:
+	size_t slabSize;
+	size_t slabCount;
+
+	// Appends count contiguous slabs to the store. Returns false, with the store unchanged, if it can't.
+	virtual bool addSlabs(size_t count) = 0;
+
+public:
+	static const uint64_t NONE = 0xFFFFFFFFFFFFFFFFull;
+
+	SnapshotStore(size_t slabSize);
+	virtual ~SnapshotStore() {}
+
+	// Returns NONE if the store is full and can't grow.
+	uint64_t alloc(size_t size);
+	void release(uint64_t offset, size_t size);
+	// The returned pointer is valid until the next call to alloc or get.
+	// Returns nullptr if the block can't be mapped.
+	virtual void *get(uint64_t offset, size_t size) = 0;
+
+	// Creates the store selected by the "snapshots" object of the tracer config.
+	static SnapshotStore *create(json_t *config);
+};
+
+class MemorySnapshotStore : public SnapshotStore
+{
+private:
+	// One entry per slab. A group of slabs allocated together is contiguous in memory.
+	std::vector<char*> slabs;
+	std::vector<char*> allocations;
+
+protected:
+	bool addSlabs(size_t count);
+
+public:
+	MemorySnapshotStore(size_t slabSize);
+	~MemorySnapshotStore();
+
+	void *get(uint64_t offset, size_t size);
+};
+
+// Spills the snapshots to a temporary file, mapped one group of slabs at a time.
+class FileSnapshotStore : public SnapshotStore
+{
+private:
+	std::string fn;
+	HANDLE hFile; // Created by the first addSlabs
 	HANDLE hMap;
+	// First slab of the group each slab belongs to, and size of each group.
+	std::vector<size_t> groupStart;
+	std::map<size_t, size_t> groupSize;
+	std::map<size_t, char*> views; // Mapped groups
+	size_t maxViews;
+
+	void unmapAll();
+
+protected:
+	bool addSlabs(size_t count);
+
+public:
+	FileSnapshotStore(const char *fn, size_t slabSize, size_t maxViews);
+	~FileSnapshotStore();
+
+	void *get(uint64_t offset, size_t size);
+};
 
-	void *pointer;
+class ObjectDump
+{
+private:
+	SnapshotStore *store;
+	const void *address;
+	// Raw snapshot followed by the JSON dump
+	uint64_t offset;
 	size_t size;
-	json_t *json;
 	size_t json_dump_size;
 
-	void map();
 	void release();
 
 public:
-	ObjectDump();
+	uint32_t epoch; // Last instruction that visited this object (see SquirrelTracer::objEpoch).
+	uint32_t deltas; // Delta records written since the last full dump
+
+	ObjectDump(SnapshotStore *store);
 	ObjectDump(const ObjectDump& other);
-	ObjectDump(const void *pointer, size_t size, json_t *json);
+	ObjectDump(ObjectDump&& other);
 	~ObjectDump();
 	ObjectDump& operator=(const ObjectDump& other);
+	ObjectDump& operator=(ObjectDump&& other);
 
-	operator bool();
-	void set(const void *pointer, size_t size, json_t *json);
-	bool equal(const void *mem_dump, size_t size);
-	bool equal(const json_t *json);
-	void writeToFile(FILE *file);
-
-	void unmap();
+	operator bool() const;
+	// Returns false, with the dump left empty, if the store is full or can't be mapped.
+	bool set(const void *address, const RawSnapshot& raw, const JsonStream& json);
+	bool equal(const RawSnapshot& raw);
+	bool equal(const JsonStream& json);
+	// Raw snapshot of the last set(), or nullptr. Valid until the next call to the store.
+	const char *snapshot(size_t& size);
 };
 
 class ObjectDumpCollection
 {
 private:
-	std::map<void*, ObjectDump> map;
-	std::stack<ObjectDump*> mappedObjects;
+	SnapshotStore *store;
+	FlatPtrMap<void*, ObjectDump> map;
 
 public:
-	ObjectDumpCollection();
+	ObjectDumpCollection(SnapshotStore *store);
 	~ObjectDumpCollection();
 
+	// The returned reference is invalidated when another dump is added.
 	ObjectDump& operator[](void* key);
-	void unmapAll();
+	// Returns false if there was no dump for this address.
+	bool erase(void* key);
+	// Drops every dump for which pred(address, dump) is true.
+	template<typename Pred> size_t erase_if(Pred pred) { return this->map.erase_if(pred); }
 };
 
-class ClosureDB : public std::map<SQClosure*, std::string>
+// Names of a closure, in ClosureDB::names.
+struct ClosureNames
+{
+	uint32_t file;
+	uint32_t function;
+};
+
+class ClosureDB : public FlatPtrMap<SQClosure*, ClosureNames>
 {
 private:
 	SQClosure * lastClosure; // Closure for the last instruction.
-	std::string lastClosureFn; // File name for the last instruction. Used for caching.
+	ClosureNames lastNames; // Names for the last instruction. Used for caching.
+	uint32_t lastFile; // File name of the last nut file loaded.
+
+	uint32_t functionName(SQClosure *closure);
 
 public:
-	std::string lastFileName; // File name of the last nut file loaded.
+	NameTable names;
 
 	ClosureDB();
 	~ClosureDB();
 
-	const std::string& get(SQClosure *closure);
+	const ClosureNames& get(SQClosure *closure);
+	TraceName file(SQClosure *closure) { return this->names.get(this->get(closure).file); }
+	TraceName function(SQClosure *closure) { return this->names.get(this->get(closure).function); }
+	// Called when a nut file is opened. Its closures are loaded just after.
+	void setLastFile(const char *fn) { this->lastFile = this->names.intern(fn); }
+	// Adds a closure loaded from the last nut file.
+	void load(SQClosure *closure);
+	void erase(SQClosure *closure);
+};
+
+/**
+  * Profile mode ("mode": "profile"): counts the executed instructions instead of tracing them.
+  * The "profile" config object sets the report files ("report" for the text report,
+  * "callgrind" for KCachegrind) and the time between 2 reports in seconds ("interval",
+  * 0 to only write them at exit).
+  */
+class Profiler
+{
+private:
+	// Counters of one VM. Each VM has its own cache lines, so the VMs running on different threads
+	// never write to the same line.
+	struct __declspec(align(64)) VmProfile
+	{
+		uint64_t opcodes[64];
+		// Counters of every function, indexed by instruction.
+		// Cache-line aligned arrays of proto->_ninstructions entries.
+		FlatPtrMap<SQFunctionProto*, uint64_t*> functions;
+		SQFunctionProto *lastProto; // Function of the last instruction. Used for caching.
+		uint64_t *lastCounts;
+		size_t lastSize; // Number of counters in lastCounts
+	};
+
+	// What the reports need to know about a function. It is copied when the function
+	// is first executed, because the function may be released before the report.
+	struct FunctionInfo
+	{
+		std::string file;
+		std::string name;
+		std::vector<SQInteger> lines; // Line of each instruction
+		std::vector<bool> lineOps;    // The instruction is a _OP_LINE
+	};
+
+	// Counters of the functions with the same file and name, by line.
+	struct FunctionReport
+	{
+		uint64_t instructions;
+		std::map<SQInteger, uint64_t> lineCosts; // Instructions executed on each line
+		std::map<SQInteger, uint64_t> lineHits;  // Executions of the _OP_LINE of each line
+
+		FunctionReport() : instructions(0) {}
+	};
+	typedef std::map<std::pair<std::string, std::string>, FunctionReport> Report;
+
+	FlatPtrMap<SQVM*, VmProfile*> vms;
+	SQVM *lastVm; // Used for caching
+	VmProfile *lastVmProfile;
+	FlatPtrMap<SQFunctionProto*, FunctionInfo> functions;
+
+	// Counters of the released VMs and functions.
+	uint64_t retiredOpcodes[64];
+	Report retired;
+
+	std::string reportFn;
+	std::string callgrindFn;
+	DWORD interval; // ms
+	DWORD lastReport;
+	uint32_t sinceCheck; // Instructions since the last time check
+
+	VmProfile *getVm(SQVM *vm);
+	uint64_t *getCounts(VmProfile *profile, SQClosure *closure, ClosureDB& closureDB);
+	void fold(SQFunctionProto *proto, const uint64_t *counts, Report& report);
+	void freeVm(VmProfile *profile);
+
+public:
+	Profiler(json_t *config);
+	~Profiler();
+
+	void count(SQVM *vm, const SQInstruction *_i_, ClosureDB& closureDB)
+	{
+		VmProfile *profile = vm == this->lastVm ? this->lastVmProfile : this->getVm(vm);
+		profile->opcodes[_i_->op & 63]++;
+
+		// A different size means a new function at the address of a released one.
+		SQClosure *closure = vm->ci->_closure._unVal.pClosure;
+		if (closure->_function != profile->lastProto || (size_t)closure->_function->_ninstructions != profile->lastSize) {
+			profile->lastCounts = this->getCounts(profile, closure, closureDB);
+			profile->lastProto = closure->_function;
+			profile->lastSize = (size_t)closure->_function->_ninstructions;
+		}
+		size_t index = _i_ - closure->_function->_instructions;
+		if (index < profile->lastSize) {
+			profile->lastCounts[index]++;
+		}
+
+		if (this->interval && ++this->sinceCheck >= 65536) {
+			this->sinceCheck = 0;
+			if (GetTickCount() - this->lastReport >= this->interval) {
+				this->report();
+			}
+		}
+	}
+	// Moves the counters of a released VM or function to the retired counters.
+	void remove(void *o);
+	// Writes the text report and the callgrind file.
+	void report();
+};
+
+/**
+  * Flight recorder mode ("mode": "flight_recorder", configured by the "flight_recorder" object).
+  * The instructions are written to a FlightRecorderOutput, and the objects aren't dumped.
+  * When a trigger fires, the buffer is written to a new binary trace ("file"-1.bin, "file"-2.bin...),
+  * with the state of the objects it references that are still alive at that time.
+  * The triggers are the opcodes in "trigger_opcodes", the start of the functions in
+  * "trigger_functions" (wildcards allowed), the Squirrel error handler (BP_SQVM_CallErrorHandler),
+  * and the process exit if "on_exit" is true.
+  */
+class FlightRecorder
+{
+private:
+	FlightRecorderOutput *recorderOutput; // Owned by the trace writer
+	bool triggerOps[256];
+	std::vector<std::string> triggerFunctions;
+	FlatPtrMap<SQFunctionProto*, bool> functionTriggers; // Computed once per function
+	std::string fileBase;
+	unsigned int files;
+	unsigned int maxFiles;
+
+public:
+	bool onExit;
+
+	// suffix is appended to the "file" of the config.
+	FlightRecorder(json_t *config, const std::string& suffix);
+
+	FlightRecorderOutput *output() { return this->recorderOutput; }
+	// Returns the trigger fired by this instruction, or nullptr.
+	const char *trigger(SQVM *vm, const SQInstruction *_i_);
+	// Opens the file of the next flush. Returns nullptr when "max_files" is reached.
+	FILE *openFile(std::string& fn);
+	// Forgets a released function.
+	void erase(SQFunctionProto *proto) { this->functionTriggers.erase(proto); }
+};
+
+/**
+  * Segmented trace ("segments" config object, with "enabled": true): the trace is cut into
+  * <file>.0001.json, <file>.0002.json... (or .bin) of "max_size" MB or "max_instructions"
+  * instructions. Every segment can be read on its own: it starts with the dumps of the live objects.
+  * When the closed segments use more than "max_total_size" MB, the oldest ones are deleted.
+  * The seek index (<file>.idx, see TraceFormat.h) gives the segment and offset of the first
+  * instruction of every segment, and of every "index_interval" instructions after it.
+  */
+class TraceSegments
+{
+private:
+	std::string fileBase;
+	uint64_t maxSize;
+	uint64_t maxInstructions;
+	uint64_t maxTotalSize;
+	uint64_t indexInterval;
+	FILE *index;
+
+	unsigned int segment; // Number of the current segment
+	std::string current;  // Its file name, without the extension
+	uint64_t instructions; // Sequence number of the next instruction
+	uint64_t segmentStart; // Sequence number of the first instruction of the current segment
+	std::deque<std::pair<std::string, uint64_t>> closed; // Segments still on disk, with their size
+	uint64_t totalSize;
+
+public:
+	// suffix is appended to the "file" of the config.
+	TraceSegments(json_t *config, const std::string& suffix);
+	~TraceSegments();
+
+	// Closes the current segment, if any, deletes the old ones over the limit, and returns
+	// the file name of the next one, without the extension.
+	std::string open();
+	// True if the current segment should be closed before the next instruction.
+	bool full(uint64_t size) const;
+	// Called before the records of every instruction, with the current size of the segment.
+	void instruction(uint64_t offset);
+};
+
+/**
+  * Chooses the instructions to trace, for always-on tracing. Configured by the "sampling" object:
+  * - "mode": "none" traces everything, "instructions" traces 1 instruction in "rate",
+  *   "frames" traces whole call frames, 1 in "rate", and "bursts" traces "burst_length"
+  *   instructions every "burst_interval" milliseconds.
+  * The sampled records stay self-contained: an object is compared against its last written dump,
+  * so the objects changed while sampling was off are written again when they are referenced.
+  * Only called from the VM thread.
+  */
+class Sampler
+{
+public:
+	enum Mode
+	{
+		SAMPLE_NONE,
+		SAMPLE_INSTRUCTIONS,
+		SAMPLE_FRAMES,
+		SAMPLE_BURSTS,
+	};
+
+private:
+	Mode mode;
+	uint32_t rate;
+	uint32_t counter;
+
+	// Frame sampling: the decision for every call frame of the last VM, by depth.
+	struct Frame
+	{
+		SQClosure *closure;
+		bool sampled;
+	};
+	std::vector<Frame> frames;
+	SQVM *lastVm;
+	size_t lastDepth;
+
+	// Burst sampling
+	uint32_t burstLength;
+	uint32_t burstInterval;
+	uint32_t burstRemaining;
+	DWORD burstStart;
+
+	// Statistics, logged when the sampler is destroyed.
+	uint64_t seen;
+	uint64_t traced;
+
+	bool sampleFrame(SQVM *vm);
+	bool sampleBurst();
+
+public:
+	Sampler(json_t *config);
+	~Sampler();
+
+	// Reads the "sampling" object again. The statistics are kept.
+	void load(json_t *config);
+
+	// Returns true if the instruction about to be executed by vm should be traced.
+	bool sample(SQVM *vm);
+};
+
+enum ArgPlanKind : uint8_t
+{
+	PLAN_VALUE,   // The value is known when the function is loaded.
+	PLAN_STACK,   // Stack slot value.i
+	PLAN_LITERAL, // Literal value.i of the running function
+	PLAN_OUTER,   // Outer value value.i of the running closure
+	PLAN_RANGE,   // count stack slots starting at value.i
+	PLAN_PAIR,    // Stack slots value.i >> 16 and value.i & 0xFFFF
+};
+
+// How to get the value of an instruction argument.
+struct ArgPlan
+{
+	uint8_t kind;
+	uint8_t count;
+	TraceValue value;
+};
+
+struct InstructionPlan
+{
+	uint8_t op;
+	const char *name;
+	ArgPlan args[4];
+};
+
+// Plans of all the instructions of a function prototype, in the same order.
+typedef std::vector<InstructionPlan> DecodePlan;
+
+// Name of an opcode, or nullptr if it isn't a valid opcode.
+const char *opcode_name(uint8_t op);
+
+// Matches str against a pattern with the '*' and '?' wildcards.
+bool wildcard_match(const char *pattern, const char *str, bool ignoreCase);
+
+/**
+  * Include and exclude filters on the traced code, from the "filters" config object.
+  * "files", "functions" and "opcodes" each have an "include" and an "exclude" list.
+  * Files and functions are matched with the '*' and '?' wildcards (case-insensitive for the files).
+  * Opcodes are given by name, or by class (see Filter.cpp).
+  * Something is traced if it matches an include pattern (or if there are none), and no exclude pattern.
+  */
+class TraceFilter
+{
+private:
+	struct PatternList
+	{
+		std::vector<std::string> include;
+		std::vector<std::string> exclude;
+		bool ignoreCase;
+
+		void load(json_t *config, bool ignoreCase);
+		bool empty() const { return this->include.empty() && this->exclude.empty(); }
+		bool traced(const char *str) const;
+	};
+	PatternList files;
+	PatternList functions;
+	bool opcodes[256];
+
+	// Result of the file and function filters, computed once per closure.
+	FlatPtrMap<SQClosure*, bool> closures;
+	SQClosure *lastClosure; // Closure of the last lookup. Used for caching.
+	bool lastTraced;
+
+	void loadOpcodes(json_t *list, bool value);
+
+public:
+	TraceFilter(json_t *config);
+
+	// Replaces the filters with the ones of config.
+	void load(json_t *config);
+
+	bool opcodeTraced(uint8_t op) const { return this->opcodes[op]; }
+	bool closureTraced(SQClosure *closure, ClosureDB& closureDB);
+	// Forgets a closure released by the VM, or loaded again from a file.
+	void erase(SQClosure *closure);
+};
+
+/**
+  * Content-addressed pool of the Squirrel strings, configured by the "string_pool" object.
+  * Every unique string is written once with an ID, and the references to it use the ID,
+  * whatever the address of the SQString. The pool keeps at most "max_strings" strings and
+  * "max_size" MB, and evicts the least recently used ones. An evicted string seen again is
+  * written again with a new ID, so the readers never have to forget an ID.
+  * The flight recorder doesn't use it: its objects are only dumped when it is flushed.
+  */
+class StringPool
+{
+private:
+	static const uint32_t NONE = 0xFFFFFFFF;
+
+	struct Entry
+	{
+		std::string value;
+		uint32_t hash;
+		uint32_t id;
+		uint32_t prev; // More recently used
+		uint32_t next; // Less recently used
+	};
+	std::vector<Entry> entries;
+	std::vector<uint32_t> freeEntries;
+	std::unordered_multimap<uint32_t, uint32_t> byHash; // SQString::_hash to entry index
+	uint32_t head; // Most recently used
+	uint32_t tail; // Least recently used
+	size_t size;
+	size_t maxSize;
+	size_t maxStrings;
+	uint32_t nextId;
+
+	// Statistics, logged when the pool is destroyed.
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+
+	void unlink(uint32_t e);
+	void pushFront(uint32_t e);
+	void evict();
+
+public:
+	bool enabled;
+
+	StringPool(json_t *config);
+	~StringPool();
+
+	// Returns the pool ID of the string. isNew is set if the string must be written.
+	uint32_t get(const SQString *s, bool& isNew);
+	// Forgets every string, for a new trace. The IDs aren't reused.
+	void clear();
 };
 
-enum ArgType;
+/**
+  * Parameter of a breakpoint function, compiled from the first bp_info it gets.
+  * The other bp_info (if the function is used by several breakpoints) and the expressions
+  * BpExpression doesn't handle go through json_object_get_immediate.
+  */
+class BpParam
+{
+private:
+	const char *key;
+	std::atomic<json_t*> bpInfo; // Set once expr is compiled.
+	std::atomic<bool> claimed;
+	BpExpression expr;
+
+	size_t getSlow(json_t *bp_info, x86_reg_t *regs);
+
+public:
+	BpParam(const char *key) : key(key), bpInfo(nullptr), claimed(false) {}
+
+	size_t get(json_t *bp_info, x86_reg_t *regs)
+	{
+		if (bp_info == this->bpInfo.load(std::memory_order_acquire)) {
+			return this->expr.eval(regs);
+		}
+		return this->getSlow(bp_info, regs);
+	}
+};
 
 class SquirrelTracer
 {
 private:
 	CRITICAL_SECTION cs;
-	FILE *file;
+	TraceWriter *writer;
 	ObjectDumpCollection objs_list;
-	bool enabled;
+	json_t *config; // Copy of the plugin config, with the changes made through the control block
+	TraceFilter filter;
+	Sampler sampler;
+	Profiler *profiler; // Only in profile mode. There is no trace writer in this mode.
+	FlightRecorder *flight; // Only in flight recorder mode.
+	const char *pendingTrigger; // Trigger fired by the instruction being traced, handled by leave()
+	StringPool strings;
 
 	SQVM *vm;
-	std::string fn;
+	TraceName fn;
+	TraceInstruction instruction;
+
+	// Change detection statistics, logged when the tracer is destroyed.
+	struct {
+		uint64_t visited;
+		uint64_t rawUnchanged;  // The raw snapshot didn't change, the JSON dump wasn't built.
+		uint64_t jsonUnchanged; // The raw snapshot changed, but not the JSON dump.
+		uint64_t written;
+		uint64_t deltas; // Written as a delta record
+		uint64_t freed;
+	} objStats;
+
+	// Objects reached by the current instruction and not dumped yet.
+	// The object graph is walked with this stack rather than by recursion, so deep graphs
+	// can't overflow the native stack.
+	struct PendingObject
+	{
+		void *o;
+		void (SquirrelTracer::*dump)(void *o);
+	};
+	std::vector<PendingObject> pendingObjs;
+	// Incremented for every instruction. An object whose dump has the current epoch
+	// was already visited by this instruction.
+	uint32_t objEpoch;
+
+	// Decode plans, computed when a function is loaded or first executed.
+	// They can be disabled with "decode_plans": false to compare the decoding times.
+	bool usePlans;
+	FlatPtrMap<SQFunctionProto*, DecodePlan> plans;
+	SQFunctionProto *lastProto; // Function of the last instruction. Used for caching.
+	const DecodePlan *lastPlan;
+	InstructionPlan tmpPlan; // For the instructions without a precomputed plan.
+
+	// Time spent decoding the instruction arguments, logged when the tracer is destroyed.
+	// Measured only with "decode_stats": true: the two rdtsc cost more than some decodes.
+	struct {
+		bool enabled;
+		uint64_t instructions;
+		uint64_t ticks; // rdtsc ticks
+		uint64_t tscStart;
+		int64_t qpcStart;
+	} decodeStats;
+
+	// Object to dump again later, from memory, if it is still alive then (see queue_live_objects).
+	struct TrackedObject
+	{
+		void (SquirrelTracer::*dump)(void *o);
+		const void *vtable; // The address may be reused by an object of another type meanwhile
+	};
+	SQSharedState *sharedState; // Of the last traced VM, until sq_vm_free frees it
+	// Queues the dump of the objects of tracked found in the GC chain or the string table of the VM,
+	// and drops the other ones from tracked. The addresses of the other ones may have been freed.
+	void queue_live_objects(FlatPtrMap<void*, TrackedObject>& tracked);
 
-	json_t *arg_to_json(ArgType type, uint32_t arg);
-	json_t *add_obj(SQObject *o);
-	template<typename T> json_t *add_refcounted(T *o);
-	template<typename T> json_t *obj_to_json(T *o);
+	// Flight recorder: the objects referenced by the recorded instructions and not released since,
+	// with their dump function. They are only dumped when the recorder is flushed.
+	FlatPtrMap<void*, TrackedObject> flightObjs;
+	size_t flightObjsLimit; // Size at which flightObjs is pruned
+	bool flushing;
+	// Drops the objects that no buffered instruction references anymore.
+	void prune_flight_objs();
+
+	// Call frame events, enabled with "frames": true.
+	// The call stack of every VM, as seen by the last instruction it executed.
+	struct Frame
+	{
+		const void *closure;
+		TraceName fn;
+		TraceName name;
+	};
+	bool traceFrames;
+	FlatPtrMap<SQVM*, std::vector<Frame>> frameStacks;
+
+	// Segmented trace. The objects dumped to the current segment or alive at its start, with their
+	// dump function, so that the next segment can start with the dumps of the live ones.
+	TraceSegments *segments;
+	FlatPtrMap<void*, TrackedObject> segmentObjs;
+
+	// Closes the current segment, and starts the next one with the live objects.
+	// Returns the offset of the first dump, where the index entry of the next instruction points.
+	uint64_t roll_segment();
+	double qpcToNs;
+
+	void track_frames(SQVM *vm);
+	Frame frame_of(const SQObjectPtr& closure);
+
+	// Creates the trace writer, the profiler or the flight recorder for the "mode" of config,
+	// replacing the current ones. The files of every run after the first one get a "-<run>" suffix,
+	// so that a mode change doesn't overwrite the previous trace.
+	void set_mode(json_t *config);
+	unsigned int runs;
+	// set_mode is first called by the first traced instruction, so a tracer that is never enabled
+	// creates no file.
+	bool started;
+
+	const DecodePlan& get_plan(SQFunctionProto *proto);
+	const InstructionPlan& find_plan(SQInstruction *_i_);
+	TraceValue plan_to_value(const ArgPlan& arg);
+	TraceValue add_obj(SQObject *o);
+	TraceValue add_string(SQString *s);
+	template<typename T> TraceValue add_refcounted(T *o);
+	template<typename T> void dump_obj(void *o);
+	void dump_pending_objs();
+	JsonStream objJson; // JSON dump of the object being dumped
+	template<typename T> void obj_to_json(JsonStream& json, T *o);
+	// Visits the objects referenced by o, like obj_to_json, without building its dump.
+	template<typename T> void add_refs(T *o);
+
+	/**
+	  * Delta records ("deltas" in the config): a table or array with at least minElements elements
+	  * is written as its changed elements, with a full dump every keyframeInterval deltas
+	  * so that the readers can resync.
+	  */
+	struct {
+		bool enabled;
+		uint32_t keyframeInterval;
+		size_t minElements;
+	} deltaConfig;
+	std::vector<size_t> objElements; // Offsets of the table nodes or array values in objJson, and of the end.
+	JsonStream deltaJson;
+	void load_delta_config(json_t *config);
+	template<typename T> bool write_delta(T *o, const RawSnapshot& raw, ObjectDump& dump);
+	// Writes the elements of the new dump that differ from the last snapshot of the object.
+	// Returns false if the full dump should be written instead.
+	bool write_elements_delta(const void *address, const RawSnapshot& raw, ObjectDump& dump,
+		size_t elementSize, size_t compareSize, bool resizable);
 
 public:
 	ClosureDB closureDB;
 
-	SquirrelTracer();
+	SquirrelTracer(json_t *config);
 	~SquirrelTracer();
 
-	void enter(SQVM *vm);
+	// Merges the config written to the control block, and clears CONTROL_CONFIG_PENDING.
+	void apply_control(TraceControlBlock *control);
+
+	// Returns false if the instruction isn't traced. leave() must be called only if it returns true.
+	// Only called while the tracer is enabled: the breakpoint checks the control block first,
+	// so a disabled tracer never takes the lock.
+	bool enter(SQVM *vm, SQInstruction *_i_);
 	void leave();
 
 	void add_instruction(SQInstruction *_i_);
+	// Called when a closure is loaded from a file.
+	void load_closure(SQClosure *closure);
+	// Forgets everything known about an object released by the VM.
+	void remove_obj(void *o);
+	// Writes the flight recorder buffer to a new file. reason is logged.
+	void flush_flight_recorder(const char *reason);
+	// Called when a script error reaches the Squirrel error handler.
+	void script_error() { if (this->flight) this->flush_flight_recorder("error handler"); }
 
-	json_t *add_STK(int i) { return add_obj(&this->vm->_stack._vals[this->vm->_stackbase + i]); }
+	TraceValue add_STK(int i) { return add_obj(&this->vm->_stack._vals[this->vm->_stackbase + i]); }
 };
 
 #endif
@@ -0,0 +1,132 @@
+#include "Squirrel tracer.h"
+
+StringPool::StringPool(json_t *config)
+	: head(NONE), tail(NONE), size(0), nextId(0), hits(0), misses(0), evictions(0)
+{
+	json_t *pool = json_object_get(config, "string_pool");
+	this->enabled = !json_is_false(json_object_get(pool, "enabled"));
+
+	json_int_t maxStrings = json_integer_value(json_object_get(pool, "max_strings"));
+	this->maxStrings = maxStrings > 0 ? (size_t)maxStrings : 65536;
+	// Size in MB
+	json_int_t maxSize = json_integer_value(json_object_get(pool, "max_size"));
+	this->maxSize = (maxSize > 0 ? (size_t)maxSize : 16) * 1024 * 1024;
+}
+
+StringPool::~StringPool()
+{
+	if (this->hits + this->misses) {
+		log_printf("Squirrel tracer: string pool: %llu references, %llu (%.1f%%) to a string already written, "
+			"%llu strings written, %llu evicted.\n",
+			this->hits + this->misses, this->hits, this->hits * 100.0 / (this->hits + this->misses),
+			this->misses, this->evictions);
+	}
+}
+
+void StringPool::unlink(uint32_t e)
+{
+	Entry& entry = this->entries[e];
+	if (entry.prev != NONE) {
+		this->entries[entry.prev].next = entry.next;
+	}
+	else {
+		this->head = entry.next;
+	}
+	if (entry.next != NONE) {
+		this->entries[entry.next].prev = entry.prev;
+	}
+	else {
+		this->tail = entry.prev;
+	}
+}
+
+void StringPool::pushFront(uint32_t e)
+{
+	Entry& entry = this->entries[e];
+	entry.prev = NONE;
+	entry.next = this->head;
+	if (this->head != NONE) {
+		this->entries[this->head].prev = e;
+	}
+	this->head = e;
+	if (this->tail == NONE) {
+		this->tail = e;
+	}
+}
+
+void StringPool::evict()
+{
+	uint32_t e = this->tail;
+	Entry& entry = this->entries[e];
+	auto range = this->byHash.equal_range(entry.hash);
+	for (auto it = range.first; it != range.second; ++it) {
+		if (it->second == e) {
+			this->byHash.erase(it);
+			break;
+		}
+	}
+	this->unlink(e);
+	this->size -= entry.value.size();
+	// Releases the memory of the long strings.
+	std::string().swap(entry.value);
+	this->freeEntries.push_back(e);
+	this->evictions++;
+}
+
+uint32_t StringPool::get(const SQString *s, bool& isNew)
+{
+	size_t len = (size_t)s->_len;
+	auto range = this->byHash.equal_range((uint32_t)s->_hash);
+	for (auto it = range.first; it != range.second; ++it) {
+		uint32_t e = it->second;
+		Entry& entry = this->entries[e];
+		if (entry.value.size() == len && memcmp(entry.value.data(), s->_val, len) == 0) {
+			if (e != this->head) {
+				this->unlink(e);
+				this->pushFront(e);
+			}
+			this->hits++;
+			isNew = false;
+			return entry.id;
+		}
+	}
+
+	this->misses++;
+	isNew = true;
+	uint32_t id = this->nextId++;
+	// A string larger than the whole pool is written every time.
+	if (len > this->maxSize) {
+		return id;
+	}
+	while (this->tail != NONE && (this->byHash.size() >= this->maxStrings || this->size + len > this->maxSize)) {
+		this->evict();
+	}
+
+	uint32_t e;
+	if (!this->freeEntries.empty()) {
+		e = this->freeEntries.back();
+		this->freeEntries.pop_back();
+	}
+	else {
+		e = this->entries.size();
+		this->entries.push_back(Entry());
+	}
+	Entry& entry = this->entries[e];
+	entry.value.assign(s->_val, len);
+	entry.hash = (uint32_t)s->_hash;
+	entry.id = id;
+	this->pushFront(e);
+	this->byHash.insert(std::make_pair(entry.hash, e));
+	this->size += len;
+	return id;
+}
+
+void StringPool::clear()
+{
+	this->entries.clear();
+	this->freeEntries.clear();
+	this->byHash.clear();
+	this->head = NONE;
+	this->tail = NONE;
+	this->size = 0;
+}
@@ -0,0 +1,359 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Squirrel tracing plugin
+  *
+  * ----
+  *
+  * LZ4 compression of the trace files. Shared with the offline trace tools.
+  */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+/**
+  * A compressed trace (trace.json.lz4 or trace.bin.lz4) is a sequence of standard LZ4 frames,
+  * so it can also be decompressed with the lz4 command-line tool. Every frame holds complete
+  * records, and its blocks are independent, so each frame can be decompressed on its own.
+  *
+  * The side index (the same file name followed by ".idx") starts with a CompressedIndexHeader,
+  * followed by one CompressedIndexEntry per frame, in order. It is written with the frames,
+  * so a reader can decompress any range of the trace, or every frame in parallel.
+  */
+
+#define COMPRESSED_INDEX_MAGIC "SQLZIDX"
+#define COMPRESSED_INDEX_VERSION 1
+
+#pragma pack(push, 1)
+struct CompressedIndexHeader
+{
+	char magic[8];
+	uint32_t version;
+};
+
+struct CompressedIndexEntry
+{
+	uint64_t offset;    // Offset of the frame in the compressed file
+	uint64_t rawOffset; // Offset of its content in the uncompressed trace
+	uint32_t size;      // Size of the frame
+	uint32_t rawSize;   // Size of its content
+};
+#pragma pack(pop)
+
+class Lz4
+{
+private:
+	enum
+	{
+		FRAME_MAGIC = 0x184D2204,
+		MAX_BLOCK_SIZE = 4 * 1024 * 1024,
+		HASH_LOG = 14,
+		MIN_MATCH = 4,
+		// The format requires the last 5 bytes to be literals, and the last match to start
+		// at least 12 bytes before the end.
+		LAST_LITERALS = 5,
+		MF_LIMIT = 12,
+	};
+
+	std::vector<uint32_t> table; // Last position of every hashed sequence
+
+	static uint32_t read32(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+	static void write32(std::string& out, uint32_t v)
+	{
+		char bytes[4] = { (char)v, (char)(v >> 8), (char)(v >> 16), (char)(v >> 24) };
+		out.append(bytes, 4);
+	}
+	static uint32_t rotl(uint32_t x, int r) { return (x << r) | (x >> (32 - r)); }
+
+	static void writeLength(uint8_t *&op, size_t length)
+	{
+		for (length -= 15; length >= 255; length -= 255) {
+			*op++ = 255;
+		}
+		*op++ = (uint8_t)length;
+	}
+
+	// Compresses one block into dst, which must hold bound(size) bytes. Returns the compressed size.
+	size_t compressBlock(const uint8_t *src, size_t size, uint8_t *dst)
+	{
+		const uint8_t *ip = src;
+		const uint8_t *anchor = src;
+		const uint8_t *end = src + size;
+		uint8_t *op = dst;
+
+		if (size > MF_LIMIT) {
+			memset(this->table.data(), 0, this->table.size() * sizeof(uint32_t));
+			const uint8_t *mfLimit = end - MF_LIMIT;
+			const uint8_t *matchLimit = end - LAST_LITERALS;
+			unsigned int misses = 0;
+			ip++;
+			while (ip < mfLimit) {
+				uint32_t sequence = read32(ip);
+				uint32_t hash = (sequence * 2654435761u) >> (32 - HASH_LOG);
+				const uint8_t *ref = src + this->table[hash];
+				this->table[hash] = (uint32_t)(ip - src);
+				if (ref >= ip || ip - ref > 65535 || read32(ref) != sequence) {
+					// Skips faster through the data that doesn't compress.
+					ip += 1 + (misses++ >> 6);
+					continue;
+				}
+				misses = 0;
+				while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+					ip--;
+					ref--;
+				}
+				const uint8_t *matchEnd = ip + MIN_MATCH;
+				const uint8_t *refEnd = ref + MIN_MATCH;
+				while (matchEnd < matchLimit && *matchEnd == *refEnd) {
+					matchEnd++;
+					refEnd++;
+				}
+
+				size_t literals = ip - anchor;
+				size_t match = matchEnd - ip - MIN_MATCH;
+				uint8_t *token = op++;
+				*token = (uint8_t)((literals >= 15 ? 15 : literals) << 4);
+				if (literals >= 15) {
+					writeLength(op, literals);
+				}
+				memcpy(op, anchor, literals);
+				op += literals;
+				size_t offset = ip - ref;
+				*op++ = (uint8_t)offset;
+				*op++ = (uint8_t)(offset >> 8);
+				*token |= (uint8_t)(match >= 15 ? 15 : match);
+				if (match >= 15) {
+					writeLength(op, match);
+				}
+				ip = matchEnd;
+				anchor = ip;
+			}
+		}
+
+		size_t literals = end - anchor;
+		uint8_t *token = op++;
+		*token = (uint8_t)((literals >= 15 ? 15 : literals) << 4);
+		if (literals >= 15) {
+			writeLength(op, literals);
+		}
+		memcpy(op, anchor, literals);
+		op += literals;
+		return op - dst;
+	}
+
+public:
+	Lz4() : table((size_t)1 << HASH_LOG) {}
+
+	static size_t bound(size_t size) { return size + size / 255 + 16; }
+
+	// Appends a frame with the given content to out. A frame can hold any size: the content
+	// is cut into blocks of 4 MB.
+	void compressFrame(const void *data, size_t size, std::string& out)
+	{
+		write32(out, FRAME_MAGIC);
+		// Version 1, independent blocks, content size. Blocks of 4 MB at most.
+		uint8_t descriptor[10] = { 0x68, 0x70 };
+		for (int i = 0; i < 8; i++) {
+			descriptor[2 + i] = (uint8_t)((uint64_t)size >> (i * 8));
+		}
+		out.append((const char*)descriptor, sizeof(descriptor));
+		out += (char)(xxh32(descriptor, sizeof(descriptor), 0) >> 8);
+
+		const uint8_t *src = (const uint8_t*)data;
+		std::vector<uint8_t> block;
+		while (size > 0) {
+			size_t blockSize = size < (size_t)MAX_BLOCK_SIZE ? size : (size_t)MAX_BLOCK_SIZE;
+			block.resize(bound(blockSize));
+			size_t compressed = this->compressBlock(src, blockSize, block.data());
+			if (compressed < blockSize) {
+				write32(out, (uint32_t)compressed);
+				out.append((const char*)block.data(), compressed);
+			}
+			else {
+				// Stored uncompressed
+				write32(out, (uint32_t)blockSize | 0x80000000);
+				out.append((const char*)src, blockSize);
+			}
+			src += blockSize;
+			size -= blockSize;
+		}
+		write32(out, 0); // End mark
+	}
+
+	// Decompresses a block. Returns the decompressed size, or (size_t)-1 if the block is invalid.
+	static size_t decompressBlock(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity)
+	{
+		const uint8_t *ip = src;
+		const uint8_t *end = src + size;
+		uint8_t *op = dst;
+		uint8_t *opEnd = dst + capacity;
+		while (ip < end) {
+			uint8_t token = *ip++;
+			size_t literals = token >> 4;
+			if (literals == 15) {
+				uint8_t b;
+				do {
+					if (ip >= end) {
+						return (size_t)-1;
+					}
+					b = *ip++;
+					literals += b;
+				} while (b == 255);
+			}
+			if ((size_t)(end - ip) < literals || (size_t)(opEnd - op) < literals) {
+				return (size_t)-1;
+			}
+			memcpy(op, ip, literals);
+			ip += literals;
+			op += literals;
+			if (ip == end) {
+				break;
+			}
+
+			if (end - ip < 2) {
+				return (size_t)-1;
+			}
+			size_t offset = ip[0] | (ip[1] << 8);
+			ip += 2;
+			size_t match = token & 15;
+			if (match == 15) {
+				uint8_t b;
+				do {
+					if (ip >= end) {
+						return (size_t)-1;
+					}
+					b = *ip++;
+					match += b;
+				} while (b == 255);
+			}
+			match += MIN_MATCH;
+			if (offset == 0 || offset > (size_t)(op - dst) || (size_t)(opEnd - op) < match) {
+				return (size_t)-1;
+			}
+			const uint8_t *ref = op - offset;
+			if (offset >= match) {
+				memcpy(op, ref, match);
+			}
+			else {
+				// The match overlaps the bytes it writes.
+				for (size_t i = 0; i < match; i++) {
+					op[i] = ref[i];
+				}
+			}
+			op += match;
+		}
+		return op - dst;
+	}
+
+	/**
+	  * Decompresses the frame at data and appends its content to out.
+	  * Returns the size of the frame, or 0 if it is invalid.
+	  * Only handles the frames with independent blocks, like the ones written by compressFrame.
+	  */
+	static size_t decompressFrame(const void *data, size_t size, std::string& out)
+	{
+		const uint8_t *p = (const uint8_t*)data;
+		const uint8_t *end = p + size;
+		if (size < 7 || read32(p) != FRAME_MAGIC) {
+			return 0;
+		}
+		uint8_t flags = p[4];
+		if ((flags & 0xC0) != 0x40 || !(flags & 0x20) || (flags & 0x01)) {
+			return 0;
+		}
+		size_t maxBlockSize = (size_t)1 << (8 + 2 * ((p[5] >> 4) & 7));
+		size_t descriptorSize = 2 + ((flags & 0x08) ? 8 : 0);
+		if (size < 4 + descriptorSize + 1) {
+			return 0;
+		}
+		// With the content size, the output buffer doesn't need to grow by a whole block every time.
+		uint64_t remaining = (uint64_t)-1;
+		if (flags & 0x08) {
+			remaining = 0;
+			for (int i = 0; i < 8; i++) {
+				remaining |= (uint64_t)p[6 + i] << (i * 8);
+			}
+		}
+		p += 4 + descriptorSize + 1;
+
+		for (;;) {
+			if (end - p < 4) {
+				return 0;
+			}
+			uint32_t blockSize = read32(p);
+			p += 4;
+			if (blockSize == 0) {
+				break;
+			}
+			bool stored = (blockSize & 0x80000000) != 0;
+			blockSize &= 0x7FFFFFFF;
+			if ((size_t)(end - p) < blockSize || blockSize > maxBlockSize) {
+				return 0;
+			}
+			size_t capacity = remaining < maxBlockSize ? (size_t)remaining : maxBlockSize;
+			size_t decompressed = blockSize;
+			if (stored) {
+				out.append((const char*)p, blockSize);
+			}
+			else {
+				size_t start = out.size();
+				out.resize(start + capacity);
+				decompressed = decompressBlock(p, blockSize, (uint8_t*)&out[start], capacity);
+				if (decompressed == (size_t)-1) {
+					return 0;
+				}
+				out.resize(start + decompressed);
+			}
+			if (decompressed > remaining) {
+				return 0;
+			}
+			remaining -= decompressed;
+			p += blockSize;
+			if (flags & 0x10) {
+				p += 4; // Block checksum
+			}
+		}
+		if (flags & 0x04) {
+			p += 4; // Content checksum
+		}
+		return p <= end ? p - (const uint8_t*)data : 0;
+	}
+
+	static uint32_t xxh32(const void *data, size_t size, uint32_t seed)
+	{
+		static const uint32_t prime1 = 2654435761u, prime2 = 2246822519u, prime3 = 3266489917u,
+			prime4 = 668265263u, prime5 = 374761393u;
+		const uint8_t *p = (const uint8_t*)data;
+		const uint8_t *end = p + size;
+		uint32_t h;
+
+		if (size >= 16) {
+			uint32_t v[4] = { seed + prime1 + prime2, seed + prime2, seed, seed - prime1 };
+			for (; end - p >= 16; p += 16) {
+				for (int i = 0; i < 4; i++) {
+					v[i] = rotl(v[i] + read32(p + i * 4) * prime2, 13) * prime1;
+				}
+			}
+			h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+		}
+		else {
+			h = seed + prime5;
+		}
+		h += (uint32_t)size;
+		for (; end - p >= 4; p += 4) {
+			h = rotl(h + read32(p) * prime3, 17) * prime4;
+		}
+		for (; p < end; p++) {
+			h = rotl(h + *p * prime5, 11) * prime1;
+		}
+		h ^= h >> 15;
+		h *= prime2;
+		h ^= h >> 13;
+		h *= prime3;
+		h ^= h >> 16;
+		return h;
+	}
+};
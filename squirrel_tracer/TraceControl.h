@@ -0,0 +1,174 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Squirrel tracing plugin
+  *
+  * ----
+  *
+  * Control block of a running tracer. Shared with the offline trace tools.
+  */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
+/**
+  * The tracer creates a shared memory block named "SquirrelTracerControl-<pid>" when the plugin
+  * is loaded. Outside of Windows, the tools use a POSIX shared memory object with the same name,
+  * so the clients can be tested against "sqtrace control <pid> serve".
+  *
+  * state is the only thing the breakpoint reads before doing anything else. 0 means that the
+  * tracer is disabled and has nothing to apply, so a disabled tracer costs a load per instruction.
+  *
+  * To change the configuration, a client waits until CONTROL_CONFIG_PENDING is cleared, writes
+  * a JSON object to config, then sets CONTROL_CONFIG_PENDING. On its next instruction, the tracer
+  * merges the object over its config, clears the flag and increments configsApplied.
+  * "mode", "filters", "sampling", "frames" and "deltas" can be changed this way.
+  */
+
+#define TRACE_CONTROL_MAGIC "SQCTRL"
+#define TRACE_CONTROL_VERSION 1
+#define TRACE_CONTROL_CONFIG_SIZE 8192
+
+enum ControlState : uint32_t
+{
+	CONTROL_ENABLED = 1,
+	CONTROL_CONFIG_PENDING = 2,
+};
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "The control block is shared between processes");
+
+struct TraceControlBlock
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t pid;
+	std::atomic<uint32_t> state; // ControlState flags
+	std::atomic<uint32_t> configsApplied;
+	char config[TRACE_CONTROL_CONFIG_SIZE]; // NUL-terminated
+};
+
+// Maps the control block of a process.
+class TraceControlMapping
+{
+private:
+#ifdef _WIN32
+	HANDLE handle;
+#else
+	char name[64];
+	bool owner;
+#endif
+
+	TraceControlMapping(const TraceControlMapping&) = delete;
+	TraceControlMapping& operator=(const TraceControlMapping&) = delete;
+
+	bool map(uint32_t pid, bool create)
+	{
+#ifdef _WIN32
+		char name[64];
+		_snprintf(name, sizeof(name), "Local\\SquirrelTracerControl-%u", pid);
+		name[sizeof(name) - 1] = '\0';
+		if (create) {
+			this->handle = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(TraceControlBlock), name);
+		}
+		else {
+			this->handle = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name);
+		}
+		if (!this->handle) {
+			return false;
+		}
+		this->block = (TraceControlBlock*)MapViewOfFile(this->handle, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(TraceControlBlock));
+		if (!this->block) {
+			CloseHandle(this->handle);
+			this->handle = NULL;
+			return false;
+		}
+#else
+		snprintf(this->name, sizeof(this->name), "/SquirrelTracerControl-%u", pid);
+		int fd = shm_open(this->name, create ? O_RDWR | O_CREAT : O_RDWR, 0600);
+		if (fd == -1) {
+			return false;
+		}
+		if (create && ftruncate(fd, sizeof(TraceControlBlock)) != 0) {
+			close(fd);
+			shm_unlink(this->name);
+			return false;
+		}
+		void *p = mmap(nullptr, sizeof(TraceControlBlock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED) {
+			if (create) {
+				shm_unlink(this->name);
+			}
+			return false;
+		}
+		this->block = (TraceControlBlock*)p;
+		this->owner = create;
+#endif
+		return true;
+	}
+
+public:
+	TraceControlBlock *block;
+
+	TraceControlMapping() : block(nullptr)
+	{
+#ifdef _WIN32
+		this->handle = NULL;
+#else
+		this->name[0] = '\0';
+		this->owner = false;
+#endif
+	}
+
+	~TraceControlMapping()
+	{
+		if (!this->block) {
+			return;
+		}
+#ifdef _WIN32
+		UnmapViewOfFile(this->block);
+		CloseHandle(this->handle);
+#else
+		munmap(this->block, sizeof(TraceControlBlock));
+		if (this->owner) {
+			shm_unlink(this->name);
+		}
+#endif
+	}
+
+	// Creates the control block of the tracer running in the process pid, with the given state.
+	bool create(uint32_t pid, uint32_t state)
+	{
+		if (!this->map(pid, true)) {
+			return false;
+		}
+		memcpy(this->block->magic, TRACE_CONTROL_MAGIC, sizeof(TRACE_CONTROL_MAGIC));
+		this->block->version = TRACE_CONTROL_VERSION;
+		this->block->pid = pid;
+		this->block->configsApplied = 0;
+		this->block->config[0] = '\0';
+		this->block->state = state;
+		return true;
+	}
+
+	// Opens the control block of a running tracer.
+	bool open(uint32_t pid)
+	{
+		if (!this->map(pid, false)) {
+			return false;
+		}
+		return memcmp(this->block->magic, TRACE_CONTROL_MAGIC, sizeof(TRACE_CONTROL_MAGIC)) == 0
+			&& this->block->version == TRACE_CONTROL_VERSION;
+	}
+};
@@ -0,0 +1,181 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Squirrel tracing plugin
+  *
+  * ----
+  *
+  * Binary trace format. Shared with the offline trace tools.
+  */
+
+#pragma once
+
+#include <stdint.h>
+
+/**
+  * A binary trace (trace.bin) starts with a BinaryTraceHeader, followed by a stream of records.
+  * Every record starts with a one-byte RecordType.
+  * All integers are little-endian, and addresses are 32-bit (the games are 32-bit processes).
+  *
+  * Instructions are fixed-size records. The strings they use (file names, argument names
+  * like "TARGET" or "CMP_G") are interned: a REC_STRING record gives the string for an ID,
+  * and it is written before the first record using that ID. In the same way, a REC_OPCODE
+  * record gives the name of an opcode before its first use.
+  * An argument of type TV_ARRAY (the stack range of a call) is followed by a REC_VALUES record
+  * holding its elements.
+  * Objects are length-prefixed records holding the same JSON content as the "content" field
+  * of an object in trace.json.
+  * A REC_FREED record tells that the VM released an object previously written to the trace,
+  * so its address may be reused by an unrelated object.
+  * REC_FRAME records are written when a call frame starts or ends (if "frames" is enabled
+  * in the tracer config), with a timestamp in nanoseconds since the start of the trace.
+  * With the string pool, the Squirrel strings aren't objects: a REC_POOLED_STRING record gives
+  * the content of a pool ID, and the values referencing it have the type TV_POOLED_STRING.
+  * Pool IDs are never reused. Object contents reference them with "STRING:<id>".
+  * When one element of a large table or array changes, a REC_OBJECT_DELTA record is written
+  * instead of the whole object. It has the layout of an object record, and its JSON content is
+  * {"length":N,"set":[[index,element],...]}: the new number of elements (table nodes or array
+  * values), and the elements that changed since the previous record of this object, which
+  * is always written before. The elements at or past the old length are inserted, the ones
+  * past the new length removed. A removed table node is a changed node with a null key and value.
+  * A full object record is written again every few deltas, so a reader can resync.
+  *
+  * Version 2 added REC_FREED, version 3 added REC_FRAME, version 4 added REC_POOLED_STRING,
+  * version 5 added REC_OBJECT_DELTA. Readers accept the older versions.
+  */
+
+#define BINARY_TRACE_MAGIC "SQTRACE"
+#define BINARY_TRACE_VERSION 5
+
+enum RecordType : uint8_t
+{
+	REC_INSTRUCTION = 1,
+	REC_VALUES = 2,
+	REC_STRING = 3,
+	REC_OBJECT = 4,
+	REC_OPCODE = 5,
+	REC_FREED = 6,
+	REC_FRAME = 7,
+	REC_POOLED_STRING = 8,
+	REC_OBJECT_DELTA = 9,
+};
+
+enum FrameEvent : uint8_t
+{
+	FRAME_ENTER = 0,
+	FRAME_EXIT = 1,
+};
+
+enum TraceValueType : uint8_t
+{
+	TV_NULL = 0,
+	TV_INTEGER,
+	TV_FLOAT,
+	TV_BOOL,
+	TV_POINTER,      // Reference to a refcounted object. "POINTER:%p" in JSON.
+	TV_USERPOINTER,  // "<user pointer: %p>" in JSON.
+	TV_STRING,       // Constant string. In a binary trace, the value is a string ID.
+	TV_UNKNOWN_TYPE, // Unknown SQObjectType. The value is the type.
+	TV_ARRAY,        // The value is the number of elements.
+	TV_POOLED_STRING, // String from the pool. The value is its pool ID. "STRING:%u" in JSON.
+};
+
+/**
+  * Seek index of a segmented trace (trace.idx). It applies to both formats.
+  * A SegmentIndexHeader, followed by SegmentIndexEntry records in instruction order.
+  * The offset is the position of the first record written for the instruction (objects included),
+  * in the uncompressed segment. The entries of the deleted segments are kept.
+  */
+#define SEGMENT_INDEX_MAGIC "SQSEGIX"
+#define SEGMENT_INDEX_VERSION 1
+
+#pragma pack(push, 1)
+struct SegmentIndexHeader
+{
+	char magic[8];
+	uint32_t version;
+};
+
+struct SegmentIndexEntry
+{
+	uint64_t instruction; // Sequence number of the instruction in the whole trace
+	uint64_t offset;
+	uint32_t segment;     // Segment number, from 1
+};
+
+struct BinaryTraceHeader
+{
+	char magic[8];
+	uint32_t version;
+};
+
+struct BinaryValue
+{
+	uint8_t type;
+	uint32_t value;
+};
+
+struct BinaryInstructionRecord
+{
+	uint8_t record;
+	uint8_t op;
+	uint8_t argType[4];
+	uint32_t fn; // String ID
+	uint32_t arg[4];
+};
+
+struct BinaryValuesRecord
+{
+	uint8_t record;
+	uint32_t count;
+	// Followed by BinaryValue values[count]
+};
+
+struct BinaryStringRecord
+{
+	uint8_t record;
+	uint32_t id;
+	uint32_t size;
+	// Followed by char data[size]
+};
+
+struct BinaryPooledStringRecord
+{
+	uint8_t record;
+	uint32_t id;
+	uint32_t size;
+	// Followed by char data[size]
+};
+
+struct BinaryOpcodeRecord
+{
+	uint8_t record;
+	uint8_t op;
+	uint32_t size;
+	// Followed by char name[size]
+};
+
+struct BinaryObjectRecord
+{
+	uint8_t record;
+	uint32_t address;
+	uint32_t size;
+	// Followed by char content[size]
+};
+
+struct BinaryFreedRecord
+{
+	uint8_t record;
+	uint32_t address;
+};
+
+struct BinaryFrameRecord
+{
+	uint8_t record;
+	uint8_t event; // FrameEvent
+	uint32_t vm;
+	uint32_t closure;
+	uint32_t fn;   // String ID of the file name
+	uint32_t name; // String ID of the function name
+	uint64_t time; // Nanoseconds
+};
+#pragma pack(pop)
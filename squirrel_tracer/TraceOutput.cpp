@@ -0,0 +1,554 @@
+#include <Squirrel tracer.h>
+#include <algorithm>
+
+static AsyncTraceOutput::Backpressure backpressure_policy(json_t *output)
+{
+	const char *policy = json_string_value(json_object_get(output, "backpressure"));
+	if (policy && strcmp(policy, "drop") == 0) {
+		return AsyncTraceOutput::BACKPRESSURE_DROP;
+	}
+	else if (policy && strcmp(policy, "degrade") == 0) {
+		return AsyncTraceOutput::BACKPRESSURE_DEGRADE;
+	}
+	else if (policy && strcmp(policy, "block") != 0) {
+		log_printf("Squirrel tracer: unknown backpressure policy \"%s\", falling back to block.\n", policy);
+	}
+	return AsyncTraceOutput::BACKPRESSURE_BLOCK;
+}
+
+TraceOutput *TraceOutput::create(json_t *config, const char *fn)
+{
+	json_t *output = json_object_get(config, "output");
+	// Buffer size in MB
+	json_int_t bufferSizeMB = json_integer_value(json_object_get(output, "buffer_size"));
+	if (bufferSizeMB <= 0) {
+		bufferSizeMB = 16;
+	}
+
+	const char *compression = json_string_value(json_object_get(output, "compression"));
+	if (compression && strcmp(compression, "none") != 0) {
+		if (strcmp(compression, "lz4") != 0) {
+			log_printf("Squirrel tracer: unknown compression \"%s\", falling back to lz4.\n", compression);
+		}
+		// The compressed output is always asynchronous. The buffer is split into frames.
+		json_int_t frameSizeMB = json_integer_value(json_object_get(output, "frame_size"));
+		if (frameSizeMB <= 0) {
+			frameSizeMB = 1;
+		}
+		size_t frameCount = (std::max)((size_t)(bufferSizeMB / frameSizeMB), (size_t)2);
+		std::string compressedFn = std::string(fn) + ".lz4";
+		return new CompressedTraceOutput(compressedFn.c_str(), (size_t)frameSizeMB * 1024 * 1024, frameCount, backpressure_policy(output));
+	}
+
+	if (!json_is_true(json_object_get(output, "async"))) {
+		return new FileTraceOutput(fn);
+	}
+
+	// Rounded up to a power of 2.
+	size_t bufferSize = 1024 * 1024;
+	while (bufferSize < (size_t)bufferSizeMB * 1024 * 1024 && bufferSize < 1024 * 1024 * 1024) {
+		bufferSize *= 2;
+	}
+	return new AsyncTraceOutput(fn, bufferSize, backpressure_policy(output));
+}
+
+
+
+FileTraceOutput::FileTraceOutput(const char *fn)
+{
+	this->file = fopen(fn, "wb");
+}
+
+FileTraceOutput::~FileTraceOutput()
+{
+	fclose(this->file);
+}
+
+bool FileTraceOutput::write(const void *data, size_t size, bool isInstruction)
+{
+	fwrite(data, size, 1, this->file);
+	if (isInstruction) {
+		fflush(this->file);
+	}
+	return true;
+}
+
+
+
+AsyncTraceOutput::AsyncTraceOutput(const char *fn, size_t bufferSize, Backpressure backpressure)
+	: ringSize(bufferSize), head(0), tail(0), stop(false), stopped(false), draining(false), broken(false),
+	backpressure(backpressure), dropped(0), degraded(0)
+{
+	this->file = fopen(fn, "wb");
+	this->ring = (char*)malloc(this->ringSize);
+	this->thread = CreateThread(nullptr, 0, threadProc, this, 0, nullptr);
+	if (this->thread == nullptr) {
+		log_mboxf("Error", MB_OK, "CreateThread failed with error code %d, the trace will be written synchronously.", GetLastError());
+	}
+}
+
+AsyncTraceOutput::~AsyncTraceOutput()
+{
+	// Deleted from the thcrap exit hook, outside of the loader lock, so the thread can be waited for.
+	// It writes everything left in the buffer before exiting.
+	this->stop = true;
+	if (this->thread) {
+		WaitForSingleObject(this->thread, INFINITE);
+		CloseHandle(this->thread);
+	}
+	// Only write the buffer here if the thread never started or was killed. If it was killed
+	// in the middle of a write, the rest is lost rather than written twice.
+	if (!this->stopped && !this->draining && !this->broken) {
+		this->drain();
+	}
+	if (this->draining || this->broken) {
+		log_printf("Squirrel tracer: the trace writer thread died, %u bytes were not written.\n",
+			(unsigned int)(this->head - this->tail));
+	}
+
+	if (this->dropped || this->degraded) {
+		log_printf("Squirrel tracer: %u instructions dropped and %u instructions traced without arguments "
+			"because the trace output couldn't keep up.\n", this->dropped, this->degraded);
+	}
+	// The dead thread may still own the file lock.
+	if (!this->draining && !this->broken) {
+		fclose(this->file);
+	}
+	free(this->ring);
+}
+
+DWORD WINAPI AsyncTraceOutput::threadProc(LPVOID param)
+{
+	AsyncTraceOutput *self = (AsyncTraceOutput*)param;
+	for (;;) {
+		if (self->drain()) {
+			continue;
+		}
+		if (self->stop) {
+			break;
+		}
+		fflush(self->file);
+		Sleep(1);
+	}
+	fflush(self->file);
+	self->stopped = true;
+	return 0;
+}
+
+bool AsyncTraceOutput::writerAlive()
+{
+	return this->thread && WaitForSingleObject(this->thread, 0) == WAIT_TIMEOUT;
+}
+
+// Writes everything currently in the ring buffer to the file.
+// Returns false if the buffer was empty.
+bool AsyncTraceOutput::drain()
+{
+	size_t head = this->head.load(std::memory_order_acquire);
+	size_t tail = this->tail.load(std::memory_order_relaxed);
+	if (head == tail) {
+		return false;
+	}
+
+	size_t start = tail & (this->ringSize - 1);
+	size_t size = head - tail;
+	size_t firstPart = (std::min)(size, this->ringSize - start);
+	this->draining = true;
+	fwrite(this->ring + start, firstPart, 1, this->file);
+	if (size > firstPart) {
+		fwrite(this->ring, size - firstPart, 1, this->file);
+	}
+
+	this->tail.store(head, std::memory_order_release);
+	this->draining = false;
+	return true;
+}
+
+bool AsyncTraceOutput::write(const void *data, size_t size, bool isInstruction)
+{
+	if (this->broken) {
+		if (isInstruction) {
+			this->dropped++;
+		}
+		return false;
+	}
+	size_t head = this->head.load(std::memory_order_relaxed);
+	if (isInstruction && this->backpressure == BACKPRESSURE_DROP &&
+		this->ringSize - (head - this->tail.load(std::memory_order_acquire)) < size) {
+		this->dropped++;
+		return false;
+	}
+
+	// Records bigger than the free space (or than the whole buffer) are pushed in several parts.
+	const char *src = (const char*)data;
+	while (size > 0) {
+		size_t available = this->ringSize - (head - this->tail.load(std::memory_order_acquire));
+		if (available == 0) {
+			if (this->writerAlive()) {
+				Sleep(0);
+			}
+			else if (!this->draining) {
+				// The writer thread never started or exited. Write the buffer from this thread.
+				this->drain();
+			}
+			else {
+				// It died while writing, so nothing after its last write can be written.
+				this->broken = true;
+				return false;
+			}
+			continue;
+		}
+
+		size_t chunk = (std::min)(size, available);
+		size_t start = head & (this->ringSize - 1);
+		size_t firstPart = (std::min)(chunk, this->ringSize - start);
+		memcpy(this->ring + start, src, firstPart);
+		if (chunk > firstPart) {
+			memcpy(this->ring, src + firstPart, chunk - firstPart);
+		}
+
+		head += chunk;
+		this->head.store(head, std::memory_order_release);
+		src += chunk;
+		size -= chunk;
+	}
+	return true;
+}
+
+bool AsyncTraceOutput::congested()
+{
+	if (this->backpressure != BACKPRESSURE_DEGRADE) {
+		return false;
+	}
+	size_t used = this->head.load(std::memory_order_relaxed) - this->tail.load(std::memory_order_acquire);
+	if (used < this->ringSize / 4 * 3) {
+		return false;
+	}
+	this->degraded++;
+	return true;
+}
+
+
+
+CompressedTraceOutput::CompressedTraceOutput(const char *fn, size_t frameSize, size_t frameCount, AsyncTraceOutput::Backpressure backpressure)
+	: offset(0), rawOffset(0), frames(frameCount), frameSize(frameSize), frameStart(0), head(0), tail(0), stop(false), stopped(false),
+	compressing(false), broken(false), backpressure(backpressure), dropped(0), degraded(0)
+{
+	for (std::string& frame : this->frames) {
+		frame.reserve(frameSize);
+	}
+	InitializeCriticalSection(&this->frameCs);
+	this->file = fopen(fn, "wb");
+	std::string indexFn = std::string(fn) + ".idx";
+	this->index = fopen(indexFn.c_str(), "wb");
+	CompressedIndexHeader header;
+	memcpy(header.magic, COMPRESSED_INDEX_MAGIC, sizeof(COMPRESSED_INDEX_MAGIC));
+	header.version = COMPRESSED_INDEX_VERSION;
+	fwrite(&header, sizeof(header), 1, this->index);
+
+	this->thread = CreateThread(nullptr, 0, threadProc, this, 0, nullptr);
+	if (this->thread == nullptr) {
+		log_mboxf("Error", MB_OK, "CreateThread failed with error code %d, the trace will be compressed synchronously.", GetLastError());
+	}
+}
+
+CompressedTraceOutput::~CompressedTraceOutput()
+{
+	// Same as AsyncTraceOutput: the thread compresses the last frames, including the partial one,
+	// and they are only compressed here if it never started or was killed between two frames.
+	this->stop = true;
+	if (this->thread) {
+		WaitForSingleObject(this->thread, INFINITE);
+		CloseHandle(this->thread);
+	}
+	if (!this->stopped && !this->compressing && !this->broken) {
+		this->compressFrames();
+		if (this->queueFrameOlderThan(0)) {
+			this->compressFrames();
+		}
+	}
+	if (this->compressing || this->broken) {
+		log_printf("Squirrel tracer: the trace compression thread died, %u frames were not written.\n",
+			(unsigned int)(this->head - this->tail));
+	}
+
+	if (this->rawOffset) {
+		log_printf("Squirrel tracer: trace compressed from %llu to %llu bytes (%.1f%%).\n",
+			this->rawOffset, this->offset, this->offset * 100.0 / this->rawOffset);
+	}
+	if (this->dropped || this->degraded) {
+		log_printf("Squirrel tracer: %u instructions dropped and %u instructions traced without arguments "
+			"because the trace output couldn't keep up.\n", this->dropped, this->degraded);
+	}
+	// The dead thread may still own the file locks.
+	if (!this->compressing && !this->broken) {
+		fclose(this->index);
+		fclose(this->file);
+	}
+	DeleteCriticalSection(&this->frameCs);
+}
+
+DWORD WINAPI CompressedTraceOutput::threadProc(LPVOID param)
+{
+	CompressedTraceOutput *self = (CompressedTraceOutput*)param;
+	for (;;) {
+		if (self->compressFrames()) {
+			continue;
+		}
+		if (self->stop) {
+			// The partial frame is the last one.
+			if (self->queueFrameOlderThan(0)) {
+				continue;
+			}
+			break;
+		}
+		// The VM thread only queues the frames it fills. Without this, the last frame
+		// would wait for the next record when the game stops running scripts.
+		self->queueFrameOlderThan(1000);
+		Sleep(1);
+	}
+	self->stopped = true;
+	return 0;
+}
+
+bool CompressedTraceOutput::writerAlive()
+{
+	return this->thread && WaitForSingleObject(this->thread, 0) == WAIT_TIMEOUT;
+}
+
+// Compresses and writes the queued frames. Returns false if there were none.
+bool CompressedTraceOutput::compressFrames()
+{
+	size_t head = this->head.load(std::memory_order_acquire);
+	size_t tail = this->tail.load(std::memory_order_relaxed);
+	if (head == tail) {
+		return false;
+	}
+
+	this->compressing = true;
+	for (; tail != head; tail++) {
+		std::string& frame = this->frames[tail % this->frames.size()];
+		this->compressed.clear();
+		this->lz4.compressFrame(frame.data(), frame.size(), this->compressed);
+		fwrite(this->compressed.data(), this->compressed.size(), 1, this->file);
+
+		CompressedIndexEntry entry;
+		entry.offset = this->offset;
+		entry.rawOffset = this->rawOffset;
+		entry.size = this->compressed.size();
+		entry.rawSize = frame.size();
+		fwrite(&entry, sizeof(entry), 1, this->index);
+		this->offset += entry.size;
+		this->rawOffset += entry.rawSize;
+
+		// Keeps the capacity for the next frame.
+		frame.clear();
+		this->tail.store(tail + 1, std::memory_order_release);
+	}
+	// The index is flushed after the frames, so it never points past the end of the file.
+	fflush(this->file);
+	fflush(this->index);
+	this->compressing = false;
+	return true;
+}
+
+// Called with frameCs held.
+void CompressedTraceOutput::queueFrame()
+{
+	this->head.store(this->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// Queues the frame being filled if it isn't empty and its first record is at least age ms old.
+bool CompressedTraceOutput::queueFrameOlderThan(DWORD age)
+{
+	bool queued = false;
+	EnterCriticalSection(&this->frameCs);
+	size_t head = this->head.load(std::memory_order_relaxed);
+	// When every frame is queued, frames[head % frames.size()] is the oldest one, not a partial frame.
+	if (head - this->tail.load(std::memory_order_acquire) < this->frames.size()) {
+		const std::string& frame = this->frames[head % this->frames.size()];
+		if (!frame.empty() && GetTickCount() - this->frameStart >= age) {
+			this->queueFrame();
+			queued = true;
+		}
+	}
+	LeaveCriticalSection(&this->frameCs);
+	return queued;
+}
+
+bool CompressedTraceOutput::write(const void *data, size_t size, bool isInstruction)
+{
+	if (this->broken) {
+		if (isInstruction) {
+			this->dropped++;
+		}
+		return false;
+	}
+
+	// The frame after the last queued one may still be compressed.
+	EnterCriticalSection(&this->frameCs);
+	size_t head = this->head.load(std::memory_order_relaxed);
+	while (head - this->tail.load(std::memory_order_acquire) >= this->frames.size()) {
+		LeaveCriticalSection(&this->frameCs);
+		if (isInstruction && this->backpressure == AsyncTraceOutput::BACKPRESSURE_DROP) {
+			this->dropped++;
+			return false;
+		}
+		if (this->writerAlive()) {
+			Sleep(0);
+		}
+		else if (!this->compressing) {
+			// The background thread never started or exited. Compress the frames from this thread.
+			this->compressFrames();
+		}
+		else {
+			// It died while writing, so nothing after its last frame can be written.
+			this->broken = true;
+			return false;
+		}
+		EnterCriticalSection(&this->frameCs);
+		head = this->head.load(std::memory_order_relaxed);
+	}
+
+	std::string& frame = this->frames[head % this->frames.size()];
+	if (frame.empty()) {
+		this->frameStart = GetTickCount();
+	}
+	// A record is never split, so a frame may be larger than frameSize.
+	frame.append((const char*)data, size);
+	if (frame.size() >= this->frameSize) {
+		this->queueFrame();
+	}
+	LeaveCriticalSection(&this->frameCs);
+	return true;
+}
+
+bool CompressedTraceOutput::congested()
+{
+	if (this->backpressure != AsyncTraceOutput::BACKPRESSURE_DEGRADE) {
+		return false;
+	}
+	// Every other frame is waiting for the compression thread.
+	size_t queued = this->head.load(std::memory_order_relaxed) - this->tail.load(std::memory_order_acquire);
+	if (queued + 1 < this->frames.size()) {
+		return false;
+	}
+	this->degraded++;
+	return true;
+}
+
+
+
+FlightRecorderOutput::FlightRecorderOutput(size_t bufferSize)
+	: ringSize(bufferSize), tail(0), used(0), file(nullptr)
+{
+	this->ring = (char*)malloc(this->ringSize);
+}
+
+FlightRecorderOutput::~FlightRecorderOutput()
+{
+	free(this->ring);
+}
+
+void FlightRecorderOutput::ringCopy(size_t offset, void *out, size_t size) const
+{
+	offset %= this->ringSize;
+	size_t first = std::min(size, this->ringSize - offset);
+	memcpy(out, this->ring + offset, first);
+	memcpy((char*)out + first, this->ring, size - first);
+}
+
+bool FlightRecorderOutput::write(const void *data, size_t size, bool isInstruction)
+{
+	if (this->file) {
+		fwrite(data, size, 1, this->file);
+		return true;
+	}
+	// The first write is the trace header.
+	uint8_t type = *(const uint8_t*)data;
+	if (this->state.empty() || (!isInstruction && (type == REC_STRING || type == REC_OPCODE))) {
+		this->state.append((const char*)data, size);
+		return true;
+	}
+
+	uint32_t recordSize = size;
+	size_t needed = sizeof(recordSize) + size;
+	if (needed > this->ringSize) {
+		return false;
+	}
+	// Evict the oldest records.
+	while (this->used + needed > this->ringSize) {
+		uint32_t oldSize;
+		this->ringCopy(this->tail, &oldSize, sizeof(oldSize));
+		this->tail = (this->tail + sizeof(oldSize) + oldSize) % this->ringSize;
+		this->used -= sizeof(oldSize) + oldSize;
+	}
+
+	size_t head = (this->tail + this->used) % this->ringSize;
+	const char *parts[2] = { (const char*)&recordSize, (const char*)data };
+	size_t sizes[2] = { sizeof(recordSize), size };
+	for (int i = 0; i < 2; i++) {
+		size_t first = std::min(sizes[i], this->ringSize - head);
+		memcpy(this->ring + head, parts[i], first);
+		memcpy(this->ring, parts[i] + first, sizes[i] - first);
+		head = (head + sizes[i]) % this->ringSize;
+	}
+	this->used += needed;
+	return true;
+}
+
+void FlightRecorderOutput::beginFlush(FILE *file)
+{
+	this->file = file;
+	fwrite(this->state.data(), this->state.size(), 1, this->file);
+}
+
+void FlightRecorderOutput::pointers(std::vector<uint32_t>& out) const
+{
+	std::string record;
+	size_t offset = 0;
+	while (offset < this->used) {
+		uint32_t size;
+		this->ringCopy(this->tail + offset, &size, sizeof(size));
+		record.resize(size);
+		this->ringCopy(this->tail + offset + sizeof(size), &record[0], size);
+		offset += sizeof(size) + size;
+
+		// An instruction, optionally followed by the values of its TV_ARRAY argument.
+		if ((uint8_t)record[0] != REC_INSTRUCTION || size < sizeof(BinaryInstructionRecord)) {
+			continue;
+		}
+		const BinaryInstructionRecord *instruction = (const BinaryInstructionRecord*)record.data();
+		for (int i = 0; i < 4; i++) {
+			if (instruction->argType[i] == TV_POINTER) {
+				out.push_back(instruction->arg[i]);
+			}
+		}
+		size_t valuesOffset = sizeof(BinaryInstructionRecord) + sizeof(BinaryValuesRecord);
+		if (size >= valuesOffset) {
+			const BinaryValuesRecord *values = (const BinaryValuesRecord*)(record.data() + sizeof(BinaryInstructionRecord));
+			const BinaryValue *value = (const BinaryValue*)(record.data() + valuesOffset);
+			for (uint32_t i = 0; i < values->count && valuesOffset + (i + 1) * sizeof(BinaryValue) <= size; i++) {
+				if (value[i].type == TV_POINTER) {
+					out.push_back(value[i].value);
+				}
+			}
+		}
+	}
+}
+
+void FlightRecorderOutput::endFlush()
+{
+	std::string record;
+	while (this->used > 0) {
+		uint32_t size;
+		this->ringCopy(this->tail, &size, sizeof(size));
+		record.resize(size);
+		this->ringCopy(this->tail + sizeof(size), &record[0], size);
+		fwrite(record.data(), size, 1, this->file);
+		this->tail = (this->tail + sizeof(size) + size) % this->ringSize;
+		this->used -= sizeof(size) + size;
+	}
+	this->tail = 0;
+	this->file = nullptr;
+}
@@ -0,0 +1,395 @@
+#include <Squirrel tracer.h>
+
+void value_to_json(JsonStream& json, const TraceValue& value)
+{
+	switch (value.type) {
+	case TV_NULL:
+		json.null();
+		break;
+
+	case TV_INTEGER:
+		json.integer(value.i);
+		break;
+
+	case TV_FLOAT:
+		json.real(value.f);
+		break;
+
+	case TV_BOOL:
+		json.boolean(value.i != 0);
+		break;
+
+	case TV_POINTER: {
+		char string[] = "POINTER:0x00000000";
+		sprintf(string, "POINTER:%p", value.p);
+		json.string(string);
+		break;
+	}
+
+	case TV_USERPOINTER: {
+		char string[] = "<user pointer: 0x00000000>";
+		sprintf(string, "<user pointer: %p>", value.p);
+		json.string(string);
+		break;
+	}
+
+	case TV_STRING:
+		json.string(value.s);
+		break;
+
+	case TV_POOLED_STRING: {
+		char string[] = "STRING:4294967295";
+		sprintf(string, "STRING:%u", (uint32_t)value.i);
+		json.string(string);
+		break;
+	}
+
+	case TV_UNKNOWN_TYPE: {
+		char string[] = "<unknown non-refcounted type 0000000000>";
+		sprintf(string, "<unknown %srefcounted type %d>", ISREFCOUNTED(value.i) ? "" : "non-", value.i);
+		json.string(string);
+		break;
+	}
+
+	default:
+		json.string("(error in the trace value)");
+		break;
+	}
+}
+
+TraceWriter *TraceWriter::create(json_t *config, const char *name)
+{
+	const char *format = json_string_value(json_object_get(config, "format"));
+	if (format && strcmp(format, "binary") == 0) {
+		return new BinaryTraceWriter(TraceOutput::create(config, (std::string(name) + ".bin").c_str()));
+	}
+	if (format && strcmp(format, "json") != 0) {
+		log_printf("Squirrel tracer: unknown trace format \"%s\", falling back to json.\n", format);
+	}
+	return new JsonTraceWriter(TraceOutput::create(config, (std::string(name) + ".json").c_str()));
+}
+
+
+
+JsonTraceWriter::JsonTraceWriter(TraceOutput *output)
+	: TraceWriter(output)
+{
+	this->write("[\n", 2, false);
+}
+
+// Every record is followed by a comma, so the array is closed with an end record.
+JsonTraceWriter::~JsonTraceWriter()
+{
+	static const char end[] = "{\"type\":\"end\"}\n]\n";
+	this->write(end, sizeof(end) - 1, false);
+}
+
+void JsonTraceWriter::writeName(const TraceName& name)
+{
+	if (name.id < this->namesWritten.size() && this->namesWritten[name.id]) {
+		return;
+	}
+	if (name.id >= this->namesWritten.size()) {
+		this->namesWritten.resize(name.id + 1, false);
+	}
+	this->namesWritten[name.id] = true;
+
+	JsonStream& json = this->json;
+	json.clear();
+	json.beginObject();
+	json.key("type");
+	json.string("name");
+	json.key("id");
+	json.integer(name.id);
+	json.key("name");
+	json.string(name.str);
+	json.endObject();
+	json.append(",\n", 2);
+	this->write(json.data(), json.size(), false);
+}
+
+void JsonTraceWriter::writeInstruction(const TraceInstruction& instruction)
+{
+	static const char *keys[] = { "arg0", "arg1", "arg2", "arg3" };
+	JsonStream& json = this->json;
+
+	this->writeName(instruction.fn);
+	json.clear();
+	json.beginObject();
+	json.key("type");
+	json.string("instruction");
+	json.key("fn");
+	json.integer(instruction.fn.id);
+	json.key("op");
+	json.string(instruction.name);
+	for (int i = 0; i < 4; i++) {
+		json.key(keys[i]);
+		if (instruction.args[i].type == TV_ARRAY) {
+			json.beginArray();
+			for (const TraceValue& it : instruction.array) {
+				value_to_json(json, it);
+			}
+			json.endArray();
+		}
+		else {
+			value_to_json(json, instruction.args[i]);
+		}
+	}
+	json.endObject();
+	json.append(",\n", 2);
+	this->write(json.data(), json.size(), true);
+}
+
+void JsonTraceWriter::writeObject(const void *address, const char *content, size_t size)
+{
+	char header[] = "{\"type\":\"object\",\"address\":\"POINTER:0x00000000\",\"content\":";
+	sprintf(header, "{\"type\":\"object\",\"address\":\"POINTER:%p\",\"content\":", address);
+
+	this->json.clear();
+	this->json.append(header, strlen(header));
+	this->json.append(content, size);
+	this->json.append("},\n", 3);
+	this->write(this->json.data(), this->json.size(), false);
+}
+
+void JsonTraceWriter::writeDelta(const void *address, const char *content, size_t size)
+{
+	char header[] = "{\"type\":\"delta\",\"address\":\"POINTER:0x00000000\",\"content\":";
+	sprintf(header, "{\"type\":\"delta\",\"address\":\"POINTER:%p\",\"content\":", address);
+
+	this->json.clear();
+	this->json.append(header, strlen(header));
+	this->json.append(content, size);
+	this->json.append("},\n", 3);
+	this->write(this->json.data(), this->json.size(), false);
+}
+
+void JsonTraceWriter::writeFreed(const void *address)
+{
+	char line[] = "{\"type\":\"freed\",\"address\":\"POINTER:0x00000000\"},\n";
+	int size = sprintf(line, "{\"type\":\"freed\",\"address\":\"POINTER:%p\"},\n", address);
+	this->write(line, size, false);
+}
+
+void JsonTraceWriter::writeString(uint32_t id, const char *str, size_t size)
+{
+	JsonStream& json = this->json;
+	json.clear();
+	json.beginObject();
+	json.key("type");
+	json.string("string");
+	json.key("id");
+	json.integer(id);
+	json.key("value");
+	json.string(str, size);
+	json.endObject();
+	json.append(",\n", 2);
+	this->write(json.data(), json.size(), false);
+}
+
+void JsonTraceWriter::writeFrame(const TraceFrame& frame)
+{
+	JsonStream& json = this->json;
+	char pointer[] = "POINTER:0x00000000";
+
+	this->writeName(frame.fn);
+	this->writeName(frame.name);
+	json.clear();
+	json.beginObject();
+	json.key("type");
+	json.string(frame.event == FRAME_ENTER ? "enter" : "exit");
+	json.key("vm");
+	sprintf(pointer, "POINTER:%p", frame.vm);
+	json.string(pointer);
+	json.key("closure");
+	sprintf(pointer, "POINTER:%p", frame.closure);
+	json.string(pointer);
+	json.key("fn");
+	json.integer(frame.fn.id);
+	json.key("name");
+	json.integer(frame.name.id);
+	json.key("time");
+	json.integer(frame.time);
+	json.endObject();
+	json.append(",\n", 2);
+	this->write(json.data(), json.size(), false);
+}
+
+
+
+BinaryTraceWriter::BinaryTraceWriter(TraceOutput *output)
+	: TraceWriter(output)
+{
+	memset(this->opcodeWritten, 0, sizeof(this->opcodeWritten));
+
+	BinaryTraceHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, BINARY_TRACE_MAGIC, sizeof(BINARY_TRACE_MAGIC));
+	header.version = BINARY_TRACE_VERSION;
+	this->write(&header, sizeof(header), false);
+}
+
+uint32_t BinaryTraceWriter::internString(const char *str)
+{
+	auto it = this->strings.find(str);
+	if (it != this->strings.end()) {
+		return it->second;
+	}
+
+	BinaryStringRecord record;
+	record.record = REC_STRING;
+	record.id = this->strings.size();
+	record.size = strlen(str);
+	this->stateBuffer.append((const char*)&record, sizeof(record));
+	this->stateBuffer.append(str, record.size);
+
+	this->strings[str] = record.id;
+	return record.id;
+}
+
+// The NameTable IDs are mapped to string IDs, so the names aren't hashed for every record.
+uint32_t BinaryTraceWriter::internName(const TraceName& name)
+{
+	static const uint32_t NO_STRING = 0xFFFFFFFF;
+	if (name.id >= this->nameStrings.size()) {
+		this->nameStrings.resize(name.id + 1, NO_STRING);
+	}
+	uint32_t& id = this->nameStrings[name.id];
+	if (id == NO_STRING) {
+		id = this->internString(name.str);
+	}
+	return id;
+}
+
+BinaryValue BinaryTraceWriter::encodeValue(const TraceValue& value)
+{
+	BinaryValue out;
+	out.type = value.type;
+	switch (value.type) {
+	case TV_POINTER:
+	case TV_USERPOINTER:
+		out.value = (uint32_t)(uintptr_t)value.p;
+		break;
+
+	case TV_STRING:
+		out.value = this->internString(value.s);
+		break;
+
+	case TV_FLOAT:
+		memcpy(&out.value, &value.f, 4);
+		break;
+
+	default:
+		out.value = value.i;
+		break;
+	}
+	return out;
+}
+
+void BinaryTraceWriter::writeInstruction(const TraceInstruction& instruction)
+{
+	BinaryInstructionRecord record;
+	record.record = REC_INSTRUCTION;
+	record.op = instruction.op;
+	record.fn = this->internName(instruction.fn);
+
+	bool hasArray = false;
+	for (int i = 0; i < 4; i++) {
+		BinaryValue arg = this->encodeValue(instruction.args[i]);
+		record.argType[i] = arg.type;
+		record.arg[i] = arg.value;
+		if (instruction.args[i].type == TV_ARRAY) {
+			hasArray = true;
+		}
+	}
+	if (hasArray) {
+		this->array.resize(instruction.array.size());
+		for (size_t i = 0; i < instruction.array.size(); i++) {
+			this->array[i] = this->encodeValue(instruction.array[i]);
+		}
+	}
+
+	if (!this->opcodeWritten[instruction.op]) {
+		BinaryOpcodeRecord opcode;
+		opcode.record = REC_OPCODE;
+		opcode.op = instruction.op;
+		opcode.size = strlen(instruction.name);
+		this->stateBuffer.append((const char*)&opcode, sizeof(opcode));
+		this->stateBuffer.append(instruction.name, opcode.size);
+		this->opcodeWritten[instruction.op] = true;
+	}
+
+	if (!this->stateBuffer.empty()) {
+		this->write(this->stateBuffer.data(), this->stateBuffer.size(), false);
+		this->stateBuffer.clear();
+	}
+
+	this->buffer.assign((const char*)&record, sizeof(record));
+	if (hasArray) {
+		BinaryValuesRecord values;
+		values.record = REC_VALUES;
+		values.count = this->array.size();
+		this->buffer.append((const char*)&values, sizeof(values));
+		this->buffer.append((const char*)this->array.data(), values.count * sizeof(BinaryValue));
+	}
+	this->write(this->buffer.data(), this->buffer.size(), true);
+}
+
+void BinaryTraceWriter::writeObject(const void *address, const char *content, size_t size)
+{
+	BinaryObjectRecord record;
+	record.record = REC_OBJECT;
+	record.address = (uint32_t)(uintptr_t)address;
+	record.size = size;
+	this->buffer.assign((const char*)&record, sizeof(record));
+	this->buffer.append(content, size);
+	this->write(this->buffer.data(), this->buffer.size(), false);
+}
+
+void BinaryTraceWriter::writeDelta(const void *address, const char *content, size_t size)
+{
+	BinaryObjectRecord record;
+	record.record = REC_OBJECT_DELTA;
+	record.address = (uint32_t)(uintptr_t)address;
+	record.size = size;
+	this->buffer.assign((const char*)&record, sizeof(record));
+	this->buffer.append(content, size);
+	this->write(this->buffer.data(), this->buffer.size(), false);
+}
+
+void BinaryTraceWriter::writeFreed(const void *address)
+{
+	BinaryFreedRecord record;
+	record.record = REC_FREED;
+	record.address = (uint32_t)(uintptr_t)address;
+	this->write(&record, sizeof(record), false);
+}
+
+void BinaryTraceWriter::writeFrame(const TraceFrame& frame)
+{
+	BinaryFrameRecord record;
+	record.record = REC_FRAME;
+	record.event = frame.event;
+	record.vm = (uint32_t)(uintptr_t)frame.vm;
+	record.closure = (uint32_t)(uintptr_t)frame.closure;
+	record.fn = this->internName(frame.fn);
+	record.name = this->internName(frame.name);
+	record.time = frame.time;
+
+	if (!this->stateBuffer.empty()) {
+		this->write(this->stateBuffer.data(), this->stateBuffer.size(), false);
+		this->stateBuffer.clear();
+	}
+	this->write(&record, sizeof(record), false);
+}
+
+void BinaryTraceWriter::writeString(uint32_t id, const char *str, size_t size)
+{
+	BinaryPooledStringRecord record;
+	record.record = REC_POOLED_STRING;
+	record.id = id;
+	record.size = size;
+	this->buffer.assign((const char*)&record, sizeof(record));
+	this->buffer.append(str, size);
+	this->write(this->buffer.data(), this->buffer.size(), false);
+}
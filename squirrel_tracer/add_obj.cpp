@@ -1,232 +1,555 @@
 #include <Squirrel tracer.h>
 #include <vector>
-#include <list>
 
-static json_t *hex_to_json(uint32_t hex)
+static void hex_to_json(JsonStream& json, uint32_t hex)
 {
 	char string[] = "0x00000000";
 	sprintf(string, "0x%.8x", hex);
-	return json_string(string);
+	json.string(string);
 }
 
-template<> json_t *SquirrelTracer::obj_to_json(SQString *o) { return json_stringn(o->_val, o->_len); }
+template<> void SquirrelTracer::obj_to_json(JsonStream& json, SQString *o) { json.string(o->_val, o->_len); }
 
-template<> json_t *SquirrelTracer::obj_to_json(SQTable *o)
+template<> void SquirrelTracer::obj_to_json(JsonStream& json, SQTable *o)
 {
-	json_t *res = json_object();
-	json_object_set_new(res, "ObjectType", json_string("SQTable"));
+	json.beginObject();
+	json.key("ObjectType");
+	json.string("SQTable");
 
-	json_t *nodes = json_array();
+	json.key("_nodes");
+	json.beginArray();
+	this->objElements.clear();
 	for (int i = 0; i < o->_numofnodes; i++) {
-		json_t *node = json_object();
-		json_object_set_new(node, "key", add_obj(&o->_nodes[i].key));
-		json_object_set_new(node, "val", add_obj(&o->_nodes[i].val));
-		json_array_append_new(nodes, node);
+		this->objElements.push_back(json.size());
+		json.beginObject();
+		json.key("key");
+		value_to_json(json, add_obj(&o->_nodes[i].key));
+		json.key("val");
+		value_to_json(json, add_obj(&o->_nodes[i].val));
+		json.endObject();
 	}
-	json_object_set_new(res, "_nodes", nodes);
-	return res;
+	this->objElements.push_back(json.size());
+	json.endArray();
+	json.endObject();
 }
 
-template<> json_t *SquirrelTracer::obj_to_json(SQArray *o)
+template<> void SquirrelTracer::obj_to_json(JsonStream& json, SQArray *o)
 {
-	json_t *res = json_array();
+	json.beginArray();
+	this->objElements.clear();
 	for (unsigned int i = 0; i < o->_values.size(); i++) {
-		json_array_append_new(res, add_obj(&o->_values._vals[i]));
+		this->objElements.push_back(json.size());
+		value_to_json(json, add_obj(&o->_values._vals[i]));
 	}
-	return res;
+	this->objElements.push_back(json.size());
+	json.endArray();
 }
 
-template<> json_t *SquirrelTracer::obj_to_json(SQUserData *o)
+template<> void SquirrelTracer::obj_to_json(JsonStream& json, SQUserData *o)
 {
-	json_t *res = json_object();
-	json_object_set_new(res, "ObjectType", json_string("SQUserData"));
-
-	char *string = (char*)malloc(o->_size * 2 + 3);
-	strcpy(string, "0x");
-
-	uint8_t *data = (uint8_t*)(o + 1);
-	for (int i = 0; i < o->_size; i++) {
-		sprintf(string + 2 + i * 2, "%.2x", data[i]);
-	}
-
-	json_object_set_new(res, "data", json_string(string));
-	free(string);
-	return res;
+	json.beginObject();
+	json.key("ObjectType");
+	json.string("SQUserData");
+	json.key("data");
+	json.hex(o + 1, o->_size);
+	json.endObject();
 }
 
-template<> json_t *SquirrelTracer::obj_to_json(SQClosure *o)
+template<> void SquirrelTracer::obj_to_json(JsonStream& json, SQClosure *o)
 {
-	json_t *res = json_object();
-	json_object_set_new(res, "ObjectType", json_string("SQClosure"));
-	json_object_set_new(res, "_function", add_refcounted<SQFunctionProto>(o->_function));
-	return res;
+	json.beginObject();
+	json.key("ObjectType");
+	json.string("SQClosure");
+	json.key("_function");
+	value_to_json(json, add_refcounted<SQFunctionProto>(o->_function));
+	json.endObject();
 }
 
-template<> json_t *SquirrelTracer::obj_to_json(SQNativeClosure *o)
+template<> void SquirrelTracer::obj_to_json(JsonStream& json, SQNativeClosure *o)
 {
-	json_t *res = json_object();
-	json_object_set_new(res, "ObjectType", json_string("SQNativeClosure"));
-	json_object_set_new(res, "_name", add_obj(&o->_name));
-	json_object_set_new(res, "_function", hex_to_json((uint32_t)o->_function));
-	return res;
+	json.beginObject();
+	json.key("ObjectType");
+	json.string("SQNativeClosure");
+	json.key("_name");
+	value_to_json(json, add_obj(&o->_name));
+	json.key("_function");
+	hex_to_json(json, (uint32_t)o->_function);
+	json.endObject();
 }
 
-template<> json_t *SquirrelTracer::obj_to_json(SQGenerator *o)
+template<> void SquirrelTracer::obj_to_json(JsonStream& json, SQGenerator *o)
 {
-	json_t *res = json_object();
-	json_object_set_new(res, "ObjectType", json_string("SQGenerator"));
-	json_object_set_new(res, "_closure", add_obj(&o->_closure));
+	json.beginObject();
+	json.key("ObjectType");
+	json.string("SQGenerator");
+	json.key("_closure");
+	value_to_json(json, add_obj(&o->_closure));
 	// We may also want to print some things from SQVM::CallInfo _ci and from SQGeneratorState _state
-	return res;
+	json.endObject();
 }
 
-template<> json_t *SquirrelTracer::obj_to_json(SQFunctionProto *o)
+template<> void SquirrelTracer::obj_to_json(JsonStream& json, SQFunctionProto *o)
 {
-	json_t *res = json_object();
-	json_object_set_new(res, "ObjectType", json_string("SQFunctionProto"));
-	json_object_set_new(res, "_sourcename", add_obj(&o->_sourcename));
-	json_object_set_new(res, "_name", add_obj(&o->_name));
-	return res;
+	json.beginObject();
+	json.key("ObjectType");
+	json.string("SQFunctionProto");
+	json.key("_sourcename");
+	value_to_json(json, add_obj(&o->_sourcename));
+	json.key("_name");
+	value_to_json(json, add_obj(&o->_name));
+	json.endObject();
 }
 
-template<> json_t *SquirrelTracer::obj_to_json(SQClassMemberVec *o)
+template<> void SquirrelTracer::obj_to_json(JsonStream& json, SQClassMemberVec *o)
 {
-	json_t *res = json_array();
+	json.beginArray();
 	for (unsigned int i = 0; i < o->size(); i++) {
 		SQObjectPtr &it = o->_vals[i].val;
-		json_t *json = json_object();
-		json_object_set_new(json, "_ismethod", _ismethod(it) ? json_true() : json_false());
-		json_object_set_new(json, "_isfield", _isfield(it) ? json_true() : json_false());
-		json_object_set_new(json, "_member_idx", json_integer(_member_idx(it)));
-		json_array_append_new(res, json);
+		json.beginObject();
+		json.key("_ismethod");
+		json.boolean(_ismethod(it) != 0);
+		json.key("_isfield");
+		json.boolean(_isfield(it) != 0);
+		json.key("_member_idx");
+		json.integer(_member_idx(it));
+		json.endObject();
 	}
-	return res;
+	json.endArray();
 }
 
-template<> json_t *SquirrelTracer::obj_to_json(SQClass *o)
+template<> void SquirrelTracer::obj_to_json(JsonStream& json, SQClass *o)
 {
-	json_t *res = json_object();
-	json_object_set_new(res, "ObjectType", json_string("SQClass"));
+	json.beginObject();
+	json.key("ObjectType");
+	json.string("SQClass");
 	if (o->_base) {
-		json_object_set_new(res, "_base", add_refcounted<SQClass>(o->_base));
+		json.key("_base");
+		value_to_json(json, add_refcounted<SQClass>(o->_base));
 	}
-	json_object_set_new(res, "_members", add_refcounted<SQTable>(o->_members));
-	json_object_set_new(res, "_defaultvalues", add_refcounted<SQClassMemberVec>(&o->_defaultvalues));
-	json_object_set_new(res, "_methods", add_refcounted<SQClassMemberVec>(&o->_methods));
-	return res;
+	json.key("_members");
+	value_to_json(json, add_refcounted<SQTable>(o->_members));
+	json.key("_defaultvalues");
+	value_to_json(json, add_refcounted<SQClassMemberVec>(&o->_defaultvalues));
+	json.key("_methods");
+	value_to_json(json, add_refcounted<SQClassMemberVec>(&o->_methods));
+	json.endObject();
 }
 
-template<> json_t *SquirrelTracer::obj_to_json(SQInstance *o)
+template<> void SquirrelTracer::obj_to_json(JsonStream& json, SQInstance *o)
 {
-	json_t *res = json_object();
-	json_object_set_new(res, "ObjectType", json_string("SQInstance"));
-	json_object_set_new(res, "_class", add_refcounted<SQClass>(o->_class));
-
-	json_t *_values = json_array();
+	json.beginObject();
+	json.key("ObjectType");
+	json.string("SQInstance");
+	json.key("_class");
+	value_to_json(json, add_refcounted<SQClass>(o->_class));
+
+	json.key("_values");
+	json.beginArray();
 	size_t _values_size = o->_class->_defaultvalues.size(); // ... I guess?
-
 	for (size_t i = 0; i < _values_size; i++) {
-		json_array_append_new(_values, add_obj(&o->_values[i]));
+		value_to_json(json, add_obj(&o->_values[i]));
 	}
+	json.endArray();
+	json.endObject();
+}
 
-	json_object_set_new(res, "_values", _values);
-	return res;
+template<> void SquirrelTracer::obj_to_json(JsonStream& json, SQWeakRef *o)
+{
+	json.beginObject();
+	json.key("ObjectType");
+	json.string("SQWeakRef");
+	json.key("_obj");
+	value_to_json(json, add_obj(&o->_obj));
+	json.endObject();
 }
 
-template<> json_t *SquirrelTracer::obj_to_json(SQWeakRef *o)
+template<> void SquirrelTracer::obj_to_json(JsonStream& json, SQOuter *o)
 {
-	json_t *res = json_object();
-	json_object_set_new(res, "ObjectType", json_string("SQWeakRef"));
-	json_object_set_new(res, "_obj", add_obj(&o->_obj));
-	return res;
+	json.beginObject();
+	json.key("ObjectType");
+	json.string("SQOuter");
+	json.key("_valptr");
+	value_to_json(json, add_obj(o->_valptr));
+	json.key("_value");
+	value_to_json(json, add_obj(&o->_value));
+	json.endObject();
 }
 
-template<> json_t *SquirrelTracer::obj_to_json(SQOuter *o)
+// The objects without references (strings, userdata, class member vectors) have nothing to visit.
+template<typename T> void SquirrelTracer::add_refs(T *o) {}
+
+template<> void SquirrelTracer::add_refs(SQTable *o)
 {
-	json_t *res = json_object();
-	json_object_set_new(res, "ObjectType", json_string("SQOuter"));
-	json_object_set_new(res, "_valptr", add_obj(o->_valptr));
-	json_object_set_new(res, "_value", add_obj(&o->_value));
-	return res;
+	for (int i = 0; i < o->_numofnodes; i++) {
+		add_obj(&o->_nodes[i].key);
+		add_obj(&o->_nodes[i].val);
+	}
 }
 
-static std::list<void*> *stack = nullptr;
+template<> void SquirrelTracer::add_refs(SQArray *o)
+{
+	for (unsigned int i = 0; i < o->_values.size(); i++) {
+		add_obj(&o->_values._vals[i]);
+	}
+}
 
-template<typename T>
-json_t *SquirrelTracer::add_refcounted(T *o)
+template<> void SquirrelTracer::add_refs(SQClosure *o) { add_refcounted<SQFunctionProto>(o->_function); }
+template<> void SquirrelTracer::add_refs(SQNativeClosure *o) { add_obj(&o->_name); }
+template<> void SquirrelTracer::add_refs(SQGenerator *o) { add_obj(&o->_closure); }
+template<> void SquirrelTracer::add_refs(SQWeakRef *o) { add_obj(&o->_obj); }
+
+template<> void SquirrelTracer::add_refs(SQFunctionProto *o)
+{
+	add_obj(&o->_sourcename);
+	add_obj(&o->_name);
+}
+
+template<> void SquirrelTracer::add_refs(SQClass *o)
+{
+	if (o->_base) {
+		add_refcounted<SQClass>(o->_base);
+	}
+	add_refcounted<SQTable>(o->_members);
+	add_refcounted<SQClassMemberVec>(&o->_defaultvalues);
+	add_refcounted<SQClassMemberVec>(&o->_methods);
+}
+
+template<> void SquirrelTracer::add_refs(SQInstance *o)
 {
-	// TODO: use something based on std::vector to reduce allocations
-	if (!stack) {
-		stack = new std::list<void*>;
+	add_refcounted<SQClass>(o->_class);
+	size_t _values_size = o->_class->_defaultvalues.size();
+	for (size_t i = 0; i < _values_size; i++) {
+		add_obj(&o->_values[i]);
 	}
+}
 
+template<> void SquirrelTracer::add_refs(SQOuter *o)
+{
+	add_obj(o->_valptr);
+	add_obj(&o->_value);
+}
+
+static size_t header_size(void*) { return 0; }
+static const void *vtable_of(void*) { return nullptr; }
+static const void *vtable_of(SQRefCounted *o) { return *(const void**)o; }
+static size_t header_size(SQRefCounted*) { return sizeof(SQRefCounted); }
+static size_t header_size(SQCollectable*) { return sizeof(SQCollectable); }
+
+/**
+  * Out-of-line storage the JSON dump of an object depends on.
+  * The JSON dump references the other objects by address, so for a given object type,
+  * identical raw snapshots always give identical JSON dumps.
+  */
+template<typename T> static void add_extra(T *o, RawSnapshot& raw) {}
+template<> void add_extra(SQString *o, RawSnapshot& raw) { raw.extra = o->_val; raw.extraSize = o->_len; }
+template<> void add_extra(SQTable *o, RawSnapshot& raw) { raw.extra = o->_nodes; raw.extraSize = o->_numofnodes * sizeof(SQTable::_HashNode); }
+template<> void add_extra(SQArray *o, RawSnapshot& raw) { raw.extra = o->_values._vals; raw.extraSize = o->_values.size() * sizeof(SQObjectPtr); }
+template<> void add_extra(SQUserData *o, RawSnapshot& raw) { raw.extra = o + 1; raw.extraSize = o->_size; }
+template<> void add_extra(SQClassMemberVec *o, RawSnapshot& raw) { raw.extra = o->_vals; raw.extraSize = o->size() * sizeof(SQClassMember); }
+template<> void add_extra(SQInstance *o, RawSnapshot& raw) { raw.extra = o->_values; raw.extraSize = o->_class->_defaultvalues.size() * sizeof(SQObjectPtr); }
+template<> void add_extra(SQOuter *o, RawSnapshot& raw) { raw.extra = o->_valptr; raw.extraSize = o->_valptr ? sizeof(SQObjectPtr) : 0; }
+
+// The refcount and GC list header is skipped: it changes all the time, and it isn't part of the dump.
+template<typename T> static RawSnapshot raw_snapshot(T *o)
+{
+	RawSnapshot raw;
+	raw.data = (char*)o + header_size(o);
+	raw.size = sizeof(T) - header_size(o);
+	raw.extra = nullptr;
+	raw.extraSize = 0;
+	add_extra<T>(o, raw);
+	return raw;
+}
+
+template<typename T>
+TraceValue SquirrelTracer::add_refcounted(T *o)
+{
 	if (!o) {
-		return json_null();
+		return TraceValue();
 	}
 
-	json_t *res;
-	char string[] = "POINTER:0x00000000";
-	sprintf(string, "POINTER:%p", o);
-	res = json_string(string);
+	if (this->flight && !this->flushing) {
+		// Dumped only if the flight recorder is flushed while it still references the object.
+		TrackedObject& tracked = this->flightObjs[o];
+		tracked.dump = &SquirrelTracer::dump_obj<T>;
+		tracked.vtable = vtable_of(o);
+		return TraceValue(TV_POINTER, o);
+	}
 
-	if (std::count(stack->begin(), stack->end(), o) > 0) {
-		log_print("<Squirrel tracer - infinite recursion detected>\n");
-		return res;
+	// The object is dumped later, by dump_pending_objs. The visited check also stops the cycles.
+	ObjectDump& dump = objs_list[o];
+	if (dump.epoch != this->objEpoch) {
+		dump.epoch = this->objEpoch;
+		PendingObject pending = { o, &SquirrelTracer::dump_obj<T> };
+		this->pendingObjs.push_back(pending);
+	}
+	return TraceValue(TV_POINTER, o);
+}
+
+void SquirrelTracer::load_delta_config(json_t *config)
+{
+	json_t *deltas = json_object_get(config, "deltas");
+	this->deltaConfig.enabled = !json_is_false(json_object_get(deltas, "enabled"));
+	json_int_t interval = json_integer_value(json_object_get(deltas, "keyframe_interval"));
+	this->deltaConfig.keyframeInterval = interval > 0 ? (uint32_t)interval : 32;
+	json_t *minElements = json_object_get(deltas, "min_elements");
+	this->deltaConfig.minElements = json_is_integer(minElements) ? (size_t)json_integer_value(minElements) : 16;
+}
+
+bool SquirrelTracer::write_elements_delta(const void *address, const RawSnapshot& raw, ObjectDump& dump,
+	size_t elementSize, size_t compareSize, bool resizable)
+{
+	size_t snapshotSize;
+	const char *snapshot = dump.snapshot(snapshotSize);
+	size_t count = raw.extraSize / elementSize;
+	if (!this->deltaConfig.enabled || !snapshot || dump.deltas >= this->deltaConfig.keyframeInterval
+		|| count < this->deltaConfig.minElements) {
+		return false;
+	}
+	size_t oldCount = (snapshotSize - raw.size) / elementSize;
+	if (oldCount != count && !resizable) {
+		return false;
+	}
+
+	const char *oldElements = snapshot + raw.size;
+	const char *newElements = (const char*)raw.extra;
+	const char *json = this->objJson.data();
+	JsonStream& delta = this->deltaJson;
+	delta.clear();
+	delta.beginObject();
+	delta.key("length");
+	delta.integer(count);
+	delta.key("set");
+	delta.beginArray();
+	size_t changed = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (i < oldCount && memcmp(oldElements + i * elementSize, newElements + i * elementSize, compareSize) == 0) {
+			continue;
+		}
+		// When most of the elements changed, the full dump is about as large.
+		if (++changed * 2 > count) {
+			return false;
+		}
+		size_t start = this->objElements[i];
+		size_t end = this->objElements[i + 1];
+		if (json[start] == ',') {
+			start++;
+		}
+		delta.beginArray();
+		delta.integer(i);
+		delta.raw(json + start, end - start);
+		delta.endArray();
 	}
-	stack->push_back(o);
+	delta.endArray();
+	delta.endObject();
 
+	this->writer->writeDelta(address, delta.data(), delta.size());
+	dump.deltas++;
+	return true;
+}
+
+template<typename T> bool SquirrelTracer::write_delta(T *o, const RawSnapshot& raw, ObjectDump& dump) { return false; }
+
+// A rehash moves every node, so a table can only be written as a delta if it wasn't resized.
+// next isn't part of the dump, only val and key are compared.
+template<> bool SquirrelTracer::write_delta(SQTable *o, const RawSnapshot& raw, ObjectDump& dump)
+{
+	return this->write_elements_delta(o, raw, dump, sizeof(SQTable::_HashNode), 2 * sizeof(SQObjectPtr), false);
+}
+
+template<> bool SquirrelTracer::write_delta(SQArray *o, const RawSnapshot& raw, ObjectDump& dump)
+{
+	return this->write_elements_delta(o, raw, dump, sizeof(SQObjectPtr), sizeof(SQObjectPtr), true);
+}
+
+template<typename T>
+void SquirrelTracer::dump_obj(void *p)
+{
+	T *o = (T*)p;
+	RawSnapshot raw = raw_snapshot<T>(o);
+	this->objStats.visited++;
+	if (objs_list[o].equal(raw)) {
+		// Nothing in the dump changed, but the objects it references may have.
+		this->objStats.rawUnchanged++;
+		this->add_refs<T>(o);
+		return;
+	}
+
+	// This pushes the referenced objects to the pending stack.
+	JsonStream& json = this->objJson;
+	json.clear();
+	this->obj_to_json<T>(json, o);
+	// The referenced objects may have been added to the collection, and moved this one.
 	ObjectDump& dump = objs_list[o];
-	// TODO: create the json object only when dump.equal(o, sizeof(T)) == false
-	json_t *obj_json = this->obj_to_json<T>(o);
-	if (dump.equal(o, sizeof(T)) == false) {
-		// Even when the objects differ, if the JSON dump is identical, we don't need to replace it.
-		if (dump.equal(obj_json) == false) {
-			dump.set(o, sizeof(T), obj_json);
-			dump.writeToFile(this->file);
+	// Even when the objects differ, if the JSON dump is identical, we don't need to write it.
+	// We still store the new snapshot, so the next check is a memcmp again.
+	if (dump.equal(json) == false) {
+		// The delta is computed against the previous snapshot, so it is written before set().
+		if (this->write_delta<T>(o, raw, dump)) {
+			dump.set(o, raw, json);
+			this->objStats.deltas++;
 		}
+		else {
+			// Written from the stream: the snapshot isn't stored if the store is full.
+			this->writer->writeObject(o, json.data(), json.size());
+			dump.set(o, raw, json);
+			dump.deltas = 0;
+		}
+		if (this->segments) {
+			TrackedObject& tracked = this->segmentObjs[o];
+			tracked.dump = &SquirrelTracer::dump_obj<T>;
+			tracked.vtable = vtable_of(o);
+		}
+		this->objStats.written++;
+	}
+	else {
+		dump.set(o, raw, json);
+		this->objStats.jsonUnchanged++;
 	}
-	json_decref(obj_json);
+}
 
-	stack->pop_back();
-	return res;
+// A referenced object is dumped after the object referencing it. That's fine for the readers:
+// every object an instruction uses is written before the instruction.
+void SquirrelTracer::dump_pending_objs()
+{
+	while (!this->pendingObjs.empty()) {
+		PendingObject pending = this->pendingObjs.back();
+		this->pendingObjs.pop_back();
+		(this->*pending.dump)(pending.o);
+	}
 }
 
-json_t *SquirrelTracer::add_obj(SQObject *o)
+/**
+  * Calls f(o) for every string and collectable object of a VM, and for their weak references.
+  * The VM must not run meanwhile.
+  */
+template<typename F> static void for_each_live_object(SQSharedState *ss, F f)
+{
+	SQStringTable *strings = ss->_stringtable;
+	for (SQUnsignedInteger i = 0; i < strings->_numofslots; i++) {
+		for (SQString *s = strings->_strings[i]; s; s = s->_next) {
+			f(s);
+			if (s->_weakref) {
+				f(s->_weakref);
+			}
+		}
+	}
+#ifndef NO_GARBAGE_COLLECTOR
+	for (SQCollectable *o = ss->_gc_chain; o; o = o->_next) {
+		f(o);
+		if (o->_weakref) {
+			f(o->_weakref);
+		}
+	}
+#endif
+}
+
+void SquirrelTracer::queue_live_objects(FlatPtrMap<void*, TrackedObject>& tracked)
+{
+	// Without a VM, nothing is known to be alive.
+	if (!this->sharedState) {
+		tracked.clear();
+		return;
+	}
+	FlatPtrMap<void*, bool> alive(tracked.size());
+	auto queue = [this, &alive](void *o, void (SquirrelTracer::*dump)(void*)) {
+		alive[o] = true;
+		ObjectDump& objDump = this->objs_list[o];
+		if (objDump.epoch != this->objEpoch) {
+			objDump.epoch = this->objEpoch;
+			PendingObject pending = { o, dump };
+			this->pendingObjs.push_back(pending);
+		}
+	};
+	for_each_live_object(this->sharedState, [this, &tracked, &queue](SQRefCounted *o) {
+		TrackedObject *object = tracked.find(o);
+		if (!object || object->vtable != vtable_of(o)) {
+			return;
+		}
+		queue(o, object->dump);
+		// The member vectors are embedded in their class, so they aren't in the GC chain,
+		// and they have no vtable to check. They live as long as the class.
+		if (object->dump == &SquirrelTracer::dump_obj<SQClass>) {
+			SQClass *cls = (SQClass*)o;
+			queue(&cls->_defaultvalues, &SquirrelTracer::dump_obj<SQClassMemberVec>);
+			queue(&cls->_methods, &SquirrelTracer::dump_obj<SQClassMemberVec>);
+		}
+	});
+	tracked.erase_if([&alive](void *o, TrackedObject&) { return alive.find(o) == nullptr; });
+}
+
+void SquirrelTracer::remove_obj(void *o)
+{
+	EnterCriticalSection(&this->cs);
+	// sq_vm_free also sees the buffers of the objects. Only the objects we dumped are reported.
+	if (this->objs_list.erase(o)) {
+		this->writer->writeFreed(o);
+		this->objStats.freed++;
+	}
+	this->closureDB.erase((SQClosure*)o);
+	this->filter.erase((SQClosure*)o);
+	if (this->profiler) {
+		this->profiler->remove(o);
+	}
+	this->frameStacks.erase((SQVM*)o);
+	// sq_close frees the shared state last. Its objects can't be read anymore.
+	if (o == this->sharedState) {
+		this->sharedState = nullptr;
+	}
+	this->flightObjs.erase(o);
+	this->segmentObjs.erase(o);
+	if (this->flight) {
+		this->flight->erase((SQFunctionProto*)o);
+	}
+	if (this->plans.erase((SQFunctionProto*)o)) {
+		this->lastProto = nullptr;
+	}
+	LeaveCriticalSection(&this->cs);
+}
+
+TraceValue SquirrelTracer::add_string(SQString *s)
+{
+	bool isNew;
+	uint32_t id = this->strings.get(s, isNew);
+	if (isNew) {
+		this->writer->writeString(id, s->_val, s->_len);
+	}
+	return TraceValue(TV_POOLED_STRING, (int32_t)id);
+}
+
+TraceValue SquirrelTracer::add_obj(SQObject *o)
 {
 	if (!o) {
-		return json_null();
+		return TraceValue();
 	}
 
 	if (!ISREFCOUNTED(o->_type)) {
 		switch (o->_type) {
 		case OT_NULL:
-			return json_null();
+			return TraceValue();
 
 		case OT_INTEGER:
-			return json_integer(o->_unVal.nInteger);
+			return TraceValue(TV_INTEGER, o->_unVal.nInteger);
 
 		case OT_FLOAT:
-			return json_real(o->_unVal.fFloat);
+			return TraceValue(o->_unVal.fFloat);
 
 		case OT_BOOL:
-			return o->_unVal.nInteger ? json_true() : json_false();
+			return TraceValue(TV_BOOL, o->_unVal.nInteger);
 
-		case OT_USERPOINTER: {
-			char string[1024] = "<user pointer: 0x00000000>";
-			sprintf(string, "<user pointer: %p>", o->_unVal.pUserPointer);
-			return json_string(string);
-		}
+		case OT_USERPOINTER:
+			return TraceValue(TV_USERPOINTER, o->_unVal.pUserPointer);
 
-		default: {
-			char string[1024] = "<unknown non-refcounted type 0000000000>";
-			sprintf(string, "<unknown non-refcounted type %d>", o->_type);
-			return json_string(string);
-		}
+		default:
+			return TraceValue(TV_UNKNOWN_TYPE, o->_type);
 		}
 	}
 	else {
 		switch (o->_type) {
 		case OT_STRING:
+			if (this->strings.enabled && !this->flight) {
+				return add_string(o->_unVal.pString);
+			}
 			return add_refcounted<SQString>(o->_unVal.pString);
 
 		case OT_TABLE:
@@ -248,7 +571,7 @@ json_t *SquirrelTracer::add_obj(SQObject *o)
 			return add_refcounted<SQGenerator>(o->_unVal.pGenerator);
 
 		case OT_THREAD:
-			return json_string("<thread>"); // Type: SQVM. I don't think we're interested by its content.
+			return TraceValue("<thread>"); // Type: SQVM. I don't think we're interested by its content.
 
 		case OT_FUNCPROTO:
 			return add_refcounted<SQFunctionProto>(o->_unVal.pFunctionProto);
@@ -266,9 +589,7 @@ json_t *SquirrelTracer::add_obj(SQObject *o)
 			return add_refcounted<SQOuter>(o->_unVal.pOuter);
 
 		default:
-			char string[1024] = "<unknown refcounted type 0000000000>";
-			sprintf(string, "<unknown refcounted type %d>", o->_type);
-			return json_string(string);
+			return TraceValue(TV_UNKNOWN_TYPE, o->_type);
 		}
 	}
 }
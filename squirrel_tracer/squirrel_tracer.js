@@ -0,0 +1,64 @@
+{
+	"mode": "trace",
+	"format": "json",
+	"decode_plans": true,
+	"decode_stats": false,
+	"frames": false,
+	"control": {
+		"enabled": true,
+		"toggle_key": "O"
+	},
+	"filters": {
+		"files": { "include": [], "exclude": [] },
+		"functions": { "include": [], "exclude": [] },
+		"opcodes": { "include": [], "exclude": [] }
+	},
+	"profile": {
+		"interval": 10,
+		"report": "profile.txt",
+		"callgrind": "callgrind.out.squirrel"
+	},
+	"flight_recorder": {
+		"buffer_size": 4,
+		"file": "flight",
+		"max_files": 16,
+		"trigger_opcodes": ["throw"],
+		"trigger_functions": [],
+		"on_exit": true
+	},
+	"sampling": {
+		"mode": "none",
+		"rate": 100,
+		"burst_length": 1000,
+		"burst_interval": 1000
+	},
+	"output": {
+		"async": false,
+		"buffer_size": 16,
+		"backpressure": "block",
+		"compression": "none",
+		"frame_size": 1
+	},
+	"string_pool": {
+		"enabled": true,
+		"max_strings": 65536,
+		"max_size": 16
+	},
+	"deltas": {
+		"enabled": true,
+		"keyframe_interval": 32,
+		"min_elements": 16
+	},
+	"segments": {
+		"enabled": false,
+		"file": "trace",
+		"max_size": 64,
+		"max_instructions": 0,
+		"max_total_size": 1024,
+		"index_interval": 4096
+	},
+	"snapshots": {
+		"store": "memory",
+		"slab_size": 16
+	}
+}
@@ -12,6 +12,9 @@
 		"file_name_for_squirrel": {
 			"file_name": "esi",
 			"cavesize": 6
+		},
+		"sq_vm_free": {
+			"p": "[esp+4]"
 		}
 	}
 }
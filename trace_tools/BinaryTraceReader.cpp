@@ -0,0 +1,157 @@
+#include "trace_tools.h"
+#include <string.h>
+
+BinaryTraceReader::BinaryTraceReader()
+	: file(nullptr), record(0), address(0), pooledId(0)
+{}
+
+BinaryTraceReader::~BinaryTraceReader()
+{
+	if (this->file) {
+		fclose(this->file);
+	}
+}
+
+bool BinaryTraceReader::open(const char *fn)
+{
+	this->file = fopen(fn, "rb");
+	if (!this->file) {
+		fprintf(stderr, "%s: cannot open file\n", fn);
+		return false;
+	}
+
+	BinaryTraceHeader header;
+	if (!this->read(&header, sizeof(header)) || memcmp(header.magic, BINARY_TRACE_MAGIC, sizeof(BINARY_TRACE_MAGIC)) != 0) {
+		fprintf(stderr, "%s: not a binary trace\n", fn);
+		return false;
+	}
+	if (header.version == 0 || header.version > BINARY_TRACE_VERSION) {
+		fprintf(stderr, "%s: unsupported binary trace version %u\n", fn, header.version);
+		return false;
+	}
+	return true;
+}
+
+bool BinaryTraceReader::read(void *buffer, size_t size)
+{
+	return size == 0 || fread(buffer, size, 1, this->file) == 1;
+}
+
+bool BinaryTraceReader::readString(std::string& out, uint32_t size)
+{
+	out.resize(size);
+	return size == 0 || this->read(&out[0], size);
+}
+
+bool BinaryTraceReader::next()
+{
+	uint8_t type;
+	while (this->read(&type, 1)) {
+		switch (type) {
+		case REC_STRING: {
+			BinaryStringRecord string;
+			if (!this->read((uint8_t*)&string + 1, sizeof(string) - 1)) {
+				return false;
+			}
+			if (string.id >= this->strings.size()) {
+				this->strings.resize(string.id + 1);
+			}
+			if (!this->readString(this->strings[string.id], string.size)) {
+				return false;
+			}
+			break;
+		}
+
+		case REC_OPCODE: {
+			BinaryOpcodeRecord opcode;
+			if (!this->read((uint8_t*)&opcode + 1, sizeof(opcode) - 1) ||
+				!this->readString(this->opcodes[opcode.op], opcode.size)) {
+				return false;
+			}
+			break;
+		}
+
+		case REC_INSTRUCTION: {
+			this->record = type;
+			this->instruction.record = type;
+			if (!this->read((uint8_t*)&this->instruction + 1, sizeof(this->instruction) - 1)) {
+				return false;
+			}
+			this->values.clear();
+			for (int i = 0; i < 4; i++) {
+				if (this->instruction.argType[i] != TV_ARRAY) {
+					continue;
+				}
+				BinaryValuesRecord values;
+				if (!this->read(&values, sizeof(values)) || values.record != REC_VALUES) {
+					fprintf(stderr, "Missing REC_VALUES record after an instruction\n");
+					return false;
+				}
+				this->values.resize(values.count);
+				if (values.count > 0 && !this->read(this->values.data(), values.count * sizeof(BinaryValue))) {
+					return false;
+				}
+				break;
+			}
+			return true;
+		}
+
+		case REC_OBJECT:
+		case REC_OBJECT_DELTA: {
+			BinaryObjectRecord object;
+			this->record = type;
+			if (!this->read((uint8_t*)&object + 1, sizeof(object) - 1) ||
+				!this->readString(this->content, object.size)) {
+				return false;
+			}
+			this->address = object.address;
+			return true;
+		}
+
+		case REC_FREED: {
+			BinaryFreedRecord freed;
+			this->record = type;
+			if (!this->read((uint8_t*)&freed + 1, sizeof(freed) - 1)) {
+				return false;
+			}
+			this->address = freed.address;
+			return true;
+		}
+
+		case REC_POOLED_STRING: {
+			BinaryPooledStringRecord string;
+			this->record = type;
+			if (!this->read((uint8_t*)&string + 1, sizeof(string) - 1) ||
+				!this->readString(this->content, string.size)) {
+				return false;
+			}
+			this->pooledId = string.id;
+			return true;
+		}
+
+		case REC_FRAME:
+			this->record = type;
+			this->frame.record = type;
+			return this->read((uint8_t*)&this->frame + 1, sizeof(this->frame) - 1);
+
+		default:
+			fprintf(stderr, "Unknown record type %u at offset %ld\n", type, ftell(this->file) - 1);
+			return false;
+		}
+	}
+	return false;
+}
+
+const std::string& BinaryTraceReader::string(uint32_t id) const
+{
+	static const std::string empty;
+	if (id >= this->strings.size()) {
+		return empty;
+	}
+	return this->strings[id];
+}
+
+const std::string& BinaryTraceReader::opcode(uint8_t op) const
+{
+	return this->opcodes[op];
+}
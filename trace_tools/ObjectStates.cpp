@@ -0,0 +1,249 @@
+#include "trace_tools.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+  * Minimal JSON scanning: the contents are only split, never converted to a tree.
+  * Every function returns the position after what it read, or nullptr if the JSON is invalid.
+  */
+
+static const char *skip_spaces(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+		p++;
+	}
+	return p;
+}
+
+static const char *skip_string(const char *p, const char *end)
+{
+	for (p++; p < end; p++) {
+		if (*p == '\\') {
+			p++;
+		}
+		else if (*p == '"') {
+			return p + 1;
+		}
+	}
+	return nullptr;
+}
+
+static const char *skip_value(const char *p, const char *end)
+{
+	p = skip_spaces(p, end);
+	if (p >= end) {
+		return nullptr;
+	}
+	if (*p == '"') {
+		return skip_string(p, end);
+	}
+	if (*p != '[' && *p != '{') {
+		// Number, true, false or null
+		while (p < end && *p != ',' && *p != ']' && *p != '}' && *p != ' ' && *p != '\n') {
+			p++;
+		}
+		return p;
+	}
+	int depth = 0;
+	while (p < end) {
+		if (*p == '"') {
+			p = skip_string(p, end);
+			if (!p) {
+				return nullptr;
+			}
+			continue;
+		}
+		if (*p == '[' || *p == '{') {
+			depth++;
+		}
+		else if (*p == ']' || *p == '}') {
+			if (--depth == 0) {
+				return p + 1;
+			}
+		}
+		p++;
+	}
+	return nullptr;
+}
+
+// Calls f(begin, end) for every element of the array at p.
+template<typename F> static const char *for_each_element(const char *p, const char *end, F f)
+{
+	p = skip_spaces(p, end);
+	if (p >= end || *p != '[') {
+		return nullptr;
+	}
+	p = skip_spaces(p + 1, end);
+	if (p < end && *p == ']') {
+		return p + 1;
+	}
+	while (p && p < end) {
+		const char *elementEnd = skip_value(p, end);
+		if (!elementEnd || !f(p, elementEnd)) {
+			return nullptr;
+		}
+		p = skip_spaces(elementEnd, end);
+		if (p < end && *p == ']') {
+			return p + 1;
+		}
+		if (p >= end || *p != ',') {
+			return nullptr;
+		}
+		p = skip_spaces(p + 1, end);
+	}
+	return nullptr;
+}
+
+// Calls f(key, keySize, value, valueEnd) for every member of the object at p.
+template<typename F> static const char *for_each_member(const char *p, const char *end, F f)
+{
+	p = skip_spaces(p, end);
+	if (p >= end || *p != '{') {
+		return nullptr;
+	}
+	p = skip_spaces(p + 1, end);
+	if (p < end && *p == '}') {
+		return p + 1;
+	}
+	while (p < end && *p == '"') {
+		const char *keyEnd = skip_string(p, end);
+		if (!keyEnd) {
+			return nullptr;
+		}
+		const char *value = skip_spaces(keyEnd, end);
+		if (value >= end || *value != ':') {
+			return nullptr;
+		}
+		value = skip_spaces(value + 1, end);
+		const char *valueEnd = skip_value(value, end);
+		if (!valueEnd || !f(p + 1, (size_t)(keyEnd - p - 2), value, valueEnd)) {
+			return nullptr;
+		}
+		p = skip_spaces(valueEnd, end);
+		if (p < end && *p == '}') {
+			return p + 1;
+		}
+		if (p >= end || *p != ',') {
+			return nullptr;
+		}
+		p = skip_spaces(p + 1, end);
+	}
+	return nullptr;
+}
+
+static bool key_is(const char *key, size_t size, const char *expected)
+{
+	return size == strlen(expected) && memcmp(key, expected, size) == 0;
+}
+
+void ObjectStates::object(uint32_t address, const std::string& content)
+{
+	State& state = this->objects[address];
+	state.elements.clear();
+	state.hasElements = false;
+
+	// The elements of an array, or the nodes of a table.
+	const char *begin = content.data();
+	const char *end = begin + content.size();
+	const char *array = nullptr;
+	const char *p = skip_spaces(begin, end);
+	if (p < end && *p == '[') {
+		array = p;
+	}
+	else if (p < end && *p == '{') {
+		for_each_member(p, end, [&array](const char *key, size_t size, const char *value, const char*) {
+			if (key_is(key, size, "_nodes") && *value == '[') {
+				array = value;
+			}
+			return true;
+		});
+	}
+
+	const char *arrayEnd = nullptr;
+	if (array) {
+		arrayEnd = for_each_element(array, end, [&state](const char *element, const char *elementEnd) {
+			state.elements.push_back(std::string(element, elementEnd));
+			return true;
+		});
+	}
+	if (!arrayEnd) {
+		state.elements.clear();
+		state.prefix = content;
+		state.suffix.clear();
+		return;
+	}
+	state.hasElements = true;
+	state.prefix.assign(begin, array + 1);
+	state.suffix.assign(arrayEnd - 1, end);
+}
+
+bool ObjectStates::delta(uint32_t address, const std::string& content)
+{
+	auto it = this->objects.find(address);
+	if (it == this->objects.end() || !it->second.hasElements) {
+		return false;
+	}
+	State& state = it->second;
+
+	const char *end = content.data() + content.size();
+	long long length = -1;
+	std::vector<std::pair<size_t, std::string>> changes;
+	const char *p = for_each_member(content.data(), end,
+		[&length, &changes](const char *key, size_t size, const char *value, const char *valueEnd) {
+		if (key_is(key, size, "length")) {
+			length = strtoll(value, nullptr, 10);
+			return length >= 0;
+		}
+		if (!key_is(key, size, "set")) {
+			return true;
+		}
+		// [[index,element],...]
+		return for_each_element(value, valueEnd, [&changes](const char *change, const char *changeEnd) {
+			size_t n = 0;
+			return for_each_element(change, changeEnd, [&changes, &n](const char *element, const char *elementEnd) {
+				if (n == 0) {
+					changes.push_back(std::make_pair((size_t)strtoull(element, nullptr, 10), std::string()));
+				}
+				else if (n == 1) {
+					changes.back().second.assign(element, elementEnd);
+				}
+				return ++n <= 2;
+			}) != nullptr && n == 2;
+		}) != nullptr;
+	});
+	if (!p || length < 0) {
+		return false;
+	}
+
+	state.elements.resize((size_t)length, "null");
+	for (auto& change : changes) {
+		if (change.first >= state.elements.size()) {
+			return false;
+		}
+		state.elements[change.first].swap(change.second);
+	}
+	return true;
+}
+
+void ObjectStates::freed(uint32_t address)
+{
+	this->objects.erase(address);
+}
+
+bool ObjectStates::get(uint32_t address, std::string& content) const
+{
+	auto it = this->objects.find(address);
+	if (it == this->objects.end()) {
+		return false;
+	}
+	const State& state = it->second;
+	content = state.prefix;
+	for (size_t i = 0; i < state.elements.size(); i++) {
+		if (i > 0) {
+			content += ',';
+		}
+		content += state.elements[i];
+	}
+	content += state.suffix;
+	return true;
+}
@@ -0,0 +1,787 @@
+#include "trace_tools.h"
+#include "TraceIndex.h"
+#include "JsonStream.h"
+#include <string.h>
+#include <algorithm>
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif
+
+MappedFile::MappedFile()
+	: file(nullptr), mapping(nullptr), fd(-1), fileSize(0), view(nullptr), viewOffset(0), viewSize(0)
+{}
+
+MappedFile::~MappedFile()
+{
+	this->close();
+}
+
+bool MappedFile::open(const char *fn)
+{
+	this->close();
+#ifdef _WIN32
+	HANDLE file = CreateFileA(fn, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	this->file = file;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size)) {
+		this->close();
+		return false;
+	}
+	this->fileSize = size.QuadPart;
+	// An empty file can't be mapped.
+	if (this->fileSize > 0) {
+		this->mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!this->mapping) {
+			this->close();
+			return false;
+		}
+	}
+#else
+	this->fd = ::open(fn, O_RDONLY);
+	if (this->fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(this->fd, &st) != 0) {
+		this->close();
+		return false;
+	}
+	this->fileSize = st.st_size;
+#endif
+	return true;
+}
+
+void MappedFile::unmap()
+{
+	if (!this->view) {
+		return;
+	}
+#ifdef _WIN32
+	UnmapViewOfFile(this->view);
+#else
+	munmap((void*)this->view, this->viewSize);
+#endif
+	this->view = nullptr;
+	this->viewSize = 0;
+}
+
+void MappedFile::close()
+{
+	this->unmap();
+#ifdef _WIN32
+	if (this->mapping) {
+		CloseHandle(this->mapping);
+		this->mapping = nullptr;
+	}
+	if (this->file) {
+		CloseHandle(this->file);
+		this->file = nullptr;
+	}
+#else
+	if (this->fd >= 0) {
+		::close(this->fd);
+		this->fd = -1;
+	}
+#endif
+	this->fileSize = 0;
+}
+
+const char *MappedFile::map(uint64_t offset, size_t size)
+{
+	if (size == 0 || offset > this->fileSize || size > this->fileSize - offset) {
+		return nullptr;
+	}
+	if (this->view && offset >= this->viewOffset && offset + size <= this->viewOffset + this->viewSize) {
+		return this->view + (offset - this->viewOffset);
+	}
+
+	this->unmap();
+	uint64_t start = offset - offset % GRANULARITY;
+	uint64_t end = offset + size;
+	if (end - start < WINDOW_SIZE) {
+		end = start + WINDOW_SIZE;
+	}
+	if (end > this->fileSize) {
+		end = this->fileSize;
+	}
+	size_t viewSize = (size_t)(end - start);
+#ifdef _WIN32
+	this->view = (const char*)MapViewOfFile(this->mapping, FILE_MAP_READ, (DWORD)(start >> 32), (DWORD)start, viewSize);
+#else
+	void *view = mmap(nullptr, viewSize, PROT_READ, MAP_SHARED, this->fd, (off_t)start);
+	this->view = view != MAP_FAILED ? (const char*)view : nullptr;
+#endif
+	if (!this->view) {
+		return nullptr;
+	}
+	this->viewOffset = start;
+	this->viewSize = viewSize;
+	return this->view + (offset - start);
+}
+
+const char *MappedFile::record(uint64_t offset, size_t& size)
+{
+	if (offset >= this->fileSize) {
+		return nullptr;
+	}
+	uint64_t remaining = this->fileSize - offset;
+	// Most records are short. The longer ones (the dumps of the big tables) are mapped again.
+	size_t want = 4096;
+	for (;;) {
+		if (want > remaining) {
+			want = (size_t)remaining;
+		}
+		const char *p = this->map(offset, want);
+		if (!p) {
+			return nullptr;
+		}
+		const char *eol = (const char*)memchr(p, '\n', want);
+		if (eol || want == remaining) {
+			size = eol ? eol - p : want;
+			if (size > 0 && p[size - 1] == '\r') {
+				size--;
+			}
+			if (size > 0 && p[size - 1] == ',') {
+				size--;
+			}
+			return p;
+		}
+		want *= 2;
+	}
+}
+
+// Returns the position after prefix if the text at p starts with it, nullptr otherwise.
+static const char *skip_prefix(const char *p, const char *end, const char *prefix)
+{
+	size_t size = strlen(prefix);
+	return p && (size_t)(end - p) >= size && memcmp(p, prefix, size) == 0 ? p + size : nullptr;
+}
+
+static const char *parse_number(const char *p, const char *end, int base, uint64_t& value)
+{
+	if (!p) {
+		return nullptr;
+	}
+	const char *start = p;
+	value = 0;
+	for (; p < end; p++) {
+		int digit;
+		if (*p >= '0' && *p <= '9') {
+			digit = *p - '0';
+		}
+		else if (base == 16 && *p >= 'A' && *p <= 'F') {
+			digit = *p - 'A' + 10;
+		}
+		else if (base == 16 && *p >= 'a' && *p <= 'f') {
+			digit = *p - 'a' + 10;
+		}
+		else {
+			break;
+		}
+		value = value * base + digit;
+	}
+	return p > start ? p : nullptr;
+}
+
+// Content of an object or delta record.
+static bool record_content(const char *record, size_t size, std::string& content)
+{
+	static const char key[] = "\"content\":";
+	const char *end = record + size;
+	const char *p = std::search(record, end, key, key + sizeof(key) - 1);
+	if (p == end || end[-1] != '}') {
+		return false;
+	}
+	p += sizeof(key) - 1;
+	content.assign(p, end - 1);
+	return true;
+}
+
+/**
+  * Builds the index of a trace, one line at a time. The instruction offsets and the checkpoints
+  * are written as they are found, the other sections when the whole trace has been read.
+  */
+class TraceIndexer
+{
+private:
+	FILE *out;
+	FILE *checkpoints;
+	TraceIndexHeader header;
+	std::vector<uint64_t> instructionOffsets; // Not written yet
+	std::vector<uint64_t> nameOffsets;
+	std::vector<std::vector<uint64_t>> filePostings; // By name ID
+	std::vector<std::pair<std::string, std::vector<uint64_t>>> opPostings;
+	std::string op;
+	std::vector<uint64_t> stringOffsets;
+	std::unordered_map<uint32_t, std::vector<TraceIndexVersion>> versions;
+	// Content of the objects, and number of deltas since their last object record or checkpoint
+	ObjectStates states;
+	std::unordered_map<uint32_t, uint32_t> deltaRuns;
+	std::string content;
+
+	void flushInstructions()
+	{
+		if (!this->instructionOffsets.empty()) {
+			fwrite(this->instructionOffsets.data(), sizeof(uint64_t), this->instructionOffsets.size(), this->out);
+			this->instructionOffsets.clear();
+		}
+	}
+
+	std::vector<uint64_t>& opList(const char *name, size_t size)
+	{
+		// There are a few dozen opcodes, and the same ones come again and again.
+		this->op.assign(name, size);
+		for (auto& it : this->opPostings) {
+			if (it.first == this->op) {
+				return it.second;
+			}
+		}
+		this->opPostings.push_back(std::make_pair(this->op, std::vector<uint64_t>()));
+		return this->opPostings.back().second;
+	}
+
+	template<typename T> void write(const std::vector<T>& v)
+	{
+		if (!v.empty()) {
+			fwrite(v.data(), sizeof(T), v.size(), this->out);
+		}
+	}
+
+public:
+	uint64_t invalid; // Records that couldn't be parsed
+
+	TraceIndexer(FILE *out, FILE *checkpoints, uint32_t checkpointInterval)
+		: out(out), checkpoints(checkpoints), invalid(0)
+	{
+		memset(&this->header, 0, sizeof(this->header));
+		this->header.checkpointInterval = checkpointInterval;
+		// Written with a valid magic when the index is complete.
+		fwrite(&this->header, sizeof(this->header), 1, this->out);
+		this->instructionOffsets.reserve(65536);
+	}
+
+	void line(uint64_t offset, const char *p, const char *end)
+	{
+		const char *q;
+		uint64_t n;
+
+		if ((q = skip_prefix(p, end, "{\"type\":\"instruction\",\"fn\":")) != nullptr) {
+			q = skip_prefix(parse_number(q, end, 10, n), end, ",\"op\":\"");
+			const char *opEnd = q ? (const char*)memchr(q, '"', end - q) : nullptr;
+			if (!opEnd || n > 0xFFFFFFFF) {
+				this->invalid++;
+				return;
+			}
+			uint64_t instruction = this->header.instructions++;
+			this->instructionOffsets.push_back(offset);
+			if (this->instructionOffsets.size() == this->instructionOffsets.capacity()) {
+				this->flushInstructions();
+			}
+			if (n >= this->filePostings.size()) {
+				this->filePostings.resize((size_t)n + 1);
+			}
+			this->filePostings[(size_t)n].push_back(instruction);
+			this->opList(q, opEnd - q).push_back(instruction);
+			return;
+		}
+
+		static const struct { const char *prefix; uint8_t type; } versionRecords[] = {
+			{ "{\"type\":\"object\",\"address\":\"POINTER:", VERSION_OBJECT },
+			{ "{\"type\":\"delta\",\"address\":\"POINTER:", VERSION_DELTA },
+			{ "{\"type\":\"freed\",\"address\":\"POINTER:", VERSION_FREED },
+		};
+		for (const auto& record : versionRecords) {
+			if ((q = skip_prefix(p, end, record.prefix)) != nullptr) {
+				if (!parse_number(q, end, 16, n)) {
+					this->invalid++;
+					return;
+				}
+				TraceIndexVersion version;
+				version.instruction = this->header.instructions;
+				version.offset = offset;
+				version.type = record.type;
+				std::vector<TraceIndexVersion>& versions = this->versions[(uint32_t)n];
+				versions.push_back(version);
+				if (this->header.checkpointInterval) {
+					this->track((uint32_t)n, record.type, p, end, versions);
+				}
+				return;
+			}
+		}
+
+		std::vector<uint64_t> *offsets = nullptr;
+		if ((q = skip_prefix(p, end, "{\"type\":\"name\",\"id\":")) != nullptr) {
+			offsets = &this->nameOffsets;
+		}
+		else if ((q = skip_prefix(p, end, "{\"type\":\"string\",\"id\":")) != nullptr) {
+			offsets = &this->stringOffsets;
+		}
+		if (offsets) {
+			if (!parse_number(q, end, 10, n) || n > 0xFFFFFFFF) {
+				this->invalid++;
+				return;
+			}
+			if (n >= offsets->size()) {
+				offsets->resize((size_t)n + 1, 0);
+			}
+			(*offsets)[(size_t)n] = offset;
+		}
+		// The frame events and the end record aren't indexed.
+	}
+
+	// Follows the content of an object, and writes a checkpoint after checkpointInterval deltas.
+	void track(uint32_t address, uint8_t type, const char *p, const char *end, std::vector<TraceIndexVersion>& versions)
+	{
+		if (type == VERSION_FREED) {
+			this->states.freed(address);
+			this->deltaRuns.erase(address);
+			return;
+		}
+		size_t size = end - p;
+		if (size > 0 && p[size - 1] == '\r') {
+			size--;
+		}
+		if (size > 0 && p[size - 1] == ',') {
+			size--;
+		}
+		if (!record_content(p, size, this->content)) {
+			this->invalid++;
+			return;
+		}
+		uint32_t& deltas = this->deltaRuns[address];
+		if (type == VERSION_OBJECT) {
+			this->states.object(address, this->content);
+			deltas = 0;
+			return;
+		}
+		if (!this->states.delta(address, this->content) || ++deltas < this->header.checkpointInterval) {
+			return;
+		}
+		deltas = 0;
+		this->states.get(address, this->content);
+		TraceIndexVersion checkpoint;
+		checkpoint.instruction = versions.back().instruction;
+		checkpoint.offset = this->header.checkpointsSize;
+		checkpoint.type = VERSION_CHECKPOINT;
+		versions.push_back(checkpoint);
+		this->content += '\n';
+		fwrite(this->content.data(), this->content.size(), 1, this->checkpoints);
+		this->header.checkpointsSize += this->content.size();
+	}
+
+	bool finish(uint64_t traceSize)
+	{
+		this->flushInstructions();
+		TraceIndexHeader& header = this->header;
+		uint64_t postings = 0;
+
+		// A name can be used before its record in a trace that was cut, and the other way around.
+		if (this->nameOffsets.size() < this->filePostings.size()) {
+			this->nameOffsets.resize(this->filePostings.size(), 0);
+		}
+		this->filePostings.resize(this->nameOffsets.size());
+		std::vector<TraceIndexName> names(this->nameOffsets.size());
+		for (size_t i = 0; i < names.size(); i++) {
+			names[i].offset = this->nameOffsets[i];
+			names[i].instructions.first = postings;
+			names[i].instructions.count = this->filePostings[i].size();
+			postings += names[i].instructions.count;
+		}
+		std::vector<TraceIndexOp> ops(this->opPostings.size());
+		for (size_t i = 0; i < ops.size(); i++) {
+			memset(ops[i].name, 0, sizeof(ops[i].name));
+			strncpy(ops[i].name, this->opPostings[i].first.c_str(), sizeof(ops[i].name) - 1);
+			ops[i].instructions.first = postings;
+			ops[i].instructions.count = this->opPostings[i].second.size();
+			postings += ops[i].instructions.count;
+		}
+
+		std::vector<uint32_t> addresses;
+		addresses.reserve(this->versions.size());
+		for (const auto& it : this->versions) {
+			addresses.push_back(it.first);
+		}
+		std::sort(addresses.begin(), addresses.end());
+		std::vector<TraceIndexObject> objects(addresses.size());
+		uint64_t versionCount = 0;
+		for (size_t i = 0; i < objects.size(); i++) {
+			objects[i].address = addresses[i];
+			objects[i].first = versionCount;
+			objects[i].count = (uint32_t)this->versions[addresses[i]].size();
+			versionCount += objects[i].count;
+		}
+
+		this->write(names);
+		this->write(ops);
+		this->write(objects);
+		this->write(this->stringOffsets);
+		for (const auto& list : this->filePostings) {
+			this->write(list);
+		}
+		for (const auto& it : this->opPostings) {
+			this->write(it.second);
+		}
+		for (uint32_t address : addresses) {
+			this->write(this->versions[address]);
+		}
+
+		memcpy(header.magic, TRACE_INDEX_MAGIC, sizeof(TRACE_INDEX_MAGIC));
+		header.version = TRACE_INDEX_VERSION;
+		header.traceSize = traceSize;
+		header.names = (uint32_t)names.size();
+		header.ops = (uint32_t)ops.size();
+		header.objects = (uint32_t)objects.size();
+		header.strings = (uint32_t)this->stringOffsets.size();
+		header.postings = postings;
+		header.versions = versionCount;
+		fseek(this->out, 0, SEEK_SET);
+		fwrite(&header, sizeof(header), 1, this->out);
+		return !ferror(this->out) && !ferror(this->checkpoints);
+	}
+};
+
+bool TraceIndex::build(const char *traceFn, uint32_t checkpointInterval)
+{
+	FILE *file = fopen(traceFn, "rb");
+	if (!file) {
+		fprintf(stderr, "%s: cannot open file\n", traceFn);
+		return false;
+	}
+	char magic[8] = { 0 };
+	size_t magicSize = fread(magic, 1, sizeof(magic), file);
+	if (magicSize == sizeof(magic) && memcmp(magic, BINARY_TRACE_MAGIC, sizeof(BINARY_TRACE_MAGIC)) == 0) {
+		fprintf(stderr, "%s: binary trace. Convert it to JSON with sqtrace convert first.\n", traceFn);
+		fclose(file);
+		return false;
+	}
+	if (magicSize >= 4 && magic[0] == 0x04 && magic[1] == 0x22 && magic[2] == 0x4D && magic[3] == 0x18) {
+		fprintf(stderr, "%s: compressed trace. Decompress it with sqtrace decompress first.\n", traceFn);
+		fclose(file);
+		return false;
+	}
+	rewind(file);
+
+	std::string indexFn = indexFile(traceFn);
+	std::string checkpointFn = checkpointFile(traceFn);
+	FILE *out = fopen(indexFn.c_str(), "wb");
+	FILE *checkpoints = fopen(checkpointFn.c_str(), "wb");
+	if (!out || !checkpoints) {
+		fprintf(stderr, "%s: cannot open file\n", !out ? indexFn.c_str() : checkpointFn.c_str());
+		if (out) {
+			fclose(out);
+		}
+		if (checkpoints) {
+			fclose(checkpoints);
+		}
+		fclose(file);
+		return false;
+	}
+
+	// The records are lines. A line that doesn't fit in the buffer makes it grow.
+	TraceIndexer indexer(out, checkpoints, checkpointInterval);
+	std::vector<char> buffer(4 * 1024 * 1024);
+	size_t filled = 0;
+	uint64_t bufferOffset = 0;
+	for (;;) {
+		size_t read = fread(buffer.data() + filled, 1, buffer.size() - filled, file);
+		filled += read;
+		const char *begin = buffer.data();
+		const char *p = begin;
+		const char *end = begin + filled;
+		const char *eol;
+		while ((eol = (const char*)memchr(p, '\n', end - p)) != nullptr) {
+			indexer.line(bufferOffset + (p - begin), p, eol);
+			p = eol + 1;
+		}
+		if (read == 0) {
+			// Last line of a trace that was cut
+			if (p < end) {
+				indexer.line(bufferOffset + (p - begin), p, end);
+			}
+			bufferOffset += filled;
+			break;
+		}
+		size_t consumed = p - begin;
+		memmove(buffer.data(), p, filled - consumed);
+		filled -= consumed;
+		bufferOffset += consumed;
+		if (filled == buffer.size()) {
+			buffer.resize(buffer.size() * 2);
+		}
+	}
+
+	bool ok = !ferror(file) && indexer.finish(bufferOffset);
+	fclose(file);
+	ok = fclose(checkpoints) == 0 && ok;
+	ok = fclose(out) == 0 && ok;
+	if (!ok) {
+		fprintf(stderr, "%s: cannot write the index\n", indexFn.c_str());
+		remove(indexFn.c_str());
+		remove(checkpointFn.c_str());
+		return false;
+	}
+	if (indexer.invalid) {
+		fprintf(stderr, "%s: %llu invalid records skipped\n", traceFn, (unsigned long long)indexer.invalid);
+	}
+	return true;
+}
+
+template<typename T> static bool read_section(MappedFile& file, uint64_t& offset, uint64_t count, std::vector<T>& out)
+{
+	out.clear();
+	if (count > 0) {
+		const T *p = (const T*)file.map(offset, (size_t)(count * sizeof(T)));
+		if (!p) {
+			return false;
+		}
+		out.assign(p, p + count);
+	}
+	offset += count * sizeof(T);
+	return true;
+}
+
+bool TraceIndex::open(const char *traceFn)
+{
+	std::string indexFn = indexFile(traceFn);
+	if (!this->trace.open(traceFn)) {
+		fprintf(stderr, "%s: cannot open file\n", traceFn);
+		return false;
+	}
+	if (!this->index.open(indexFn.c_str())) {
+		return false;
+	}
+
+	const TraceIndexHeader *header = (const TraceIndexHeader*)this->index.map(0, sizeof(TraceIndexHeader));
+	if (!header || memcmp(header->magic, TRACE_INDEX_MAGIC, sizeof(TRACE_INDEX_MAGIC)) != 0
+		|| header->version != TRACE_INDEX_VERSION) {
+		fprintf(stderr, "%s: not a trace index\n", indexFn.c_str());
+		return false;
+	}
+	this->header = *header;
+	if (this->header.traceSize != this->trace.size()) {
+		fprintf(stderr, "%s: the trace changed since it was indexed\n", indexFn.c_str());
+		return false;
+	}
+	std::string checkpointFn = checkpointFile(traceFn);
+	if (!this->checkpoints.open(checkpointFn.c_str()) || this->checkpoints.size() != this->header.checkpointsSize) {
+		fprintf(stderr, "%s: missing or truncated checkpoints\n", checkpointFn.c_str());
+		return false;
+	}
+
+	uint64_t offset = sizeof(TraceIndexHeader);
+	this->instructionsOffset = offset;
+	offset += this->header.instructions * sizeof(uint64_t);
+	if (!read_section(this->index, offset, this->header.names, this->names)
+		|| !read_section(this->index, offset, this->header.ops, this->ops)
+		|| !read_section(this->index, offset, this->header.objects, this->objects)
+		|| !read_section(this->index, offset, this->header.strings, this->strings)) {
+		fprintf(stderr, "%s: truncated index\n", indexFn.c_str());
+		return false;
+	}
+	this->postingsOffset = offset;
+	this->versionsOffset = offset + this->header.postings * sizeof(uint64_t);
+	if (this->versionsOffset + this->header.versions * sizeof(TraceIndexVersion) != this->index.size()) {
+		fprintf(stderr, "%s: truncated index\n", indexFn.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool TraceIndex::name(uint32_t id, std::string& name)
+{
+	size_t size;
+	const char *record = id < this->names.size() && this->names[id].offset ? this->trace.record(this->names[id].offset, size) : nullptr;
+	if (!record) {
+		return false;
+	}
+	static const char key[] = "\"name\":";
+	const char *end = record + size;
+	const char *p = std::search(record, end, key, key + sizeof(key) - 1);
+	if (p == end || end[-1] != '}') {
+		return false;
+	}
+	name.assign(p + sizeof(key) - 1, end - 1);
+	return true;
+}
+
+const TraceIndexList *TraceIndex::fileList(const std::string& file)
+{
+	// The names are compared as they are written in the trace.
+	JsonStream json;
+	json.string(file.c_str(), file.size());
+	std::string expected(json.data(), json.size());
+	std::string name;
+	for (uint32_t id = 0; id < this->names.size(); id++) {
+		if (this->name(id, name) && name == expected) {
+			return &this->names[id].instructions;
+		}
+	}
+	return nullptr;
+}
+
+const TraceIndexList *TraceIndex::opList(const std::string& op) const
+{
+	for (const TraceIndexOp& it : this->ops) {
+		if (op == it.name) {
+			return &it.instructions;
+		}
+	}
+	return nullptr;
+}
+
+const char *TraceIndex::instruction(uint64_t n, size_t& size)
+{
+	if (n >= this->header.instructions) {
+		return nullptr;
+	}
+	const uint64_t *offset = this->section<uint64_t>(this->instructionsOffset, n, 1);
+	return offset ? this->trace.record(*offset, size) : nullptr;
+}
+
+const char *TraceIndex::string(uint32_t id, size_t& size)
+{
+	if (id >= this->strings.size() || this->strings[id] == 0) {
+		return nullptr;
+	}
+	return this->trace.record(this->strings[id], size);
+}
+
+const TraceIndexObject *TraceIndex::object(uint32_t address) const
+{
+	auto it = std::lower_bound(this->objects.begin(), this->objects.end(), address,
+		[](const TraceIndexObject& object, uint32_t address) { return object.address < address; });
+	return it != this->objects.end() && it->address == address ? &*it : nullptr;
+}
+
+bool TraceIndex::object(uint32_t address, uint64_t instruction, std::string& content)
+{
+	const TraceIndexObject *object = this->object(address);
+	const TraceIndexVersion *versions = object ? this->section<TraceIndexVersion>(this->versionsOffset, object->first, object->count) : nullptr;
+	if (!versions) {
+		return false;
+	}
+	// Last version at or before the instruction
+	const TraceIndexVersion *last = std::upper_bound(versions, versions + object->count, instruction,
+		[](uint64_t instruction, const TraceIndexVersion& version) { return instruction < version.instruction; });
+	if (last == versions || last[-1].type == VERSION_FREED) {
+		return false;
+	}
+	// The deltas are applied over the last full dump or checkpoint.
+	const TraceIndexVersion *first = last - 1;
+	while (first > versions && first->type == VERSION_DELTA) {
+		first--;
+	}
+	if (first->type != VERSION_OBJECT && first->type != VERSION_CHECKPOINT) {
+		return false;
+	}
+	std::vector<TraceIndexVersion> chain(first, last);
+
+	ObjectStates states;
+	std::string recordContent;
+	for (const TraceIndexVersion& version : chain) {
+		size_t size;
+		if (version.type == VERSION_CHECKPOINT) {
+			const char *checkpoint = this->checkpoints.record(version.offset, size);
+			if (!checkpoint) {
+				return false;
+			}
+			states.object(address, std::string(checkpoint, size));
+			continue;
+		}
+		const char *record = this->trace.record(version.offset, size);
+		if (!record || !record_content(record, size, recordContent)) {
+			return false;
+		}
+		if (version.type == VERSION_OBJECT) {
+			states.object(address, recordContent);
+		}
+		else if (!states.delta(address, recordContent)) {
+			return false;
+		}
+	}
+	return states.get(address, content);
+}
+
+bool TraceIndex::stringValue(uint32_t id, std::string& value)
+{
+	size_t size;
+	const char *record = this->string(id, size);
+	if (!record) {
+		return false;
+	}
+	static const char key[] = "\"value\":";
+	const char *end = record + size;
+	const char *p = std::search(record, end, key, key + sizeof(key) - 1);
+	if (p == end || end[-1] != '}') {
+		return false;
+	}
+	value.assign(p + sizeof(key) - 1, end - 1);
+	return true;
+}
+
+// Copies content to out, with the "POINTER:" and "STRING:" values replaced.
+void TraceIndex::resolveValues(const std::string& content, uint64_t instruction, unsigned int depth,
+	std::unordered_set<uint32_t>& expanded, std::string& out)
+{
+	const char *p = content.data();
+	const char *end = p + content.size();
+	std::string value;
+	while (p < end) {
+		const char *begin = (const char*)memchr(p, '"', end - p);
+		if (!begin) {
+			out.append(p, end);
+			break;
+		}
+		out.append(p, begin);
+		const char *stringEnd = begin + 1;
+		while (stringEnd < end && *stringEnd != '"') {
+			stringEnd += *stringEnd == '\\' ? 2 : 1;
+		}
+		if (stringEnd >= end) {
+			out.append(begin, end);
+			break;
+		}
+		p = stringEnd + 1;
+
+		uint64_t n;
+		const char *q = skip_prefix(begin + 1, stringEnd, "POINTER:");
+		if (depth > 0 && parse_number(q, stringEnd, 16, n) == stringEnd && expanded.insert((uint32_t)n).second
+			&& this->object((uint32_t)n, instruction, value)) {
+			out += "{\"address\":";
+			out.append(begin, p);
+			out += ",\"content\":";
+			std::string nested;
+			nested.swap(value);
+			this->resolveValues(nested, instruction, depth - 1, expanded, out);
+			out += '}';
+			continue;
+		}
+		q = skip_prefix(begin + 1, stringEnd, "STRING:");
+		if (parse_number(q, stringEnd, 10, n) == stringEnd && n <= 0xFFFFFFFF && this->stringValue((uint32_t)n, value)) {
+			out += value;
+			continue;
+		}
+		out.append(begin, p);
+	}
+}
+
+bool TraceIndex::resolve(uint32_t address, uint64_t instruction, unsigned int depth, std::string& content)
+{
+	std::string value;
+	if (!this->object(address, instruction, value)) {
+		return false;
+	}
+	std::unordered_set<uint32_t> expanded;
+	expanded.insert(address);
+	content.clear();
+	this->resolveValues(value, instruction, depth, expanded, content);
+	return true;
+}
@@ -0,0 +1,255 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Squirrel trace tools
+  *
+  * ----
+  *
+  * Persistent index of a JSON trace, and random access to its records.
+  */
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_set>
+
+/**
+  * Read-only view of a file. Only a window of the file is mapped at a time, so the traces
+  * larger than the address space of the 32-bit tools can be read too.
+  */
+class MappedFile
+{
+private:
+	enum
+	{
+		GRANULARITY = 64 * 1024,        // Allocation granularity of MapViewOfFile, and a multiple of the page sizes
+		WINDOW_SIZE = 16 * 1024 * 1024,
+	};
+
+	// HANDLEs on Windows, to keep windows.h out of this header.
+	void *file;
+	void *mapping;
+	int fd;
+	uint64_t fileSize;
+	const char *view;
+	uint64_t viewOffset;
+	size_t viewSize;
+
+	void unmap();
+
+public:
+	MappedFile();
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool open(const char *fn);
+	void close();
+	uint64_t size() const { return this->fileSize; }
+	// Returns a pointer to size bytes at offset, valid until the next call, or nullptr if they are past the end.
+	const char *map(uint64_t offset, size_t size);
+	// Returns the record starting at offset, without its ",\n", and sets size to its size.
+	const char *record(uint64_t offset, size_t& size);
+};
+
+/**
+  * Index of a JSON trace, written next to it as "<trace>.sqidx". It is built by one streaming pass
+  * over the trace (TraceIndex::build), and read with the trace mapped (TraceIndex::open).
+  *
+  * The instructions are numbered from 0 in trace order. An object version (an object, delta
+  * or freed record) is numbered with the instruction after it: the objects dumped for an
+  * instruction are written before it, so the version of an object at instruction N is its last
+  * version numbered N or less.
+  *
+  * The tables and arrays sent as deltas are rebuilt from their last full dump. Every
+  * checkpointInterval deltas in a row, the indexer also writes the full content of the object
+  * to "<trace>.sqckpt", one line per checkpoint, and adds a VERSION_CHECKPOINT right after
+  * the delta. A lookup starts from the last object record or checkpoint, so it never applies
+  * more than checkpointInterval - 1 deltas, whatever the keyframe interval of the tracer.
+  *
+  * Layout: a TraceIndexHeader, then the sections in this order:
+  * - uint64_t offset of every instruction;
+  * - TraceIndexName for every name ID, with the instructions of that file ("fn" in the records);
+  * - TraceIndexOp for every opcode;
+  * - TraceIndexObject for every object address, sorted by address;
+  * - uint64_t offset of every pooled string record, by string ID (0 if there is none);
+  * - uint64_t instruction numbers of the posting lists of the names and the opcodes;
+  * - TraceIndexVersion for the versions of every object, grouped by address, in trace order.
+  */
+
+#define TRACE_INDEX_MAGIC "SQTRIDX"
+#define TRACE_INDEX_VERSION 2
+#define TRACE_INDEX_CHECKPOINT_INTERVAL 16
+
+#pragma pack(push, 1)
+struct TraceIndexHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint64_t traceSize; // Size of the indexed trace: the index is stale if it changed
+	uint64_t instructions;
+	uint32_t names;
+	uint32_t ops;
+	uint32_t objects;
+	uint32_t strings;
+	uint64_t postings;
+	uint64_t versions;
+	uint64_t checkpointsSize; // Size of the checkpoint file
+	uint32_t checkpointInterval;
+};
+
+// Posting list: range of the postings section.
+struct TraceIndexList
+{
+	uint64_t first;
+	uint64_t count;
+};
+
+struct TraceIndexName
+{
+	uint64_t offset; // Offset of the name record, 0 if there is none
+	TraceIndexList instructions;
+};
+
+struct TraceIndexOp
+{
+	char name[32];
+	TraceIndexList instructions;
+};
+
+struct TraceIndexObject
+{
+	uint32_t address;
+	uint64_t first; // Range of the versions section
+	uint32_t count;
+};
+
+enum TraceIndexVersionType
+{
+	VERSION_OBJECT,
+	VERSION_DELTA,
+	VERSION_FREED,
+	VERSION_CHECKPOINT, // Offset in the checkpoint file
+};
+
+struct TraceIndexVersion
+{
+	uint64_t instruction;
+	uint64_t offset;
+	uint8_t type; // TraceIndexVersionType
+};
+#pragma pack(pop)
+
+class TraceIndex
+{
+private:
+	MappedFile trace;
+	MappedFile index;
+	MappedFile checkpoints;
+	TraceIndexHeader header;
+	std::vector<TraceIndexName> names;
+	std::vector<TraceIndexOp> ops;
+	std::vector<TraceIndexObject> objects;
+	std::vector<uint64_t> strings;
+	// Offsets of the sections mapped from the index file
+	uint64_t instructionsOffset;
+	uint64_t postingsOffset;
+	uint64_t versionsOffset;
+
+	template<typename T> const T *section(uint64_t offset, uint64_t first, uint64_t count)
+	{
+		return (const T*)this->index.map(offset + first * sizeof(T), (size_t)(count * sizeof(T)));
+	}
+
+	// Calls f(n) for every instruction number of a posting list, until f returns false.
+	template<typename F> bool for_each_posting(const TraceIndexList& list, F f)
+	{
+		static const uint64_t CHUNK = 65536;
+		std::vector<uint64_t> chunk;
+		for (uint64_t i = 0; i < list.count; i += CHUNK) {
+			uint64_t count = list.count - i < CHUNK ? list.count - i : CHUNK;
+			// Copied: f may map another part of the index.
+			const uint64_t *postings = this->section<uint64_t>(this->postingsOffset, list.first + i, count);
+			if (!postings) {
+				return false;
+			}
+			chunk.assign(postings, postings + count);
+			for (uint64_t n : chunk) {
+				if (!f(n)) {
+					return true;
+				}
+			}
+		}
+		return true;
+	}
+
+	const TraceIndexList *fileList(const std::string& file);
+	const TraceIndexList *opList(const std::string& op) const;
+	const TraceIndexObject *object(uint32_t address) const;
+	bool stringValue(uint32_t id, std::string& value);
+	void resolveValues(const std::string& content, uint64_t instruction, unsigned int depth,
+		std::unordered_set<uint32_t>& expanded, std::string& out);
+
+public:
+	static std::string indexFile(const char *traceFn) { return std::string(traceFn) + ".sqidx"; }
+	static std::string checkpointFile(const char *traceFn) { return std::string(traceFn) + ".sqckpt"; }
+	// Indexes a JSON trace. Returns false if it can't be read, or if the index can't be written.
+	// checkpointInterval is the number of deltas between the checkpoints, 0 for none.
+	static bool build(const char *traceFn, uint32_t checkpointInterval);
+
+	// Opens a trace and its index. Returns false if the index is missing or stale.
+	bool open(const char *traceFn);
+
+	uint64_t instructions() const { return this->header.instructions; }
+	const std::vector<TraceIndexOp>& opcodes() const { return this->ops; }
+	// Name of a file, as a JSON string. Returns false if there is no name with this ID.
+	bool name(uint32_t id, std::string& name);
+	uint32_t nameCount() const { return (uint32_t)this->names.size(); }
+	uint64_t fileInstructions(uint32_t id) const { return id < this->names.size() ? this->names[id].instructions.count : 0; }
+
+	// Instruction record N. The pointer is valid until the next call.
+	const char *instruction(uint64_t n, size_t& size);
+	// Pooled string record. The pointer is valid until the next call.
+	const char *string(uint32_t id, size_t& size);
+
+	// Calls f(n) for every instruction in a file, or with an opcode, in order, until f returns false.
+	// Returns false if there is no such file or opcode.
+	template<typename F> bool for_each_in_file(const std::string& file, F f)
+	{
+		const TraceIndexList *list = this->fileList(file);
+		return list && this->for_each_posting(*list, f);
+	}
+	template<typename F> bool for_each_with_op(const std::string& op, F f)
+	{
+		const TraceIndexList *list = this->opList(op);
+		return list && this->for_each_posting(*list, f);
+	}
+
+	/**
+	  * Content of an object as it was when instruction N ran, with the deltas applied.
+	  * Returns false if the object wasn't dumped yet, or was freed, at that instruction.
+	  */
+	bool object(uint32_t address, uint64_t instruction, std::string& content);
+	/**
+	  * Same as object, with the pooled strings replaced by their value, and the objects it points to
+	  * replaced by {"address":..., "content":...} with their content at that instruction, down to
+	  * depth levels. Every object is only expanded once, so the cycles end.
+	  */
+	bool resolve(uint32_t address, uint64_t instruction, unsigned int depth, std::string& content);
+
+	// Calls f(version) for every version of an object, checkpoints included, in order.
+	template<typename F> bool for_each_version(uint32_t address, F f)
+	{
+		const TraceIndexObject *object = this->object(address);
+		const TraceIndexVersion *versions = object ? this->section<TraceIndexVersion>(this->versionsOffset, object->first, object->count) : nullptr;
+		if (!versions) {
+			return false;
+		}
+		std::vector<TraceIndexVersion> copy(versions, versions + object->count);
+		for (const TraceIndexVersion& version : copy) {
+			f(version);
+		}
+		return true;
+	}
+};
@@ -0,0 +1,396 @@
+#include "trace_tools.h"
+#include "FlatPtrMap.h"
+#include "JsonStream.h"
+#include "TraceCompression.h"
+#include <string.h>
+#include <map>
+#include <atomic>
+#include <algorithm>
+
+// Same layout as the thcrap x86_reg_t: the registers saved by pushfd and pushad.
+struct x86_reg_t
+{
+	size_t flags;
+	size_t edi, esi, ebp, esp, ebx, edx, ecx, eax;
+};
+#include "BpExpression.h"
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <chrono>
+#endif
+
+// VS2013's std::chrono clocks only have a millisecond resolution.
+static double now_ns()
+{
+#ifdef _WIN32
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (double)counter.QuadPart * 1e9 / (double)frequency.QuadPart;
+#else
+	return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+static uint32_t xorshift(uint32_t& state)
+{
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+// Same size as an ObjectDump in the 32-bit plugin.
+struct DumpLike
+{
+	void *store;
+	const void *address;
+	uint64_t offset;
+	uint32_t size;
+	uint32_t json_dump_size;
+};
+
+static DumpLike make_value(void *key, DumpLike*) { DumpLike v = { nullptr, key, 0, 0, 0 }; return v; }
+static std::string make_value(void*, std::string*) { return "data/script/th155/stage1.nut"; }
+
+static void print_result(const char *container, const char *operation, double start, size_t count)
+{
+	printf("  %-10s %-22s %8.1f ns/op\n", container, operation, (now_ns() - start) / (double)count);
+}
+
+// Shuffles keys with the permutation given by seed.
+static std::vector<void*> shuffled(const std::vector<void*>& keys, uint32_t seed)
+{
+	std::vector<void*> order(keys);
+	for (size_t i = order.size() - 1; i > 0; i--) {
+		std::swap(order[i], order[xorshift(seed) % (i + 1)]);
+	}
+	return order;
+}
+
+/**
+  * Same operations as the tracer does on its maps: insertions, lookups of known objects,
+  * lookups of new objects, and evictions.
+  * The keys look like heap addresses: 8-aligned, with irregular gaps. The tracer finds the objects
+  * in the order the scripts use them, not by address, so every operation uses a random order.
+  * The hits and the misses use the same one, so that they only differ by the result.
+  */
+template<typename V>
+static void bench_maps_run(const std::vector<void*>& keys, const std::vector<void*>& missing)
+{
+	size_t n = keys.size();
+	std::vector<void*> insertOrder = shuffled(keys, 12345);
+	std::vector<void*> order = shuffled(keys, 54321);
+	std::vector<void*> missingOrder = shuffled(missing, 54321);
+	size_t found = 0;
+	double start;
+
+	{
+		std::map<void*, V> map;
+		start = now_ns();
+		for (void *key : insertOrder) {
+			map.insert(std::make_pair(key, make_value(key, (V*)nullptr)));
+		}
+		print_result("std::map", "insert", start, n);
+
+		start = now_ns();
+		for (void *key : order) {
+			found += map.find(key) != map.end();
+		}
+		print_result("std::map", "lookup (hit)", start, n);
+
+		start = now_ns();
+		for (void *key : missingOrder) {
+			found += map.find(key) != map.end();
+		}
+		print_result("std::map", "lookup (miss)", start, n);
+
+		start = now_ns();
+		for (size_t i = 0; i < n / 2; i++) {
+			map.erase(order[i]);
+		}
+		print_result("std::map", "erase", start, n / 2);
+
+		start = now_ns();
+		for (auto it = map.begin(); it != map.end();) {
+			if (((uintptr_t)it->first >> 3) & 1) {
+				it = map.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+		print_result("std::map", "bulk erase (per entry)", start, n / 2);
+	}
+
+	{
+		FlatPtrMap<void*, V> map;
+		start = now_ns();
+		for (void *key : insertOrder) {
+			map.insert(key, make_value(key, (V*)nullptr));
+		}
+		print_result("FlatPtrMap", "insert", start, n);
+
+		start = now_ns();
+		for (void *key : order) {
+			found += map.find(key) != nullptr;
+		}
+		print_result("FlatPtrMap", "lookup (hit)", start, n);
+
+		start = now_ns();
+		for (void *key : missingOrder) {
+			found += map.find(key) != nullptr;
+		}
+		print_result("FlatPtrMap", "lookup (miss)", start, n);
+
+		start = now_ns();
+		for (size_t i = 0; i < n / 2; i++) {
+			map.erase(order[i]);
+		}
+		print_result("FlatPtrMap", "erase", start, n / 2);
+
+		start = now_ns();
+		map.erase_if([](void *key, V&) { return (((uintptr_t)key >> 3) & 1) != 0; });
+		print_result("FlatPtrMap", "bulk erase (per entry)", start, n / 2);
+	}
+
+	// Keeps the lookups from being optimized out.
+	if (found == 0) {
+		printf("  (no key found)\n");
+	}
+}
+
+static void bench_maps()
+{
+	static const size_t sizes[] = { 10000, 100000, 1000000 };
+	for (size_t n : sizes) {
+		std::vector<void*> keys;
+		std::vector<void*> missing;
+		uint32_t seed = 2463534242u;
+		uintptr_t address = 0x02000000;
+		for (size_t i = 0; i < n; i++) {
+			keys.push_back((void*)address);
+			missing.push_back((void*)(address + 8));
+			address += 16 + (xorshift(seed) % 16) * 8;
+		}
+
+		printf("%u entries, ObjectDumpCollection-like values:\n", (unsigned int)n);
+		bench_maps_run<DumpLike>(keys, missing);
+		printf("%u entries, ClosureDB-like values:\n", (unsigned int)n);
+		bench_maps_run<std::string>(keys, missing);
+		printf("\n");
+	}
+}
+
+/**
+  * Cost of getting the parameters of BP_SQVM_execute_switch ("this": "ebx", "instruction": "esi")
+  * and BP_sq_vm_free ("p": "[esp+4]") on every hit.
+  * "lookup + parse" stands for json_object_get_immediate: a key lookup in bp_info, then the parsing
+  * of the expression. "compiled" is the BpParam fast path: a bp_info check, then BpExpression::eval.
+  */
+static void bench_dispatch()
+{
+	const size_t n = 10000000;
+	std::map<std::string, std::string> bp_info;
+	bp_info["this"] = "ebx";
+	bp_info["instruction"] = "esi";
+	bp_info["p"] = "[esp+4]";
+	bp_info["cavesize"] = "7";
+	const void *bpInfo = &bp_info;
+	std::atomic<const void*> compiledInfo(bpInfo);
+	std::atomic<uint32_t> state(0);
+
+	size_t stack[2] = { 0, 0x1234 };
+	x86_reg_t regs;
+	memset(&regs, 0, sizeof(regs));
+	regs.esp = (size_t)stack;
+	size_t sum = 0;
+	double start;
+
+	auto lookup = [&](const char *key) {
+		BpExpression expr;
+		expr.compile(bp_info.find(key)->second.c_str());
+		return expr.eval(&regs);
+	};
+	start = now_ns();
+	for (size_t i = 0; i < n; i++) {
+		regs.ebx = i;
+		regs.esi = i * 4;
+		sum += lookup("this") + lookup("instruction");
+	}
+	print_result("2 params", "lookup + parse", start, n);
+	start = now_ns();
+	for (size_t i = 0; i < n; i++) {
+		stack[1] = i;
+		sum += lookup("p");
+	}
+	print_result("[esp+4]", "lookup + parse", start, n);
+
+	BpExpression vm, instruction, p;
+	vm.compile("ebx");
+	instruction.compile("esi");
+	p.compile("[esp+4]");
+	start = now_ns();
+	for (size_t i = 0; i < n; i++) {
+		regs.ebx = i;
+		regs.esi = i * 4;
+		if (bpInfo == compiledInfo.load(std::memory_order_acquire)) {
+			sum += vm.eval(&regs) + instruction.eval(&regs);
+		}
+	}
+	print_result("2 params", "compiled", start, n);
+	start = now_ns();
+	for (size_t i = 0; i < n; i++) {
+		stack[1] = i;
+		if (bpInfo == compiledInfo.load(std::memory_order_acquire)) {
+			sum += p.eval(&regs);
+		}
+	}
+	print_result("[esp+4]", "compiled", start, n);
+
+	// What a hit costs while the tracer is disabled.
+	start = now_ns();
+	for (size_t i = 0; i < n; i++) {
+		if (state.load(std::memory_order_acquire) != 0) {
+			sum += vm.eval(&regs);
+		}
+	}
+	print_result("disabled", "state check", start, n);
+
+	if (sum == 0) {
+		printf("  (no value read)\n");
+	}
+	printf("\n");
+}
+
+/**
+  * LZ4 frames of the CompressedTraceOutput size, on records like the ones of a JSON trace.
+  * The compression runs on the output thread, so its speed is what the tracer can sustain.
+  */
+// JSON instruction records, like the ones of a real trace.
+static std::string make_trace(size_t size)
+{
+	static const char *ops[] = { "LINE", "LOAD", "GET", "SET", "CALL", "MOVE", "JMP", "EQ" };
+	uint32_t seed = 1;
+	JsonStream json;
+	std::string trace;
+	char pointer[32];
+	while (trace.size() < size) {
+		json.clear();
+		json.beginObject();
+		json.key("type");
+		json.string("instruction");
+		json.key("fn");
+		json.integer(xorshift(seed) % 16);
+		json.key("op");
+		json.string(ops[xorshift(seed) % 8]);
+		json.key("arg0");
+		json.integer(xorshift(seed) % 256);
+		json.key("arg1");
+		sprintf(pointer, "POINTER:%08X", 0x02000000 + (xorshift(seed) % 4096) * 16);
+		json.string(pointer);
+		json.key("arg2");
+		sprintf(pointer, "STRING:%u", xorshift(seed) % 2000);
+		json.string(pointer);
+		json.key("arg3");
+		json.real((xorshift(seed) % 10000) / 100.0);
+		json.endObject();
+		json.append(",\n", 2);
+		trace.append(json.data(), json.size());
+	}
+	return trace;
+}
+
+static void bench_compression()
+{
+	const size_t frameSize = 1024 * 1024;
+	const size_t frameCount = 64;
+	std::string trace = make_trace(frameSize * frameCount);
+
+	Lz4 lz4;
+	std::string compressed;
+	std::vector<size_t> frameEnds;
+	double start = now_ns();
+	for (size_t i = 0; i < frameCount; i++) {
+		lz4.compressFrame(trace.data() + i * frameSize, frameSize, compressed);
+		frameEnds.push_back(compressed.size());
+	}
+	double compressNs = now_ns() - start;
+
+	std::string decompressed;
+	start = now_ns();
+	size_t offset = 0;
+	for (size_t i = 0; i < frameCount; i++) {
+		offset += Lz4::decompressFrame(compressed.data() + offset, frameEnds[i] - offset, decompressed);
+	}
+	double decompressNs = now_ns() - start;
+
+	double mb = frameSize * frameCount / (1024.0 * 1024.0);
+	printf("  %u MB of JSON records in 1 MB frames: %.1f%% of the original size%s\n", (unsigned int)mb,
+		compressed.size() * 100.0 / (frameSize * frameCount),
+		decompressed == trace.substr(0, frameSize * frameCount) ? "" : " (ROUND TRIP FAILED)");
+	printf("  %-10s %-22s %8.1f MB/s\n", "lz4", "compress", mb / (compressNs / 1e9));
+	printf("  %-10s %-22s %8.1f MB/s\n\n", "lz4", "decompress", mb / (decompressNs / 1e9));
+}
+
+static void bench_grep()
+{
+	std::string trace = make_trace(64 * 1024 * 1024);
+	const char *end = trace.data() + trace.size();
+	// A rare string, and a frequent one.
+	static const char *needles[] = { "\"STRING:1999\"", "\"op\":\"CALL\"" };
+	double mb = trace.size() / (1024.0 * 1024.0);
+
+	for (const char *needle : needles) {
+		size_t size = strlen(needle);
+		size_t expected = 0;
+		double start = now_ns();
+		for (const char *p = trace.data(); (p = std::search(p, end, needle, needle + size)) != end; p++) {
+			expected++;
+		}
+		double searchNs = now_ns() - start;
+
+		size_t found = 0;
+		start = now_ns();
+		for (const char *p = trace.data(); (p = find_substring(p, end, needle, size)) != nullptr; p++) {
+			found++;
+		}
+		double findNs = now_ns() - start;
+
+		printf("  %s: %u matches%s\n", needle, (unsigned int)found, found == expected ? "" : " (DIFFERENT FROM std::search)");
+		printf("  %-16s %8.1f MB/s\n", "std::search", mb / (searchNs / 1e9));
+		printf("  %-16s %8.1f MB/s\n\n", "find_substring", mb / (findNs / 1e9));
+	}
+}
+
+struct Benchmark
+{
+	const char *name;
+	void (*run)();
+	const char *description;
+};
+
+static const Benchmark benchmarks[] = {
+	{ "maps", bench_maps, "std::map against FlatPtrMap, with the access patterns of ObjectDumpCollection and ClosureDB" },
+	{ "dispatch", bench_dispatch, "Breakpoint parameters looked up and parsed on every hit, against the compiled ones" },
+	{ "compression", bench_compression, "LZ4 compression of the trace output" },
+	{ "grep", bench_grep, "Substring search of sqtrace grep, against std::search" },
+};
+
+int bench_main(int argc, char **argv)
+{
+	bool ran = false;
+	for (const Benchmark& benchmark : benchmarks) {
+		if (argc < 2 || strcmp(argv[1], benchmark.name) == 0) {
+			printf("== %s: %s\n\n", benchmark.name, benchmark.description);
+			benchmark.run();
+			ran = true;
+		}
+	}
+	if (!ran) {
+		fprintf(stderr, "Unknown benchmark: %s\n", argv[1]);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,395 @@
+#include "trace_tools.h"
+#include <string.h>
+#include <stdlib.h>
+#include <map>
+#include <memory>
+#include <algorithm>
+
+/**
+  * Rebuilds the call tree from the frame events of a trace ("frames": true in the tracer config).
+  * Each VM (thread or generator) has its own call stack. The time a VM spends suspended
+  * is counted in the frames it has open.
+  */
+
+struct FrameEventData
+{
+	uint8_t event; // FrameEvent
+	uint32_t vm;
+	uint32_t closure;
+	std::string function;
+	uint64_t time;
+};
+
+// Function name in the reports: "name (file)". ';' separates the frames of a folded stack.
+static std::string function_name(const std::string& name, const std::string& fn)
+{
+	std::string out = name + " (" + fn + ")";
+	std::replace(out.begin(), out.end(), ';', ':');
+	return out;
+}
+
+// Reads a line of any length. Returns false at the end of the file.
+static bool read_line(FILE *file, std::string& line)
+{
+	char buffer[4096];
+	line.clear();
+	while (fgets(buffer, sizeof(buffer), file)) {
+		line += buffer;
+		if (!line.empty() && line.back() == '\n') {
+			return true;
+		}
+	}
+	return !line.empty();
+}
+
+// Finds "key": in a JSON record written by the tracer, starting at pos. Returns the position of the value.
+static const char *find_key(const char *pos, const char *key)
+{
+	std::string pattern = std::string("\"") + key + "\":";
+	const char *found = strstr(pos, pattern.c_str());
+	return found ? found + pattern.size() : nullptr;
+}
+
+static const char *read_json_string(const char *pos, std::string& out)
+{
+	out.clear();
+	if (!pos || *pos != '"') {
+		return nullptr;
+	}
+	for (pos++; *pos && *pos != '"'; pos++) {
+		if (*pos != '\\') {
+			out += *pos;
+			continue;
+		}
+		pos++;
+		switch (*pos) {
+		case 'b': out += '\b'; break;
+		case 'f': out += '\f'; break;
+		case 'n': out += '\n'; break;
+		case 'r': out += '\r'; break;
+		case 't': out += '\t'; break;
+		case 'u': {
+			// The tracer only writes \u for single bytes.
+			char hex[5] = { 0 };
+			strncpy(hex, pos + 1, 4);
+			out += (char)strtoul(hex, nullptr, 16);
+			pos += strlen(hex);
+			break;
+		}
+		case '\0': return nullptr;
+		default: out += *pos; break;
+		}
+	}
+	return *pos == '"' ? pos + 1 : nullptr;
+}
+
+static uint32_t parse_pointer(const std::string& str)
+{
+	const char *prefix = "POINTER:";
+	if (str.compare(0, strlen(prefix), prefix) != 0) {
+		return 0;
+	}
+	return strtoul(str.c_str() + strlen(prefix), nullptr, 16);
+}
+
+class FrameSource
+{
+private:
+	BinaryTraceReader reader;
+	FILE *json;
+	std::string line;
+	std::vector<std::string> names; // Name records of the JSON trace, by ID
+
+	const std::string& name(uint32_t id)
+	{
+		static const std::string unknown = "(unknown)";
+		return id < this->names.size() ? this->names[id] : unknown;
+	}
+
+public:
+	FrameSource() : json(nullptr) {}
+	~FrameSource()
+	{
+		if (this->json) {
+			fclose(this->json);
+		}
+	}
+
+	bool open(const char *fn)
+	{
+		FILE *file = fopen(fn, "rb");
+		if (!file) {
+			fprintf(stderr, "%s: cannot open file\n", fn);
+			return false;
+		}
+		char magic[sizeof(BINARY_TRACE_MAGIC)] = { 0 };
+		bool binary = fread(magic, sizeof(magic), 1, file) == 1 && memcmp(magic, BINARY_TRACE_MAGIC, sizeof(magic)) == 0;
+		if (binary) {
+			fclose(file);
+			return this->reader.open(fn);
+		}
+		rewind(file);
+		this->json = file;
+		return true;
+	}
+
+	bool next(FrameEventData& event)
+	{
+		if (!this->json) {
+			while (this->reader.next()) {
+				if (this->reader.record == REC_FRAME) {
+					const BinaryFrameRecord& frame = this->reader.frame;
+					event.event = frame.event;
+					event.vm = frame.vm;
+					event.closure = frame.closure;
+					event.function = function_name(this->reader.string(frame.name), this->reader.string(frame.fn));
+					event.time = frame.time;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		// JSON trace: one record per line, with the keys in the order JsonTraceWriter writes them.
+		std::string vm, closure, type, str;
+		while (read_line(this->json, this->line)) {
+			const char *pos = this->line.c_str();
+			if (strncmp(pos, "{\"type\":\"name\"", 14) == 0) {
+				pos = find_key(pos, "id");
+				uint32_t id = pos ? strtoul(pos, nullptr, 10) : 0;
+				if (pos && read_json_string(find_key(pos, "name"), str)) {
+					if (id >= this->names.size()) {
+						this->names.resize(id + 1);
+					}
+					this->names[id] = str;
+				}
+				continue;
+			}
+			if (strncmp(pos, "{\"type\":\"enter\"", 15) != 0 && strncmp(pos, "{\"type\":\"exit\"", 14) != 0) {
+				continue;
+			}
+			pos = read_json_string(find_key(pos, "type"), type);
+			pos = pos ? read_json_string(find_key(pos, "vm"), vm) : nullptr;
+			pos = pos ? read_json_string(find_key(pos, "closure"), closure) : nullptr;
+			const char *fn = pos ? find_key(pos, "fn") : nullptr;
+			const char *name = fn ? find_key(fn, "name") : nullptr;
+			pos = name ? find_key(name, "time") : nullptr;
+			if (!pos) {
+				fprintf(stderr, "Invalid frame record: %s", this->line.c_str());
+				continue;
+			}
+			event.event = type == "enter" ? FRAME_ENTER : FRAME_EXIT;
+			event.vm = parse_pointer(vm);
+			event.closure = parse_pointer(closure);
+			event.function = function_name(this->name(strtoul(name, nullptr, 10)), this->name(strtoul(fn, nullptr, 10)));
+			event.time = strtoull(pos, nullptr, 10);
+			return true;
+		}
+		return false;
+	}
+};
+
+struct CallNode
+{
+	std::string function;
+	std::map<std::string, std::unique_ptr<CallNode>> children;
+	uint64_t calls;
+	uint64_t inclusive;
+	uint64_t exclusive;
+
+	CallNode(const std::string& function) : function(function), calls(0), inclusive(0), exclusive(0) {}
+};
+
+struct FunctionStats
+{
+	uint64_t calls;
+	uint64_t inclusive; // Recursive calls are only counted once
+	uint64_t exclusive;
+	unsigned int active;
+
+	FunctionStats() : calls(0), inclusive(0), exclusive(0), active(0) {}
+};
+
+struct ActiveFrame
+{
+	CallNode *node;
+	uint32_t closure;
+	uint64_t start;
+	uint64_t children; // Time spent in the callees
+};
+
+class CallTree
+{
+private:
+	std::map<uint32_t, std::vector<ActiveFrame>> stacks; // By VM
+	uint64_t lastTime;
+
+	void pop(std::vector<ActiveFrame>& stack, uint64_t time)
+	{
+		ActiveFrame frame = stack.back();
+		stack.pop_back();
+		uint64_t duration = time > frame.start ? time - frame.start : 0;
+		uint64_t self = duration > frame.children ? duration - frame.children : 0;
+
+		frame.node->calls++;
+		frame.node->inclusive += duration;
+		frame.node->exclusive += self;
+		FunctionStats& stats = this->functions[frame.node->function];
+		stats.calls++;
+		stats.exclusive += self;
+		if (--stats.active == 0) {
+			stats.inclusive += duration;
+		}
+		if (!stack.empty()) {
+			stack.back().children += duration;
+		}
+	}
+
+public:
+	CallNode root;
+	std::map<std::string, FunctionStats> functions;
+
+	CallTree() : lastTime(0), root("(root)") {}
+
+	void add(const FrameEventData& event)
+	{
+		std::vector<ActiveFrame>& stack = this->stacks[event.vm];
+		this->lastTime = std::max(this->lastTime, event.time);
+
+		if (event.event == FRAME_ENTER) {
+			CallNode *parent = stack.empty() ? &this->root : stack.back().node;
+			std::unique_ptr<CallNode>& node = parent->children[event.function];
+			if (!node) {
+				node.reset(new CallNode(event.function));
+			}
+			ActiveFrame frame = { node.get(), event.closure, event.time, 0 };
+			stack.push_back(frame);
+			this->functions[event.function].active++;
+			return;
+		}
+
+		// Frames without an exit event (the trace may have missed it) end with their caller.
+		size_t i = stack.size();
+		while (i > 0 && stack[i - 1].closure != event.closure) {
+			i--;
+		}
+		if (i == 0) {
+			return;
+		}
+		while (stack.size() >= i) {
+			this->pop(stack, event.time);
+		}
+	}
+
+	// Ends the frames still open at the end of the trace.
+	void finish()
+	{
+		for (auto& it : this->stacks) {
+			while (!it.second.empty()) {
+				this->pop(it.second, this->lastTime);
+			}
+		}
+		for (auto& it : this->root.children) {
+			this->root.inclusive += it.second->inclusive;
+		}
+	}
+};
+
+static double ms(uint64_t ns)
+{
+	return ns / 1000000.0;
+}
+
+static void print_tree(const CallNode& node, uint64_t total, int depth)
+{
+	std::vector<const CallNode*> children;
+	for (const auto& it : node.children) {
+		children.push_back(it.second.get());
+	}
+	std::sort(children.begin(), children.end(), [](const CallNode *a, const CallNode *b) {
+		return a->inclusive > b->inclusive;
+	});
+	for (const CallNode *child : children) {
+		// Hide the branches below 0.1% of the total time.
+		if (child->inclusive * 1000 < total) {
+			continue;
+		}
+		printf("%12.3f %12.3f %10llu  %*s%s\n", ms(child->inclusive), ms(child->exclusive),
+			(unsigned long long)child->calls, depth * 2, "", child->function.c_str());
+		print_tree(*child, total, depth + 1);
+	}
+}
+
+// One line per node: the frames from the root separated by ';', and the exclusive time in microseconds.
+static void write_folded(FILE *out, const CallNode& node, std::string& path)
+{
+	for (const auto& it : node.children) {
+		const CallNode& child = *it.second;
+		size_t size = path.size();
+		if (!path.empty()) {
+			path += ';';
+		}
+		path += child.function;
+		if (child.exclusive >= 1000) {
+			fprintf(out, "%s %llu\n", path.c_str(), (unsigned long long)(child.exclusive / 1000));
+		}
+		write_folded(out, child, path);
+		path.resize(size);
+	}
+}
+
+int calltree_main(int argc, char **argv)
+{
+	if (argc != 2 && argc != 3) {
+		fprintf(stderr, "Usage: sqtrace calltree <trace.bin|trace.json> [folded.txt]\n");
+		return 1;
+	}
+
+	FrameSource source;
+	if (!source.open(argv[1])) {
+		return 1;
+	}
+	CallTree tree;
+	FrameEventData event;
+	size_t events = 0;
+	while (source.next(event)) {
+		tree.add(event);
+		events++;
+	}
+	tree.finish();
+	if (events == 0) {
+		fprintf(stderr, "%s: no frame events. Enable \"frames\" in the tracer config.\n", argv[1]);
+		return 1;
+	}
+
+	uint64_t total = tree.root.inclusive;
+	printf("%u frame events, %.3f ms in the traced frames\n\n", (unsigned int)events, ms(total));
+
+	std::vector<std::pair<std::string, FunctionStats>> functions(tree.functions.begin(), tree.functions.end());
+	std::sort(functions.begin(), functions.end(), [](const std::pair<std::string, FunctionStats>& a, const std::pair<std::string, FunctionStats>& b) {
+		return a.second.exclusive > b.second.exclusive;
+	});
+	printf("Functions by exclusive time\n");
+	printf("%12s %12s %10s  %s\n", "incl. ms", "excl. ms", "calls", "function");
+	for (size_t i = 0; i < functions.size() && i < 50; i++) {
+		const FunctionStats& stats = functions[i].second;
+		printf("%12.3f %12.3f %10llu  %s\n", ms(stats.inclusive), ms(stats.exclusive),
+			(unsigned long long)stats.calls, functions[i].first.c_str());
+	}
+
+	printf("\nCall tree\n");
+	printf("%12s %12s %10s  %s\n", "incl. ms", "excl. ms", "calls", "function");
+	print_tree(tree.root, total, 0);
+
+	if (argc == 3) {
+		FILE *out = fopen(argv[2], "w");
+		if (!out) {
+			fprintf(stderr, "%s: cannot open file\n", argv[2]);
+			return 1;
+		}
+		std::string path;
+		write_folded(out, tree.root, path);
+		fclose(out);
+	}
+	return 0;
+}
@@ -0,0 +1,180 @@
+#include "trace_tools.h"
+#include "TraceControl.h"
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <chrono>
+#include <thread>
+
+/**
+  * Client of the control block of a running tracer (see TraceControl.h).
+  * "serve" creates the block itself and plays the part of the tracer, to test the clients
+  * (and the tools using the block) without a game.
+  */
+
+static void sleep_ms(unsigned int ms)
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+// Waits until (state & flag) == value. Returns false after timeout milliseconds.
+static bool wait_state(TraceControlBlock *block, uint32_t flag, uint32_t value, unsigned int timeout)
+{
+	for (unsigned int elapsed = 0; (block->state.load() & flag) != value; elapsed += 10) {
+		if (elapsed >= timeout) {
+			return false;
+		}
+		sleep_ms(10);
+	}
+	return true;
+}
+
+static void print_status(TraceControlBlock *block)
+{
+	uint32_t state = block->state.load();
+	printf("pid %u: %s%s, %u configs applied\n", block->pid,
+		(state & CONTROL_ENABLED) ? "enabled" : "disabled",
+		(state & CONTROL_CONFIG_PENDING) ? ", config pending" : "",
+		block->configsApplied.load());
+	if (block->config[0]) {
+		printf("last config: %.*s\n", TRACE_CONTROL_CONFIG_SIZE, block->config);
+	}
+}
+
+// Reads the config argument: a JSON object, or @file.
+static bool read_config(const char *arg, std::string& config)
+{
+	if (arg[0] != '@') {
+		config = arg;
+		return true;
+	}
+	FILE *file = fopen(arg + 1, "rb");
+	if (!file) {
+		fprintf(stderr, "%s: cannot open file\n", arg + 1);
+		return false;
+	}
+	char buffer[4096];
+	size_t size;
+	config.clear();
+	while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+		config.append(buffer, size);
+	}
+	fclose(file);
+	return true;
+}
+
+static int send_config(TraceControlBlock *block, const char *arg)
+{
+	std::string config;
+	if (!read_config(arg, config)) {
+		return 1;
+	}
+	if (config.size() >= TRACE_CONTROL_CONFIG_SIZE) {
+		fprintf(stderr, "The config is too large (%u bytes, the maximum is %u).\n",
+			(unsigned int)config.size(), TRACE_CONTROL_CONFIG_SIZE - 1);
+		return 1;
+	}
+	if (!wait_state(block, CONTROL_CONFIG_PENDING, 0, 5000)) {
+		fprintf(stderr, "The tracer didn't apply the previous config. Is the game running Squirrel code?\n");
+		return 1;
+	}
+
+	uint32_t applied = block->configsApplied.load();
+	memcpy(block->config, config.c_str(), config.size() + 1);
+	block->state |= CONTROL_CONFIG_PENDING;
+
+	// The config is applied on the next instruction. A disabled tracer applies it too.
+	for (unsigned int elapsed = 0; block->configsApplied.load() == applied; elapsed += 10) {
+		if (elapsed >= 5000) {
+			printf("Config sent, but not applied yet.\n");
+			return 0;
+		}
+		sleep_ms(10);
+	}
+	printf("Config applied. Check the thcrap log for errors.\n");
+	return 0;
+}
+
+static volatile sig_atomic_t stopServing = 0;
+
+static void stop_serving(int)
+{
+	stopServing = 1;
+}
+
+// Stand-in for the tracer: applies the configs and prints the changes.
+static int serve(TraceControlMapping& mapping)
+{
+	TraceControlBlock *block = mapping.block;
+	printf("Serving the control block of pid %u. Press Ctrl+C to stop.\n", block->pid);
+	uint32_t lastState = block->state.load();
+	print_status(block);
+	// Stops cleanly, so the block is removed.
+	signal(SIGINT, stop_serving);
+	signal(SIGTERM, stop_serving);
+	while (!stopServing) {
+		uint32_t state = block->state.load();
+		if (state & CONTROL_CONFIG_PENDING) {
+			char config[TRACE_CONTROL_CONFIG_SIZE];
+			memcpy(config, block->config, sizeof(config));
+			config[sizeof(config) - 1] = '\0';
+			block->state &= ~CONTROL_CONFIG_PENDING;
+			block->configsApplied++;
+			printf("config: %s\n", config);
+			state &= ~CONTROL_CONFIG_PENDING;
+		}
+		if ((state & CONTROL_ENABLED) != (lastState & CONTROL_ENABLED)) {
+			printf("%s\n", (state & CONTROL_ENABLED) ? "enabled" : "disabled");
+		}
+		lastState = state;
+		fflush(stdout);
+		sleep_ms(10);
+	}
+	return 0;
+}
+
+int control_main(int argc, char **argv)
+{
+	if (argc < 3) {
+		fprintf(stderr, "Usage: sqtrace control <pid> status|enable|disable|toggle|config <json|@file>|serve\n");
+		return 1;
+	}
+	uint32_t pid = strtoul(argv[1], nullptr, 10);
+	const char *command = argv[2];
+
+	TraceControlMapping mapping;
+	if (strcmp(command, "serve") == 0) {
+		if (!mapping.create(pid, CONTROL_ENABLED)) {
+			fprintf(stderr, "Cannot create the control block of pid %u.\n", pid);
+			return 1;
+		}
+		return serve(mapping);
+	}
+	if (!mapping.open(pid)) {
+		fprintf(stderr, "No tracer control block for pid %u. Is the squirrel_tracer plugin loaded?\n", pid);
+		return 1;
+	}
+	TraceControlBlock *block = mapping.block;
+
+	if (strcmp(command, "status") == 0) {
+		print_status(block);
+	}
+	else if (strcmp(command, "enable") == 0) {
+		block->state |= CONTROL_ENABLED;
+	}
+	else if (strcmp(command, "disable") == 0) {
+		block->state &= ~CONTROL_ENABLED;
+	}
+	else if (strcmp(command, "toggle") == 0) {
+		uint32_t state = block->state.fetch_xor(CONTROL_ENABLED) ^ CONTROL_ENABLED;
+		printf("%s\n", (state & CONTROL_ENABLED) ? "enabled" : "disabled");
+	}
+	else if (strcmp(command, "config") == 0 && argc == 4) {
+		return send_config(block, argv[3]);
+	}
+	else {
+		fprintf(stderr, "Unknown control command: %s\n", command);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,213 @@
+#include "trace_tools.h"
+#include "JsonStream.h"
+#include <string.h>
+
+/**
+  * Converts a binary trace to the JSON format written by JsonTraceWriter.
+  * The output is byte-for-byte what the tracer would have written, so the existing consumers
+  * (like the trace viewer) can read it.
+  * With --expand-deltas, the delta records are replaced with the full object they give,
+  * for the consumers that don't handle them.
+  */
+
+static void write_value(JsonStream& json, const BinaryTraceReader& reader, uint8_t type, uint32_t value)
+{
+	char string[64];
+
+	switch (type) {
+	case TV_NULL:
+		json.null();
+		break;
+
+	case TV_INTEGER:
+		json.integer((int32_t)value);
+		break;
+
+	case TV_FLOAT: {
+		float f;
+		memcpy(&f, &value, 4);
+		json.real(f);
+		break;
+	}
+
+	case TV_BOOL:
+		json.boolean(value != 0);
+		break;
+
+	case TV_POINTER:
+		sprintf(string, "POINTER:%08X", value);
+		json.string(string);
+		break;
+
+	case TV_USERPOINTER:
+		sprintf(string, "<user pointer: %08X>", value);
+		json.string(string);
+		break;
+
+	case TV_STRING: {
+		const std::string& str = reader.string(value);
+		json.string(str.c_str(), str.size());
+		break;
+	}
+
+	case TV_POOLED_STRING:
+		sprintf(string, "STRING:%u", value);
+		json.string(string);
+		break;
+
+	case TV_UNKNOWN_TYPE:
+		// 0x08000000 is SQOBJECT_REF_COUNTED
+		sprintf(string, "<unknown %srefcounted type %d>", (value & 0x08000000) ? "" : "non-", (int32_t)value);
+		json.string(string);
+		break;
+
+	case TV_ARRAY:
+		json.beginArray();
+		for (size_t i = 0; i < reader.values.size(); i++) {
+			write_value(json, reader, reader.values[i].type, reader.values[i].value);
+		}
+		json.endArray();
+		break;
+
+	default:
+		json.string("(error in the trace value)");
+		break;
+	}
+}
+
+// The file and function names are written once, with the string ID as name ID, like JsonTraceWriter does.
+static void write_name(FILE *out, const BinaryTraceReader& reader, uint32_t id, std::vector<bool>& written)
+{
+	if (id < written.size() && written[id]) {
+		return;
+	}
+	if (id >= written.size()) {
+		written.resize(id + 1, false);
+	}
+	written[id] = true;
+
+	const std::string& name = reader.string(id);
+	JsonStream json;
+	json.beginObject();
+	json.key("type");
+	json.string("name");
+	json.key("id");
+	json.integer(id);
+	json.key("name");
+	json.string(name.c_str(), name.size());
+	json.endObject();
+	json.append(",\n", 2);
+	fwrite(json.data(), json.size(), 1, out);
+}
+
+int convert_main(int argc, char **argv)
+{
+	bool expandDeltas = argc == 4 && strcmp(argv[1], "--expand-deltas") == 0;
+	if (argc != 3 && !expandDeltas) {
+		fprintf(stderr, "Usage: sqtrace convert [--expand-deltas] <trace.bin> <trace.json>\n");
+		return 1;
+	}
+	const char *inputFn = argv[argc - 2];
+	const char *outputFn = argv[argc - 1];
+
+	BinaryTraceReader reader;
+	if (!reader.open(inputFn)) {
+		return 1;
+	}
+	FILE *out = fopen(outputFn, "w");
+	if (!out) {
+		fprintf(stderr, "%s: cannot open file\n", outputFn);
+		return 1;
+	}
+
+	static const char *keys[] = { "arg0", "arg1", "arg2", "arg3" };
+	JsonStream json;
+	char header[64];
+	std::vector<bool> namesWritten;
+	ObjectStates objects;
+	std::string content;
+
+	fputs("[\n", out);
+	while (reader.next()) {
+		json.clear();
+		if (reader.record == REC_INSTRUCTION) {
+			const BinaryInstructionRecord& instruction = reader.instruction;
+			const std::string& op = reader.opcode(instruction.op);
+			write_name(out, reader, instruction.fn, namesWritten);
+			json.beginObject();
+			json.key("type");
+			json.string("instruction");
+			json.key("fn");
+			json.integer(instruction.fn);
+			json.key("op");
+			json.string(op.c_str(), op.size());
+			for (int i = 0; i < 4; i++) {
+				json.key(keys[i]);
+				write_value(json, reader, instruction.argType[i], instruction.arg[i]);
+			}
+			json.endObject();
+			json.append(",\n", 2);
+		}
+		else if (reader.record == REC_OBJECT || (reader.record == REC_OBJECT_DELTA && !expandDeltas)) {
+			const char *type = reader.record == REC_OBJECT ? "object" : "delta";
+			json.append(header, sprintf(header, "{\"type\":\"%s\",\"address\":\"POINTER:%08X\",\"content\":", type, reader.address));
+			json.append(reader.content.data(), reader.content.size());
+			json.append("},\n", 3);
+			if (expandDeltas) {
+				objects.object(reader.address, reader.content);
+			}
+		}
+		else if (reader.record == REC_OBJECT_DELTA) {
+			if (!objects.delta(reader.address, reader.content) || !objects.get(reader.address, content)) {
+				fprintf(stderr, "Delta record for %08X without a table or array before it\n", reader.address);
+				continue;
+			}
+			json.append(header, sprintf(header, "{\"type\":\"object\",\"address\":\"POINTER:%08X\",\"content\":", reader.address));
+			json.append(content.data(), content.size());
+			json.append("},\n", 3);
+		}
+		else if (reader.record == REC_POOLED_STRING) {
+			json.beginObject();
+			json.key("type");
+			json.string("string");
+			json.key("id");
+			json.integer(reader.pooledId);
+			json.key("value");
+			json.string(reader.content.data(), reader.content.size());
+			json.endObject();
+			json.append(",\n", 2);
+		}
+		else if (reader.record == REC_FREED) {
+			json.append(header, sprintf(header, "{\"type\":\"freed\",\"address\":\"POINTER:%08X\"},\n", reader.address));
+			objects.freed(reader.address);
+		}
+		else if (reader.record == REC_FRAME) {
+			const BinaryFrameRecord& frame = reader.frame;
+			char pointer[32];
+			write_name(out, reader, frame.fn, namesWritten);
+			write_name(out, reader, frame.name, namesWritten);
+			json.beginObject();
+			json.key("type");
+			json.string(frame.event == FRAME_ENTER ? "enter" : "exit");
+			json.key("vm");
+			sprintf(pointer, "POINTER:%08X", frame.vm);
+			json.string(pointer);
+			json.key("closure");
+			sprintf(pointer, "POINTER:%08X", frame.closure);
+			json.string(pointer);
+			json.key("fn");
+			json.integer(frame.fn);
+			json.key("name");
+			json.integer(frame.name);
+			json.key("time");
+			json.integer(frame.time);
+			json.endObject();
+			json.append(",\n", 2);
+		}
+		fwrite(json.data(), json.size(), 1, out);
+	}
+
+	fputs("{\"type\":\"end\"}\n]\n", out);
+	fclose(out);
+	return 0;
+}
@@ -0,0 +1,138 @@
+#include "trace_tools.h"
+#include "TraceCompression.h"
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <thread>
+
+/**
+  * Decompresses a trace written with "compression": "lz4" (see TraceCompression.h).
+  * With the side index, the frames are decompressed in parallel, by batches, and written in order.
+  * Without it (it was deleted, or not copied with the trace), the frames are read one after the other.
+  */
+
+static bool read_file(const char *fn, std::string& out)
+{
+	FILE *file = fopen(fn, "rb");
+	if (!file) {
+		return false;
+	}
+	char buffer[65536];
+	size_t size;
+	out.clear();
+	while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+		out.append(buffer, size);
+	}
+	fclose(file);
+	return true;
+}
+
+static bool read_index(const char *fn, std::vector<CompressedIndexEntry>& entries)
+{
+	std::string indexFn = std::string(fn) + ".idx";
+	std::string index;
+	if (!read_file(indexFn.c_str(), index) || index.size() < sizeof(CompressedIndexHeader)) {
+		return false;
+	}
+	const CompressedIndexHeader *header = (const CompressedIndexHeader*)index.data();
+	if (memcmp(header->magic, COMPRESSED_INDEX_MAGIC, sizeof(COMPRESSED_INDEX_MAGIC)) != 0
+		|| header->version != COMPRESSED_INDEX_VERSION) {
+		fprintf(stderr, "%s: not a compressed trace index\n", indexFn.c_str());
+		return false;
+	}
+	size_t count = (index.size() - sizeof(CompressedIndexHeader)) / sizeof(CompressedIndexEntry);
+	entries.resize(count);
+	if (count) {
+		memcpy(entries.data(), index.data() + sizeof(CompressedIndexHeader), count * sizeof(CompressedIndexEntry));
+	}
+	return true;
+}
+
+static int decompress_sequential(const std::string& compressed, size_t offset, FILE *out)
+{
+	std::string frame;
+	while (offset < compressed.size()) {
+		frame.clear();
+		size_t size = Lz4::decompressFrame(compressed.data() + offset, compressed.size() - offset, frame);
+		if (size == 0) {
+			// The tracer may have been killed while writing the last frame.
+			fprintf(stderr, "Invalid or truncated frame at offset %llu\n", (unsigned long long)offset);
+			return 1;
+		}
+		fwrite(frame.data(), frame.size(), 1, out);
+		offset += size;
+	}
+	return 0;
+}
+
+int decompress_main(int argc, char **argv)
+{
+	if (argc != 3 && argc != 4) {
+		fprintf(stderr, "Usage: sqtrace decompress <trace.lz4> <output> [threads]\n");
+		return 1;
+	}
+	std::string compressed;
+	if (!read_file(argv[1], compressed)) {
+		fprintf(stderr, "%s: cannot open file\n", argv[1]);
+		return 1;
+	}
+	FILE *out = fopen(argv[2], "wb");
+	if (!out) {
+		fprintf(stderr, "%s: cannot open file\n", argv[2]);
+		return 1;
+	}
+
+	std::vector<CompressedIndexEntry> entries;
+	if (!read_index(argv[1], entries)) {
+		int ret = decompress_sequential(compressed, 0, out);
+		fclose(out);
+		return ret;
+	}
+
+	unsigned int threads = argc == 4 ? strtoul(argv[3], nullptr, 10) : std::thread::hardware_concurrency();
+	if (threads == 0) {
+		threads = 1;
+	}
+	// The frames past the end of the file were indexed, but their write didn't complete.
+	while (!entries.empty() && entries.back().offset + entries.back().size > compressed.size()) {
+		entries.pop_back();
+	}
+
+	size_t batchSize = threads * 4;
+	std::vector<std::string> frames(batchSize);
+	std::vector<char> failed(batchSize); // Not vector<bool>: the threads write to it
+	int ret = 0;
+	for (size_t batch = 0; batch < entries.size() && ret == 0; batch += batchSize) {
+		size_t count = (std::min)(batchSize, entries.size() - batch);
+		std::vector<std::thread> workers;
+		for (unsigned int t = 0; t < threads; t++) {
+			workers.push_back(std::thread([&, t]() {
+				for (size_t i = t; i < count; i += threads) {
+					const CompressedIndexEntry& entry = entries[batch + i];
+					frames[i].clear();
+					size_t size = Lz4::decompressFrame(compressed.data() + entry.offset, entry.size, frames[i]);
+					failed[i] = size != entry.size || frames[i].size() != entry.rawSize;
+				}
+			}));
+		}
+		for (std::thread& worker : workers) {
+			worker.join();
+		}
+		for (size_t i = 0; i < count; i++) {
+			if (failed[i]) {
+				fprintf(stderr, "Invalid frame %u at offset %llu\n", (unsigned int)(batch + i),
+					(unsigned long long)entries[batch + i].offset);
+				ret = 1;
+				break;
+			}
+			fwrite(frames[i].data(), frames[i].size(), 1, out);
+		}
+	}
+	// The index is written after the frames, so the last frames may be missing from it.
+	size_t indexed = entries.empty() ? 0 : (size_t)(entries.back().offset + entries.back().size);
+	if (ret == 0 && indexed < compressed.size()) {
+		ret = decompress_sequential(compressed, indexed, out);
+	}
+	fclose(out);
+	return ret;
+}
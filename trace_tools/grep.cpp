@@ -0,0 +1,481 @@
+#include "trace_tools.h"
+#include "TraceIndex.h"
+#include "JsonStream.h"
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <unordered_set>
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+# include <emmintrin.h>
+# define GREP_SSE2
+#endif
+
+/**
+  * Parallel filter of a JSON trace. Every record is one line, so the trace is cut into chunks
+  * at line boundaries, and the chunks are scanned by all the cores. The lines are first found
+  * with a substring search, and only these candidates are parsed. The matches are written
+  * in trace order.
+  */
+
+#ifdef GREP_SSE2
+static unsigned int lowest_bit(unsigned int mask)
+{
+# ifdef _MSC_VER
+	unsigned long bit;
+	_BitScanForward(&bit, mask);
+	return bit;
+# else
+	return __builtin_ctz(mask);
+# endif
+}
+#endif
+
+const char *find_substring(const char *p, const char *end, const char *needle, size_t size)
+{
+	if (size == 0 || (size_t)(end - p) < size) {
+		return size == 0 ? p : nullptr;
+	}
+	const char *last = end - size; // Last position the needle can start at
+#ifdef GREP_SSE2
+	// Compares 16 positions at a time with two bytes of the needle, and only compares the whole
+	// needle where both match. The JSON punctuation is everywhere in a trace, so the first and last
+	// bytes that aren't punctuation are used.
+	static const char punctuation[] = "\"{}[]:,";
+	size_t i = 0;
+	size_t j = size - 1;
+	while (i < j && strchr(punctuation, needle[i])) {
+		i++;
+	}
+	while (j > i && strchr(punctuation, needle[j])) {
+		j--;
+	}
+	const __m128i first = _mm_set1_epi8(needle[i]);
+	const __m128i lastByte = _mm_set1_epi8(needle[j]);
+	for (; last - p >= 15; p += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(p + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(p + j));
+		unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, lastByte)));
+		while (mask) {
+			unsigned int bit = lowest_bit(mask);
+			if (memcmp(p + bit, needle, size) == 0) {
+				return p + bit;
+			}
+			mask &= mask - 1;
+		}
+	}
+#endif
+	for (; p <= last; p++) {
+		p = (const char*)memchr(p, needle[0], last - p + 1);
+		if (!p) {
+			return nullptr;
+		}
+		if (memcmp(p, needle, size) == 0) {
+			return p;
+		}
+	}
+	return nullptr;
+}
+
+static const char *find_substring(const char *p, const char *end, const std::string& needle)
+{
+	return find_substring(p, end, needle.data(), needle.size());
+}
+
+static std::string json_string(const char *str)
+{
+	JsonStream json;
+	json.string(str);
+	return std::string(json.data(), json.size());
+}
+
+static const char INSTRUCTION_PREFIX[] = "{\"type\":\"instruction\",\"fn\":";
+
+// Returns the position after the JSON string at p, or nullptr if it doesn't end.
+static const char *skip_json_string(const char *p, const char *end)
+{
+	for (p++; p < end; p++) {
+		if (*p == '\\') {
+			p++;
+		}
+		else if (*p == '"') {
+			return p + 1;
+		}
+	}
+	return nullptr;
+}
+
+/**
+  * The filters of the command line. A record matches if it matches all of them.
+  * The strings are compared as they are written in the trace, with the JSON escapes.
+  */
+struct GrepFilter
+{
+	std::string op;                        // "op":"<op>"
+	std::unordered_set<uint64_t> files;    // Name IDs of the file
+	bool hasFile;
+	std::string string;                    // "<string>", the JSON string
+	std::unordered_set<uint64_t> strings;  // Pooled string IDs of the string
+	bool hasString;
+	std::string text;                      // Anywhere in the record
+
+	GrepFilter() : hasFile(false), hasString(false) {}
+
+	// The record has at least one of these substrings. Every candidate line is parsed.
+	std::vector<std::string> needles() const
+	{
+		std::vector<std::string> needles;
+		char id[32];
+		if (!this->text.empty()) {
+			needles.push_back(this->text);
+		}
+		else if (this->hasString) {
+			needles.push_back(this->string);
+			for (uint64_t it : this->strings) {
+				sprintf(id, "\"STRING:%llu\"", (unsigned long long)it);
+				needles.push_back(id);
+			}
+		}
+		else if (this->hasFile) {
+			for (uint64_t it : this->files) {
+				sprintf(id, "%llu,\"op\":", (unsigned long long)it);
+				needles.push_back(INSTRUCTION_PREFIX + std::string(id));
+			}
+		}
+		else if (!this->op.empty()) {
+			needles.push_back(this->op);
+		}
+		return needles;
+	}
+
+	// Is the string value at p (with its quotes) the string of the filter?
+	bool isString(const char *p, const char *end) const
+	{
+		if ((size_t)(end - p) == this->string.size() && memcmp(p, this->string.data(), end - p) == 0) {
+			return true;
+		}
+		static const char prefix[] = "\"STRING:";
+		if ((size_t)(end - p) <= sizeof(prefix) || memcmp(p, prefix, sizeof(prefix) - 1) != 0) {
+			return false;
+		}
+		return this->strings.count(strtoull(p + sizeof(prefix) - 1, nullptr, 10)) > 0;
+	}
+
+	bool match(const char *p, const char *end) const
+	{
+		if (!this->text.empty() && !find_substring(p, end, this->text)) {
+			return false;
+		}
+		if (!this->hasFile && !this->hasString && this->op.empty()) {
+			return true;
+		}
+		// The other filters only apply to the instructions.
+		const size_t prefixSize = sizeof(INSTRUCTION_PREFIX) - 1;
+		if ((size_t)(end - p) < prefixSize || memcmp(p, INSTRUCTION_PREFIX, prefixSize) != 0) {
+			return false;
+		}
+		const char *fn = p + prefixSize;
+		if (this->hasFile && !this->files.count(strtoull(fn, nullptr, 10))) {
+			return false;
+		}
+		const char *op = (const char*)memchr(fn, '"', end - fn); // "op":
+		if (!op || end - op < 6) {
+			return false;
+		}
+		if (!this->op.empty() && ((size_t)(end - op) < this->op.size() || memcmp(op, this->op.data(), this->op.size()) != 0)) {
+			return false;
+		}
+		if (!this->hasString) {
+			return true;
+		}
+
+		// The strings after the opcode, except the keys, are the arguments and the elements of the array argument.
+		const char *s = skip_json_string(op + 5, end);
+		while (s && (s = (const char*)memchr(s, '"', end - s)) != nullptr) {
+			const char *stringEnd = skip_json_string(s, end);
+			if (!stringEnd) {
+				return false;
+			}
+			if ((stringEnd == end || *stringEnd != ':') && this->isString(s, stringEnd)) {
+				return true;
+			}
+			s = stringEnd;
+		}
+		return false;
+	}
+};
+
+struct GrepChunk
+{
+	uint64_t begin;
+	uint64_t end;
+	std::string out;                 // Matching records, one per line
+	std::vector<uint64_t> numbers;   // Instruction number of every match, in the chunk
+	uint64_t instructions;           // Instructions in the chunk
+	bool failed;
+};
+
+// Start of the first line at or after pos.
+static uint64_t line_start(MappedFile& file, uint64_t pos)
+{
+	if (pos == 0) {
+		return 0;
+	}
+	for (uint64_t at = pos - 1; at < file.size(); ) {
+		size_t size = (size_t)(std::min)((uint64_t)65536, file.size() - at);
+		const char *p = file.map(at, size);
+		if (!p) {
+			break;
+		}
+		const char *eol = (const char*)memchr(p, '\n', size);
+		if (eol) {
+			return at + (eol - p) + 1;
+		}
+		at += size;
+	}
+	return file.size();
+}
+
+static size_t count_instructions(const char *p, const char *end, const char *chunkBegin)
+{
+	static const char needle[] = "\n{\"type\":\"instruction\"";
+	size_t count = 0;
+	// The line at the start of the chunk has no \n before it.
+	if (p == chunkBegin && (size_t)(end - p) >= sizeof(needle) - 2 && memcmp(p, needle + 1, sizeof(needle) - 2) == 0) {
+		count++;
+	}
+	while ((p = find_substring(p, end, needle, sizeof(needle) - 1)) != nullptr) {
+		count++;
+		p++;
+	}
+	return count;
+}
+
+/**
+  * Calls scan(begin, end, chunk) for every chunk of the trace, in parallel, then write(chunk)
+  * for every chunk, in order. A chunk holds complete lines.
+  */
+template<typename S, typename W> static bool scan_chunks(const char *fn, uint64_t size, unsigned int threads, S scan, W write)
+{
+	const uint64_t CHUNK_SIZE = 8 * 1024 * 1024;
+	size_t batchSize = threads * 4;
+	std::vector<GrepChunk> chunks(batchSize);
+	bool ok = true;
+	for (uint64_t batch = 0; batch < size && ok; batch += CHUNK_SIZE * batchSize) {
+		size_t count = (size_t)(std::min)((uint64_t)batchSize, (size - batch + CHUNK_SIZE - 1) / CHUNK_SIZE);
+		std::atomic<size_t> next(0);
+		std::vector<std::thread> workers;
+		for (unsigned int t = 0; t < threads && t < count; t++) {
+			workers.push_back(std::thread([&]() {
+				MappedFile file;
+				bool opened = file.open(fn);
+				size_t i;
+				while ((i = next++) < count) {
+					GrepChunk& chunk = chunks[i];
+					chunk.out.clear();
+					chunk.numbers.clear();
+					chunk.instructions = 0;
+					chunk.failed = !opened;
+					if (!opened) {
+						continue;
+					}
+					uint64_t offset = batch + i * CHUNK_SIZE;
+					chunk.begin = line_start(file, offset);
+					chunk.end = line_start(file, (std::min)(offset + CHUNK_SIZE, size));
+					if (chunk.end <= chunk.begin) {
+						continue; // Inside a line that started in another chunk
+					}
+					const char *p = file.map(chunk.begin, (size_t)(chunk.end - chunk.begin));
+					if (!p) {
+						chunk.failed = true;
+						continue;
+					}
+					scan(p, p + (chunk.end - chunk.begin), chunk);
+				}
+			}));
+		}
+		for (std::thread& worker : workers) {
+			worker.join();
+		}
+		for (size_t i = 0; i < count; i++) {
+			if (chunks[i].failed) {
+				fprintf(stderr, "%s: cannot read the trace at offset %llu\n", fn, (unsigned long long)(batch + i * CHUNK_SIZE));
+				ok = false;
+				break;
+			}
+			write(chunks[i]);
+		}
+	}
+	return ok;
+}
+
+// Calls f(line, lineEnd) for every line with one of the needles, in order. The lines don't have their ",\n".
+template<typename F> static void for_each_candidate(const char *begin, const char *end, const std::vector<std::string>& needles, F f)
+{
+	std::vector<const char*> lines;
+	for (const std::string& needle : needles) {
+		for (const char *p = begin; (p = find_substring(p, end, needle)) != nullptr; ) {
+			const char *line = p;
+			while (line > begin && line[-1] != '\n') {
+				line--;
+			}
+			lines.push_back(line);
+			p = (const char*)memchr(p, '\n', end - p);
+			if (!p) {
+				break;
+			}
+		}
+	}
+	if (needles.size() > 1) {
+		std::sort(lines.begin(), lines.end());
+		lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+	}
+	for (const char *line : lines) {
+		const char *lineEnd = (const char*)memchr(line, '\n', end - line);
+		if (!lineEnd) {
+			lineEnd = end;
+		}
+		const char *recordEnd = lineEnd;
+		if (recordEnd > line && recordEnd[-1] == '\r') {
+			recordEnd--;
+		}
+		if (recordEnd > line && recordEnd[-1] == ',') {
+			recordEnd--;
+		}
+		f(line, recordEnd);
+	}
+}
+
+// Finds the IDs of the name or pooled string records ({"type":"<type>","id":N,"<key>":<value>}) with a value.
+static bool find_ids(const char *fn, uint64_t size, unsigned int threads, const char *type, const char *key,
+	const std::string& value, std::unordered_set<uint64_t>& ids)
+{
+	std::vector<std::string> needles(1, std::string(",\"") + key + "\":" + value + "}");
+	std::string prefix = std::string("{\"type\":\"") + type + "\",\"id\":";
+	return scan_chunks(fn, size, threads, [&](const char *begin, const char *end, GrepChunk& chunk) {
+		for_each_candidate(begin, end, needles, [&](const char *line, const char *lineEnd) {
+			if ((size_t)(lineEnd - line) > prefix.size() && memcmp(line, prefix.data(), prefix.size()) == 0
+				&& find_substring(line, lineEnd, needles[0]) == lineEnd - needles[0].size()) {
+				chunk.numbers.push_back(strtoull(line + prefix.size(), nullptr, 10));
+			}
+		});
+	}, [&](const GrepChunk& chunk) {
+		ids.insert(chunk.numbers.begin(), chunk.numbers.end());
+	});
+}
+
+static void usage()
+{
+	fprintf(stderr, "Usage: sqtrace grep [-n] [--threads <count>] [--op <op>] [--file <file>] [--string <string>]\n"
+		"                   [--text <text>] <trace.json>\n");
+}
+
+int grep_main(int argc, char **argv)
+{
+	GrepFilter filter;
+	bool numbers = false;
+	unsigned int threads = std::thread::hardware_concurrency();
+	const char *file = nullptr;
+	const char *string = nullptr;
+	int i;
+	for (i = 1; i < argc - 1; i++) {
+		if (strcmp(argv[i], "-n") == 0) {
+			numbers = true;
+		}
+		else if (i + 1 < argc - 1 && strcmp(argv[i], "--threads") == 0) {
+			threads = strtoul(argv[++i], nullptr, 10);
+		}
+		else if (i + 1 < argc - 1 && strcmp(argv[i], "--op") == 0) {
+			filter.op = "\"op\":" + json_string(argv[++i]);
+		}
+		else if (i + 1 < argc - 1 && strcmp(argv[i], "--file") == 0) {
+			file = argv[++i];
+		}
+		else if (i + 1 < argc - 1 && strcmp(argv[i], "--string") == 0) {
+			string = argv[++i];
+		}
+		else if (i + 1 < argc - 1 && strcmp(argv[i], "--text") == 0) {
+			filter.text = argv[++i];
+		}
+		else {
+			break;
+		}
+	}
+	if (i != argc - 1 || (!file && !string && filter.op.empty() && filter.text.empty())) {
+		usage();
+		return 1;
+	}
+	const char *traceFn = argv[argc - 1];
+	if (threads == 0) {
+		threads = 1;
+	}
+
+	MappedFile trace;
+	if (!trace.open(traceFn)) {
+		fprintf(stderr, "%s: cannot open file\n", traceFn);
+		return 1;
+	}
+	uint64_t size = trace.size();
+	const char *magic = size >= sizeof(BINARY_TRACE_MAGIC) ? trace.map(0, sizeof(BINARY_TRACE_MAGIC)) : nullptr;
+	if (magic && memcmp(magic, BINARY_TRACE_MAGIC, sizeof(BINARY_TRACE_MAGIC)) == 0) {
+		fprintf(stderr, "%s: binary trace. Convert it to JSON with sqtrace convert first.\n", traceFn);
+		return 1;
+	}
+	trace.close();
+
+	// The instructions only have the IDs of the file names and of the pooled strings.
+	if (file) {
+		filter.hasFile = true;
+		if (!find_ids(traceFn, size, threads, "name", "name", json_string(file), filter.files)) {
+			return 1;
+		}
+		if (filter.files.empty()) {
+			fprintf(stderr, "No file named %s in the trace\n", file);
+			return 1;
+		}
+	}
+	if (string) {
+		filter.hasString = true;
+		filter.string = json_string(string);
+		if (!find_ids(traceFn, size, threads, "string", "value", filter.string, filter.strings)) {
+			return 1;
+		}
+	}
+
+	std::vector<std::string> needles = filter.needles();
+	uint64_t instructions = 0;
+	bool ok = scan_chunks(traceFn, size, threads, [&](const char *begin, const char *end, GrepChunk& chunk) {
+		const char *counted = begin;
+		for_each_candidate(begin, end, needles, [&](const char *line, const char *lineEnd) {
+			if (!filter.match(line, lineEnd)) {
+				return;
+			}
+			if (numbers) {
+				chunk.instructions += count_instructions(counted, line, begin);
+				// From the \n before the line, so that the line is counted if it is an instruction.
+				counted = line > begin ? line - 1 : begin;
+				chunk.numbers.push_back(chunk.instructions);
+			}
+			chunk.out.append(line, lineEnd);
+			chunk.out += '\n';
+		});
+		if (numbers) {
+			chunk.instructions += count_instructions(counted, end, begin);
+		}
+	}, [&](const GrepChunk& chunk) {
+		if (!numbers) {
+			fwrite(chunk.out.data(), chunk.out.size(), 1, stdout);
+			return;
+		}
+		// Numbered like in the trace index: a record that isn't an instruction has the number of the next one.
+		const char *p = chunk.out.data();
+		for (uint64_t n : chunk.numbers) {
+			const char *eol = (const char*)memchr(p, '\n', chunk.out.data() + chunk.out.size() - p);
+			printf("%llu\t%.*s\n", (unsigned long long)(instructions + n), (int)(eol - p), p);
+			p = eol + 1;
+		}
+		instructions += chunk.instructions;
+	});
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,45 @@
+#include "trace_tools.h"
+#include <string.h>
+
+struct Command
+{
+	const char *name;
+	int (*main)(int argc, char **argv);
+	const char *usage;
+};
+
+static const Command commands[] = {
+	{ "convert", convert_main, "convert [--expand-deltas] <trace.bin> <trace.json>\n\tConverts a binary trace to the JSON format. --expand-deltas writes the\n\ttables and arrays sent as deltas as full objects." },
+	{ "decompress", decompress_main, "decompress <trace.lz4> <output> [threads]\n\tDecompresses a trace written with \"compression\": \"lz4\". The frames are decompressed\n\tin parallel when the side index (trace.lz4.idx) is there." },
+	{ "segments", segments_main, "segments <trace.idx> [instruction]\n\tLists the segments of a segmented trace, or finds the segment and offset of an instruction." },
+	{ "index", index_main, "index [--checkpoint-interval <deltas>] <trace.json>\n\tIndexes a JSON trace into trace.json.sqidx: the offsets of the instructions, the versions of\n\tevery object, and the instructions of every file and opcode. The full content of the objects is\n\tsaved in trace.json.sqckpt every 16 deltas in a row (by default), to rebuild them faster." },
+	{ "query", query_main, "query <trace.json> info|instructions <first> [last]|file <name> [first] [last]|op <name> [first] [last]|\n\t\tobject <address> <instruction>|resolve <address> <instruction> [depth]|versions <address>\n\tReads the instructions or the objects of a trace through its index, without loading the whole trace.\n\tresolve also replaces the objects it points to with their content at that instruction.\n\tThe index is built first if it is missing." },
+	{ "grep", grep_main, "grep [-n] [--threads <count>] [--op <op>] [--file <file>] [--string <string>] [--text <text>] <trace.json>\n\tPrints the records of a JSON trace that match all the filters, in order, using all the cores.\n\t--string matches the instructions with this string as argument. -n prints the instruction numbers." },
+	{ "calltree", calltree_main, "calltree <trace.bin|trace.json> [folded.txt]\n\tBuilds the call tree from the frame events, with the inclusive and exclusive times.\n\tWrites the folded stacks for flame graphs if an output file is given." },
+	{ "control", control_main, "control <pid> status|enable|disable|toggle|config <json|@file>|serve\n\tControls the tracer running in a game process. config merges a JSON object over the tracer config\n\t(\"mode\", \"filters\", \"sampling\", \"frames\", \"deltas\"). serve plays the tracer, to test the clients." },
+	{ "bench", bench_main, "bench [name]\n\tRuns the microbenchmarks of the tracer data structures (all of them by default)." },
+};
+
+static void usage()
+{
+	fprintf(stderr, "Usage: sqtrace <command> [arguments]\n\nCommands:\n");
+	for (const Command& command : commands) {
+		fprintf(stderr, "  %s\n", command.usage);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		usage();
+		return 1;
+	}
+	for (const Command& command : commands) {
+		if (strcmp(argv[1], command.name) == 0) {
+			return command.main(argc - 1, argv + 1);
+		}
+	}
+	fprintf(stderr, "Unknown command: %s\n\n", argv[1]);
+	usage();
+	return 1;
+}
@@ -0,0 +1,160 @@
+#include "trace_tools.h"
+#include "TraceIndex.h"
+#include <string.h>
+#include <stdlib.h>
+
+/**
+  * Random access to a JSON trace through its index (see TraceIndex.h).
+  * The index is built by "sqtrace index", or by the first query on a trace.
+  */
+
+int index_main(int argc, char **argv)
+{
+	uint32_t checkpointInterval = TRACE_INDEX_CHECKPOINT_INTERVAL;
+	if (argc == 4 && strcmp(argv[1], "--checkpoint-interval") == 0) {
+		checkpointInterval = strtoul(argv[2], nullptr, 10);
+	}
+	else if (argc != 2) {
+		fprintf(stderr, "Usage: sqtrace index [--checkpoint-interval <deltas>] <trace.json>\n");
+		return 1;
+	}
+	const char *traceFn = argv[argc - 1];
+	if (!TraceIndex::build(traceFn, checkpointInterval)) {
+		return 1;
+	}
+	TraceIndex index;
+	if (!index.open(traceFn)) {
+		return 1;
+	}
+	printf("%s: %llu instructions\n", TraceIndex::indexFile(traceFn).c_str(), (unsigned long long)index.instructions());
+	return 0;
+}
+
+static bool print_instruction(TraceIndex& index, uint64_t n)
+{
+	size_t size;
+	const char *record = index.instruction(n, size);
+	if (!record) {
+		fprintf(stderr, "Cannot read instruction %llu\n", (unsigned long long)n);
+		return false;
+	}
+	printf("%llu\t%.*s\n", (unsigned long long)n, (int)size, record);
+	return true;
+}
+
+// Accepts "POINTER:0BADF00D", as written in the trace, as well.
+static uint32_t parse_address(const char *address)
+{
+	if (strncmp(address, "POINTER:", 8) == 0) {
+		address += 8;
+	}
+	return strtoul(address, nullptr, 16);
+}
+
+static void usage()
+{
+	fprintf(stderr, "Usage: sqtrace query <trace.json> info\n"
+		"       sqtrace query <trace.json> instructions <first> [last]\n"
+		"       sqtrace query <trace.json> file <name> [first] [last]\n"
+		"       sqtrace query <trace.json> op <name> [first] [last]\n"
+		"       sqtrace query <trace.json> object <address> <instruction>\n"
+		"       sqtrace query <trace.json> resolve <address> <instruction> [depth]\n"
+		"       sqtrace query <trace.json> versions <address>\n");
+}
+
+int query_main(int argc, char **argv)
+{
+	if (argc < 3) {
+		usage();
+		return 1;
+	}
+	const char *traceFn = argv[1];
+	const char *query = argv[2];
+	TraceIndex index;
+	if (!index.open(traceFn)) {
+		fprintf(stderr, "Indexing %s...\n", traceFn);
+		if (!TraceIndex::build(traceFn, TRACE_INDEX_CHECKPOINT_INTERVAL) || !index.open(traceFn)) {
+			return 1;
+		}
+	}
+
+	if (strcmp(query, "info") == 0 && argc == 3) {
+		printf("%llu instructions\n\nFiles:\n", (unsigned long long)index.instructions());
+		std::string name;
+		for (uint32_t id = 0; id < index.nameCount(); id++) {
+			if (index.fileInstructions(id) && index.name(id, name)) {
+				printf("  %10llu  %s\n", (unsigned long long)index.fileInstructions(id), name.c_str());
+			}
+		}
+		printf("\nOpcodes:\n");
+		for (const TraceIndexOp& op : index.opcodes()) {
+			printf("  %10llu  %s\n", (unsigned long long)op.instructions.count, op.name);
+		}
+		return 0;
+	}
+
+	if (strcmp(query, "instructions") == 0 && (argc == 4 || argc == 5)) {
+		uint64_t first = strtoull(argv[3], nullptr, 10);
+		uint64_t last = argc == 5 ? strtoull(argv[4], nullptr, 10) : first;
+		if (last >= index.instructions()) {
+			last = index.instructions() - 1;
+		}
+		for (uint64_t n = first; n <= last && index.instructions(); n++) {
+			if (!print_instruction(index, n)) {
+				return 1;
+			}
+		}
+		return 0;
+	}
+
+	if ((strcmp(query, "file") == 0 || strcmp(query, "op") == 0) && argc >= 4 && argc <= 6) {
+		uint64_t first = argc >= 5 ? strtoull(argv[4], nullptr, 10) : 0;
+		uint64_t last = argc == 6 ? strtoull(argv[5], nullptr, 10) : (uint64_t)-1;
+		bool ok = true;
+		auto print = [&](uint64_t n) {
+			if (n > last) {
+				return false;
+			}
+			if (n >= first) {
+				ok = print_instruction(index, n);
+			}
+			return ok;
+		};
+		bool found = strcmp(query, "file") == 0 ? index.for_each_in_file(argv[3], print) : index.for_each_with_op(argv[3], print);
+		if (!found) {
+			fprintf(stderr, "No instruction in %s %s\n", query, argv[3]);
+			return 1;
+		}
+		return ok ? 0 : 1;
+	}
+
+	if ((strcmp(query, "object") == 0 && argc == 5) || (strcmp(query, "resolve") == 0 && (argc == 5 || argc == 6))) {
+		uint32_t object = parse_address(argv[3]);
+		uint64_t instruction = strtoull(argv[4], nullptr, 10);
+		unsigned int depth = argc == 6 ? strtoul(argv[5], nullptr, 10) : 16;
+		std::string content;
+		bool found = strcmp(query, "object") == 0 ? index.object(object, instruction, content) : index.resolve(object, instruction, depth, content);
+		if (!found) {
+			fprintf(stderr, "No object at %08X at instruction %llu\n", object, (unsigned long long)instruction);
+			return 1;
+		}
+		printf("%s\n", content.c_str());
+		return 0;
+	}
+
+	if (strcmp(query, "versions") == 0 && argc == 4) {
+		static const char *types[] = { "object", "delta", "freed", "checkpoint" };
+		uint32_t object = parse_address(argv[3]);
+		bool found = index.for_each_version(object, [](const TraceIndexVersion& version) {
+			printf("%llu\t%s\n", (unsigned long long)version.instruction, version.type < 4 ? types[version.type] : "?");
+		});
+		if (!found) {
+			fprintf(stderr, "No record for the object at %08X\n", object);
+			return 1;
+		}
+		return 0;
+	}
+
+	usage();
+	return 1;
+}
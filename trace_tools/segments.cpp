@@ -0,0 +1,93 @@
+#include "trace_tools.h"
+#include <string.h>
+#include <stdlib.h>
+
+/**
+  * Reads the seek index of a segmented trace (see SegmentIndexEntry in TraceFormat.h).
+  */
+
+static bool read_index(const char *fn, std::vector<SegmentIndexEntry>& entries)
+{
+	FILE *file = fopen(fn, "rb");
+	if (!file) {
+		fprintf(stderr, "%s: cannot open file\n", fn);
+		return false;
+	}
+	SegmentIndexHeader header;
+	if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, SEGMENT_INDEX_MAGIC, sizeof(SEGMENT_INDEX_MAGIC)) != 0
+		|| header.version != SEGMENT_INDEX_VERSION) {
+		fprintf(stderr, "%s: not a segment index\n", fn);
+		fclose(file);
+		return false;
+	}
+	SegmentIndexEntry entry;
+	while (fread(&entry, sizeof(entry), 1, file) == 1) {
+		entries.push_back(entry);
+	}
+	fclose(file);
+	return true;
+}
+
+// Finds the file of a segment: the index doesn't know the format and the compression.
+static std::string segment_file(const std::string& base, uint32_t segment)
+{
+	static const char *extensions[] = { ".json", ".bin", ".json.lz4", ".bin.lz4" };
+	char number[16];
+	sprintf(number, ".%04u", segment);
+	for (const char *extension : extensions) {
+		std::string fn = base + number + extension;
+		FILE *file = fopen(fn.c_str(), "rb");
+		if (file) {
+			fclose(file);
+			return fn;
+		}
+	}
+	return "";
+}
+
+int segments_main(int argc, char **argv)
+{
+	if (argc != 2 && argc != 3) {
+		fprintf(stderr, "Usage: sqtrace segments <trace.idx> [instruction]\n");
+		return 1;
+	}
+	std::vector<SegmentIndexEntry> entries;
+	if (!read_index(argv[1], entries)) {
+		return 1;
+	}
+	std::string base = argv[1];
+	if (base.size() > 4 && base.compare(base.size() - 4, 4, ".idx") == 0) {
+		base.resize(base.size() - 4);
+	}
+
+	if (argc == 2) {
+		for (size_t i = 0; i < entries.size(); i++) {
+			if (i > 0 && entries[i].segment == entries[i - 1].segment) {
+				continue;
+			}
+			std::string fn = segment_file(base, entries[i].segment);
+			printf("segment %u: from instruction %llu, %s\n", entries[i].segment,
+				(unsigned long long)entries[i].instruction, fn.empty() ? "deleted" : fn.c_str());
+		}
+		return 0;
+	}
+
+	// Last indexed instruction at or before the requested one.
+	unsigned long long instruction = strtoull(argv[2], nullptr, 10);
+	const SegmentIndexEntry *found = nullptr;
+	for (const SegmentIndexEntry& entry : entries) {
+		if (entry.instruction > instruction) {
+			break;
+		}
+		found = &entry;
+	}
+	if (!found) {
+		fprintf(stderr, "Instruction %llu isn't in the index.\n", instruction);
+		return 1;
+	}
+	std::string fn = segment_file(base, found->segment);
+	printf("segment %u (%s), offset %llu: instruction %llu, read %llu instructions from there\n",
+		found->segment, fn.empty() ? "deleted" : fn.c_str(), (unsigned long long)found->offset,
+		(unsigned long long)found->instruction, instruction - (unsigned long long)found->instruction);
+	return 0;
+}
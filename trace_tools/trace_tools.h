@@ -0,0 +1,91 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Squirrel trace tools
+  *
+  * ----
+  *
+  * Main include file.
+  */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "TraceFormat.h"
+
+// Sequential reader for the binary traces written by BinaryTraceWriter.
+class BinaryTraceReader
+{
+private:
+	FILE *file;
+	std::vector<std::string> strings;
+	std::string opcodes[256];
+
+	bool read(void *buffer, size_t size);
+	bool readString(std::string& out, uint32_t size);
+
+public:
+	// Current record. record is REC_INSTRUCTION, REC_OBJECT, REC_OBJECT_DELTA, REC_FREED, REC_FRAME
+	// or REC_POOLED_STRING.
+	uint8_t record;
+	BinaryInstructionRecord instruction;
+	BinaryFrameRecord frame;
+	std::vector<BinaryValue> values; // Elements of the TV_ARRAY argument of the current instruction.
+	uint32_t address; // Object or freed object address.
+	uint32_t pooledId; // ID of a pooled string.
+	std::string content; // Object content, delta content, or pooled string.
+
+	BinaryTraceReader();
+	~BinaryTraceReader();
+
+	bool open(const char *fn);
+	// Reads the next instruction or object. The string and opcode records are handled here.
+	// Returns false at the end of the file or on error.
+	bool next();
+
+	const std::string& string(uint32_t id) const;
+	const std::string& opcode(uint8_t op) const;
+};
+
+/**
+  * Full content of the objects of a trace, rebuilt from the object and delta records
+  * (see REC_OBJECT_DELTA in TraceFormat.h). The elements of the tables and arrays are kept
+  * apart, so a delta only replaces the ones it changes.
+  */
+class ObjectStates
+{
+private:
+	struct State
+	{
+		bool hasElements; // The content is a table or an array.
+		std::string prefix; // Content up to the elements
+		std::vector<std::string> elements;
+		std::string suffix; // Content after the elements
+	};
+	std::unordered_map<uint32_t, State> objects;
+
+public:
+	// Object record
+	void object(uint32_t address, const std::string& content);
+	// Delta record. Returns false if there is no table or array to apply it to, or if it is invalid.
+	bool delta(uint32_t address, const std::string& content);
+	void freed(uint32_t address);
+	// Current content of an object. Returns false if it isn't known.
+	bool get(uint32_t address, std::string& content) const;
+};
+
+// SSE2 substring search, used by grep. Returns nullptr if needle isn't in [p, end).
+const char *find_substring(const char *p, const char *end, const char *needle, size_t size);
+
+int convert_main(int argc, char **argv);
+int bench_main(int argc, char **argv);
+int calltree_main(int argc, char **argv);
+int control_main(int argc, char **argv);
+int decompress_main(int argc, char **argv);
+int segments_main(int argc, char **argv);
+int index_main(int argc, char **argv);
+int query_main(int argc, char **argv);
+int grep_main(int argc, char **argv);